@@ -0,0 +1,239 @@
+#ifndef VARINT_ADAPTIVE_HPP
+#define VARINT_ADAPTIVE_HPP
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include "libvarint.hpp"
+
+namespace varint {
+
+#define EVENT_TOLERANCE 1e-13
+#define EVENT_ITERATIONS 60
+
+// Adaptive steps by a Sundman time transformation dt = g(q) dtau. The scheme integrates
+//   L~(q, q') = g(q) (L(q, q'/g(q)) + E0)
+// with the fixed step dtau, where q' = dq/dtau and E0 is the initial energy. On the energy level E0 its
+// trajectories are those of L, the momenta are the same, and each step of the midpoint rule on L~ is the
+// midpoint step of L with h = dtau g(q_1/2) plus the equation that keeps the discrete energy. The monitor g
+// must be positive, small where the motion is fast. The states are yielded at the adaptive steps, or every
+// output time units, by linear interpolation inside a step, which keeps the second order of the midpoint rule
+// in q and p. The scheme takes all the steps, so the Newton, mass solve, mixed precision and constraint settings
+// are forwarded to it, and L itself is only bound for its energy.
+template<class PhaseSpace, class Scheme = HamiltonIntegrator<PhaseSpace> > class AdaptiveIntegrator : public BaseIntegrator<PhaseSpace> {
+private:
+	typedef BaseIntegrator<PhaseSpace> Base;
+public:
+	typedef typename Base::Field Field;
+	// Zero of an event formula, index is the order of addEvent
+	struct Event {
+		unsigned int index;
+		double t;
+		PhaseSpace state;
+	};
+protected:
+	double dtau;
+	double t_end;
+	formula::Formula<Field> monitor;
+	Scheme scheme;
+	double output;
+	double next_output;
+	unsigned int steps;
+	// The last two states of the scheme in physical time, velocities are the chords of the step
+	PhaseSpace previous;
+	PhaseSpace last;
+	double previous_t;
+	double last_t;
+	std::vector< formula::Formula<Field> > events;
+	std::vector<bool> terminal;
+	std::vector<Field> event_values;
+	std::vector<Event> found;
+	bool stopped;
+	static std::vector<std::string> names(const PhaseSpace &space) {
+		std::vector<std::string> ret(space.coordinates);
+		ret.insert(ret.end(), space.velocities.begin(), space.velocities.end());
+		return ret;
+	}
+	static formula::Formula<Field> bound(const formula::Formula<Field> &f, const PhaseSpace &space) {
+		formula::Formula<Field> ret(f);
+		ret.bind(names(space));
+		return ret;
+	}
+	static formula::Formula<Field> transform(const formula::Formula<Field> &L, const formula::Formula<Field> &g, const PhaseSpace &space, Field E0) {
+		std::map<const std::string, std::unique_ptr< formula::Element<Field> > > velocities;
+		for (unsigned int i = 0; i < space.size(); i++) {
+			velocities[space.velocities[i]] = std::unique_ptr< formula::Element<Field> >(new formula::Ratio<Field>(std::unique_ptr< formula::Element<Field> >(new formula::Variable<Field>(space.velocities[i])), g.getRoot()->clone()));
+		}
+		std::unique_ptr< formula::Sum<Field> > energy(new formula::Sum<Field>());
+		energy->append(L.evaluate(velocities));
+		energy->append(std::unique_ptr< formula::Element<Field> >(new formula::Constant<Field>(E0)));
+		std::unique_ptr< formula::Product<Field> > ret(new formula::Product<Field>());
+		ret->append(g.getRoot()->clone());
+		ret->append(std::move(energy));
+		return formula::Formula<Field>(std::move(ret));
+	}
+	// p v - L at the initial state, for E0 before the scheme exists
+	static Field initialEnergy(const formula::Formula<Field> &L, const PhaseSpace &space) {
+		std::map<const std::string, Field> values;
+		for (unsigned int i = 0; i < space.size(); i++) {
+			values[space.coordinates[i]] = space.q[i];
+			values[space.velocities[i]] = space.v[i];
+		}
+		Field ret = -L.nevaluate(values);
+		for (unsigned int i = 0; i < space.size(); i++) ret += space.v[i]*L.derivative(space.velocities[i])->nevaluate(values);
+		return ret;
+	}
+	static PhaseSpace scaled(PhaseSpace space, const formula::Formula<Field> &g) {
+		std::vector<Field> values(space.q);
+		values.insert(values.end(), space.v.begin(), space.v.end());
+		Field factor = g.ievaluate(values);
+		for (unsigned int i = 0; i < space.size(); i++) space.v[i] *= factor;
+		return space;
+	}
+	Field evaluate(const formula::Formula<Field> &f, const PhaseSpace &state) const {
+		std::vector<Field> values(state.q);
+		values.insert(values.end(), state.v.begin(), state.v.end());
+		return f.ievaluate(values);
+	}
+	// State at previous_t + theta (last_t - previous_t), the velocities between the chords of the two steps
+	void interpolate(Field theta, PhaseSpace &out) const {
+		out = last;
+		for (unsigned int i = 0; i < out.size(); i++) {
+			out.q[i] = (1-theta)*previous.q[i] + theta*last.q[i];
+			out.v[i] = (1-theta)*previous.v[i] + theta*last.v[i];
+			out.p[i] = (1-theta)*previous.p[i] + theta*last.p[i];
+		}
+	}
+	// Illinois false position on the interpolated step for a sign change of event a
+	Field locate(unsigned int a, Field fa, Field fb) const {
+		Field lo = 0, hi = 1;
+		PhaseSpace state;
+		int side = 0;
+		for (unsigned int iter = 0; (iter < EVENT_ITERATIONS) && ((hi - lo)*(last_t - previous_t) > EVENT_TOLERANCE); iter++) {
+			Field theta = (lo*fb - hi*fa)/(fb - fa);
+			interpolate(theta, state);
+			Field f = evaluate(events[a], state);
+			if (f == 0) return theta;
+			if ((f < 0) == (fa < 0)) {
+				lo = theta;
+				fa = f;
+				if (side == -1) fb /= 2;
+				side = -1;
+			} else {
+				hi = theta;
+				fb = f;
+				if (side == 1) fa /= 2;
+				side = 1;
+			}
+		}
+		return (lo + hi)/2;
+	}
+	// One step of the scheme, events in it are recorded, a terminal one ends the step at its zero
+	void advance() {
+		previous = last;
+		previous_t = last_t;
+		scheme.step();
+		const PhaseSpace &s = scheme.getPosition();
+		PhaseSpace middle(s);
+		for (unsigned int i = 0; i < s.size(); i++) middle.q[i] = (previous.q[i] + s.q[i])/2;
+		Field h = dtau*evaluate(monitor, middle);
+		last.q = s.q;
+		last.p = s.p;
+		for (unsigned int i = 0; i < s.size(); i++) last.v[i] = (s.q[i] - previous.q[i])/h;
+		last_t += h;
+		steps++;
+		Field first = 2;
+		Event event;
+		for (unsigned int a = 0; a < events.size(); a++) {
+			Field fa = event_values[a], fb = evaluate(events[a], last);
+			event_values[a] = fb;
+			if ((fa == 0) || ((fa < 0) == (fb < 0) && (fb != 0))) continue;
+			Field theta = (fb == 0) ? 1 : locate(a, fa, fb);
+			Event cur = { a, previous_t + theta*(last_t - previous_t), PhaseSpace() };
+			interpolate(theta, cur.state);
+			found.push_back(cur);
+			if (terminal[a] && (theta < first)) {
+				first = theta;
+				event = cur;
+			}
+		}
+		if (first <= 1) {
+			last = event.state;
+			last_t = event.t;
+			stopped = true;
+			this->t1 = event.t;
+		}
+	}
+public:
+	AdaptiveIntegrator(formula::Formula<Field> _L, double _t0, double _t1, double _dtau, PhaseSpace _initial_pos, formula::Formula<Field> _monitor)
+	: BaseIntegrator<PhaseSpace>(_L, _t0, _t1, _initial_pos), dtau(_dtau), t_end(_t1), monitor(bound(_monitor, _initial_pos)),
+	  scheme(transform(_L, _monitor, _initial_pos, initialEnergy(_L, _initial_pos)), 0, std::numeric_limits<double>::infinity(), _dtau, scaled(_initial_pos, monitor)),
+	  output(0), next_output(_t0), steps(0), previous_t(_t0), last_t(_t0), stopped(false) {
+		reset();
+	}
+	// The momenta of the transformed Lagrangian are those of L
+	virtual void reset() {
+		this->position = this->initial_position;
+		this->t = this->t0;
+		this->t1 = t_end;
+		scheme.reset();
+		this->position.p = scheme.getPosition().p;
+		previous = last = this->position;
+		previous_t = last_t = this->t0;
+		next_output = this->t0 + output;
+		steps = 0;
+		stopped = false;
+		found.clear();
+		event_values.resize(events.size());
+		for (unsigned int a = 0; a < events.size(); a++) event_values[a] = evaluate(events[a], last);
+	}
+	// Yield a state every _output time units instead of at every step, 0 for the adaptive steps
+	void setOutput(double _output) { output = _output; next_output = this->t0 + output; }
+	// Records the zeros of e(q, v), a terminal event also ends the integration at its zero
+	void addEvent(const formula::Formula<Field> &e, bool _terminal = false) {
+		events.push_back(bound(e, this->initial_position));
+		terminal.push_back(_terminal);
+		event_values.push_back(evaluate(events.back(), last));
+	}
+	const std::vector<Event>& getEvents() const { return found; }
+	// Steps of the scheme so far, and the length in time of the last one
+	unsigned int getSteps() const { return steps; }
+	double getStep() const { return last_t - previous_t; }
+	// The scheme on the transformed Lagrangian, its time is tau
+	const Scheme& getScheme() const { return scheme; }
+	virtual void setNewtonTolerance(Field _tolerance) { scheme.setNewtonTolerance(_tolerance); }
+	virtual void setNewtonIterations(unsigned int _iterations) { scheme.setNewtonIterations(_iterations); }
+	virtual Kinetic getKinetic() const { return scheme.getKinetic(); }
+	virtual void setMassSolve(bool _enabled) { scheme.setMassSolve(_enabled); }
+	virtual void setMixedPrecision(bool _mixed) { scheme.setMixedPrecision(_mixed); }
+	virtual bool getMixedPrecision() const { return scheme.getMixedPrecision(); }
+	virtual Field getMassBound() const { return scheme.getMassBound(); }
+	virtual Field getSolveError() const { return scheme.getSolveError(); }
+	virtual const SparsePattern & getPattern() const { return scheme.getPattern(); }
+	// g(q) = 0 does not involve the time, the scheme keeps it in tau
+	virtual void addConstraint(const formula::Formula<Field> &g) { scheme.addConstraint(g); }
+	virtual unsigned int numConstraints() const { return scheme.numConstraints(); }
+	virtual void step() {
+		double target = output > 0 ? std::min(next_output, this->t1) : this->t1;
+		if (output > 0) {
+			while ((last_t < target) && !stopped) advance();
+			next_output += output;
+		} else if (!stopped) advance();
+		if (stopped) target = std::min(target, last_t);
+		if (last_t >= target) {
+			Field theta = (last_t > previous_t) ? (target - previous_t)/(last_t - previous_t) : 1;
+			interpolate(theta, this->position);
+			this->t = target;
+		} else {
+			this->position = last;
+			this->t = last_t;
+		}
+	}
+};
+
+}
+
+#endif // VARINT_ADAPTIVE_HPP
@@ -0,0 +1,148 @@
+#ifndef VARINT_ELEMENTARY_HPP
+#define VARINT_ELEMENTARY_HPP
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include "formula.hpp"
+
+namespace varint {
+namespace formula {
+
+#ifndef EL_UPTR
+#define EL_PTR Element<Field> *
+#define EL_UPTR std::unique_ptr< Element<Field> >
+#define ELEMENTARY_UNDEF_MACROS
+#endif
+
+// One loop per function so that the switch stays out of the loop body, with -O3 -ffast-math
+// these loops are vectorized against the vector math library (libmvec, SVML)
+#define ELEMENTARY_MAP(f, expr) case f: for (unsigned int k = 0; k < n; k++) out[k] = expr; break;
+
+// Registry of the built-in elementary functions: names, scalar and batch kernels and partial derivatives.
+// Kernels call the math functions unqualified, so a Field provides them next to its type (see rational.hpp).
+template<class Field> class Elementaries {
+protected:
+	static EL_UPTR num(const Field &value) { return EL_UPTR(new Constant<Field>(value)); }
+	static EL_UPTR call(Elementary f, EL_UPTR arg) { return EL_UPTR(new Function<Field>(f, std::move(arg))); }
+	static EL_UPTR square(EL_UPTR arg) { return EL_UPTR(new Power<Field>(std::move(arg), num(2))); }
+	static EL_UPTR product(EL_UPTR a, EL_UPTR b) {
+		std::vector< EL_UPTR > factors;
+		factors.push_back(std::move(a));
+		factors.push_back(std::move(b));
+		return make_product<Field>(factors);
+	}
+	static EL_UPTR sum(EL_UPTR a, EL_UPTR b) {
+		std::vector< EL_UPTR > parts;
+		parts.push_back(std::move(a));
+		parts.push_back(std::move(b));
+		return make_sum<Field>(parts);
+	}
+	// 1-u^2
+	static EL_UPTR complement(const EL_PTR u) { return sum(num(1), product(num(-1), square(u->clone()))); }
+public:
+	static const char* name(Elementary f) {
+		static const char* const names[ELEMENTARY_COUNT] = { "", "sin", "cos", "tan", "asin", "acos", "atan", "sinh", "cosh", "tanh", "exp", "log", "sqrt", "abs", "atan2", "hypot" };
+		return names[f];
+	}
+	static unsigned int arity(Elementary f) { return ((f == ELEMENTARY_ATAN2) || (f == ELEMENTARY_HYPOT)) ? 2 : 1; }
+	// ELEMENTARY_NONE if no built-in function of that name takes nargs arguments
+	static Elementary find(const std::string &_name, unsigned int nargs) {
+		for (unsigned int f = ELEMENTARY_NONE+1; f < ELEMENTARY_COUNT; f++) {
+			if ((arity(Elementary(f)) == nargs) && (_name == name(Elementary(f)))) return Elementary(f);
+		}
+		return ELEMENTARY_NONE;
+	}
+	// f at args[0..arity(f)-1]
+	static Field scalar(Elementary f, const Field *args) {
+		using std::sin; using std::cos; using std::tan; using std::asin; using std::acos; using std::atan;
+		using std::sinh; using std::cosh; using std::tanh; using std::exp; using std::log; using std::sqrt;
+		using std::abs; using std::atan2; using std::hypot;
+		const Field &x = args[0];
+		switch (f) {
+			case ELEMENTARY_SIN: return sin(x);
+			case ELEMENTARY_COS: return cos(x);
+			case ELEMENTARY_TAN: return tan(x);
+			case ELEMENTARY_ASIN: return asin(x);
+			case ELEMENTARY_ACOS: return acos(x);
+			case ELEMENTARY_ATAN: return atan(x);
+			case ELEMENTARY_SINH: return sinh(x);
+			case ELEMENTARY_COSH: return cosh(x);
+			case ELEMENTARY_TANH: return tanh(x);
+			case ELEMENTARY_EXP: return exp(x);
+			case ELEMENTARY_LOG: return log(x);
+			case ELEMENTARY_SQRT: return sqrt(x);
+			case ELEMENTARY_ABS: return abs(x);
+			case ELEMENTARY_ATAN2: return atan2(x, args[1]);
+			case ELEMENTARY_HYPOT: return hypot(x, args[1]);
+			default: return x;
+		}
+	}
+	// f at n points, argument i of point k is args[i*n+k]
+	static void batch(Elementary f, const Field *args, unsigned int n, Field *out) {
+		using std::sin; using std::cos; using std::tan; using std::asin; using std::acos; using std::atan;
+		using std::sinh; using std::cosh; using std::tanh; using std::exp; using std::log; using std::sqrt;
+		using std::abs; using std::atan2; using std::hypot;
+		const Field *x = args, *y = args+n;
+		switch (f) {
+			ELEMENTARY_MAP(ELEMENTARY_SIN, sin(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_COS, cos(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_TAN, tan(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_ASIN, asin(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_ACOS, acos(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_ATAN, atan(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_SINH, sinh(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_COSH, cosh(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_TANH, tanh(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_EXP, exp(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_LOG, log(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_SQRT, sqrt(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_ABS, abs(x[k]))
+			ELEMENTARY_MAP(ELEMENTARY_ATAN2, atan2(x[k], y[k]))
+			ELEMENTARY_MAP(ELEMENTARY_HYPOT, hypot(x[k], y[k]))
+			default: for (unsigned int k = 0; k < n; k++) out[k] = x[k];
+		}
+	}
+	// Derivative of f with respect to its argument i, as an expression of the arguments
+	static EL_UPTR partial(Elementary f, const std::vector< EL_PTR > &args, unsigned int i) {
+		const EL_PTR u = args[0];
+		switch (f) {
+			case ELEMENTARY_SIN: return call(ELEMENTARY_COS, u->clone());
+			case ELEMENTARY_COS: return product(num(-1), call(ELEMENTARY_SIN, u->clone()));
+			// 1/cos(u)^2
+			case ELEMENTARY_TAN: return EL_UPTR(new Power<Field>(call(ELEMENTARY_COS, u->clone()), num(-2)));
+			// 1/sqrt(1-u^2)
+			case ELEMENTARY_ASIN: return EL_UPTR(new Ratio<Field>(num(1), call(ELEMENTARY_SQRT, complement(u))));
+			case ELEMENTARY_ACOS: return EL_UPTR(new Ratio<Field>(num(-1), call(ELEMENTARY_SQRT, complement(u))));
+			case ELEMENTARY_ATAN: return EL_UPTR(new Ratio<Field>(num(1), sum(num(1), square(u->clone()))));
+			case ELEMENTARY_SINH: return call(ELEMENTARY_COSH, u->clone());
+			case ELEMENTARY_COSH: return call(ELEMENTARY_SINH, u->clone());
+			// 1-tanh(u)^2
+			case ELEMENTARY_TANH: return sum(num(1), product(num(-1), square(call(ELEMENTARY_TANH, u->clone()))));
+			case ELEMENTARY_EXP: return call(ELEMENTARY_EXP, u->clone());
+			case ELEMENTARY_LOG: return EL_UPTR(new Ratio<Field>(num(1), u->clone()));
+			case ELEMENTARY_SQRT: return EL_UPTR(new Ratio<Field>(num(1), product(num(2), call(ELEMENTARY_SQRT, u->clone()))));
+			case ELEMENTARY_ABS: return EL_UPTR(new Ratio<Field>(u->clone(), call(ELEMENTARY_ABS, u->clone())));
+			// atan2(y,x): (x, -y)/(x^2+y^2)
+			case ELEMENTARY_ATAN2: return EL_UPTR(new Ratio<Field>((i == 0) ? args[1]->clone() : product(num(-1), u->clone()), sum(square(u->clone()), square(args[1]->clone()))));
+			// hypot(x,y): (x, y)/hypot(x,y)
+			case ELEMENTARY_HYPOT: {
+				std::array< EL_UPTR, 2 > parts = {{ u->clone(), args[1]->clone() }};
+				return EL_UPTR(new Ratio<Field>(args[i]->clone(), EL_UPTR(new Function<Field, 2>(f, parts))));
+			}
+			default: return num(0);
+		}
+	}
+};
+
+#undef ELEMENTARY_MAP
+#ifdef ELEMENTARY_UNDEF_MACROS
+#undef EL_PTR
+#undef EL_UPTR
+#undef ELEMENTARY_UNDEF_MACROS
+#endif
+
+}
+}
+
+#endif // VARINT_ELEMENTARY_HPP
@@ -0,0 +1,549 @@
+#ifndef VARINT_EXPAND_HPP
+#define VARINT_EXPAND_HPP
+
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include "formula.hpp"
+
+namespace varint {
+namespace formula {
+
+#ifndef EL_UPTR
+#define EL_PTR Element<Field> *
+#define EL_UPTR std::unique_ptr< Element<Field> >
+#define EXPAND_UNDEF_MACROS
+#endif
+
+// Polynomial passes over a formula. Subtrees that are not sums, products, constants or
+// integer powers are atoms; the tree becomes a sparse polynomial in the atoms.
+//  expand   - sum of monomials
+//  together - sum over a common denominator, or common factors of all monomials pulled out of the sum
+//  compress - multivariate Horner form, the cheapest of it and the input to evaluate
+// Products are multiplied term by term into a map of distinct monomials, so the swell of a
+// product is never larger than its result. When a product or a power would exceed max_terms,
+// or the tree is deeper than max_depth, the subtree is kept as an atom.
+template<class Field> class Expander {
+protected:
+	typedef std::vector< std::pair<unsigned int, int> > Monomial;
+	typedef std::map<Monomial, Field> Polynomial;
+	typedef std::vector< std::pair<Monomial, Field> > Terms;
+	struct Atoms {
+		std::map<std::string, unsigned int> ids;
+		std::vector< EL_UPTR > atoms;
+		unsigned int insert(EL_UPTR atom) {
+			std::string key = atom->stringify();
+			auto found = ids.find(key);
+			if (found != ids.end()) return found->second;
+			ids[key] = atoms.size();
+			atoms.push_back(std::move(atom));
+			return atoms.size()-1;
+		}
+	};
+	unsigned int max_terms;
+	unsigned int max_depth;
+	unsigned int threads;
+	static Monomial merge(const Monomial &a, const Monomial &b) {
+		Monomial ret;
+		auto i = a.begin(), j = b.begin();
+		while ((i != a.end()) || (j != b.end())) {
+			if ((j == b.end()) || ((i != a.end()) && (i->first < j->first))) { if (i->second != 0) ret.push_back(*i); i++; }
+			else if ((i == a.end()) || (j->first < i->first)) { if (j->second != 0) ret.push_back(*j); j++; }
+			else {
+				if (i->second + j->second != 0) ret.push_back(std::make_pair(i->first, i->second + j->second));
+				i++;
+				j++;
+			}
+		}
+		return ret;
+	}
+	static void prune(Polynomial &p) {
+		auto term = p.begin();
+		while (term != p.end()) {
+			if (term->second == Field(0)) term = p.erase(term);
+			else term++;
+		}
+	}
+	static void add(Polynomial &to, const Polynomial &from) {
+		for (auto term = from.begin(); term != from.end(); term++) to[term->first] += term->second;
+		prune(to);
+	}
+	bool multiply(const Polynomial &a, const Polynomial &b, Polynomial &out) const {
+		out.clear();
+		for (auto i = a.begin(); i != a.end(); i++) {
+			for (auto j = b.begin(); j != b.end(); j++) {
+				out[merge(i->first, j->first)] += i->second*j->second;
+				if (out.size() > max_terms) return false;
+			}
+		}
+		prune(out);
+		return true;
+	}
+	// Non-negative integer exponent of a power, -1 otherwise
+	long long exponent(const Element<Field> &power) const {
+		const Constant<Field> *value = kind_cast< const Constant<Field> >(power.getChild(POWER_ID));
+		if (!value) return -1;
+		long long n = static_cast<long long>(static_cast<double>(value->getValue()));
+		if ((n < 0) || (Field(n) != value->getValue()) || (n > (long long)max_terms)) return -1;
+		return n;
+	}
+	// Copy of node with every child expanded on its own
+	EL_UPTR rebuild(const Element<Field> &node, unsigned int depth) const {
+		EL_UPTR ret = std::move(node.clone());
+		if (depth >= max_depth) return ret;
+		for (unsigned int i = 0; i < ret->arity(); i++) {
+			EL_PTR child = ret->getChild(i);
+			ret->replaceById(child->getId(), std::move(expanded(*node.getChild(i), depth+1)));
+		}
+		return ret;
+	}
+	void atom(const Element<Field> &node, unsigned int depth, Atoms &atoms, Polynomial &out) const {
+		EL_UPTR a = std::move(rebuild(node, depth));
+		out.clear();
+		if (const Constant<Field> *value = kind_cast< const Constant<Field> >(a.get())) {
+			if (!(value->getValue() == Field(0))) out[Monomial()] = value->getValue();
+			return;
+		}
+		out[Monomial(1, std::make_pair(atoms.insert(std::move(a)), 1))] = Field(1);
+	}
+	void polynomial(const Element<Field> &node, unsigned int depth, Atoms &atoms, Polynomial &out) const {
+		out.clear();
+		if (depth >= max_depth) { atom(node, depth, atoms, out); return; }
+		switch (node.getKind()) {
+		case KIND_CONSTANT: {
+			const Field &value = static_cast<const Constant<Field>&>(node).getValue();
+			if (!(value == Field(0))) out[Monomial()] = value;
+			return;
+		}
+		case KIND_SUM: {
+			Polynomial part;
+			for (unsigned int i = 0; i < node.arity(); i++) {
+				polynomial(*node.getChild(i), depth+1, atoms, part);
+				add(out, part);
+			}
+			return;
+		}
+		case KIND_PRODUCT: {
+			Polynomial acc, factor, next;
+			acc[Monomial()] = Field(1);
+			for (unsigned int i = 0; i < node.arity(); i++) {
+				polynomial(*node.getChild(i), depth+1, atoms, factor);
+				if (!multiply(acc, factor, next)) { atom(node, depth, atoms, out); return; }
+				acc.swap(next);
+			}
+			out.swap(acc);
+			return;
+		}
+		case KIND_POWER: {
+			long long n = exponent(node);
+			if (n < 0) break;
+			Polynomial base, square, next;
+			polynomial(*node.getChild(EXPRESSION_ID), depth+1, atoms, base);
+			out[Monomial()] = Field(1);
+			while (n > 0) {
+				if (n % 2) {
+					if (!multiply(out, base, next)) { atom(node, depth, atoms, out); return; }
+					out.swap(next);
+				}
+				n /= 2;
+				if (n > 0) {
+					if (!multiply(base, base, square)) { atom(node, depth, atoms, out); return; }
+					base.swap(square);
+				}
+			}
+			return;
+		}
+		default:
+			break;
+		}
+		atom(node, depth, atoms, out);
+	}
+	EL_UPTR build(const Monomial &m, const Field &coefficient, const Atoms &atoms) const {
+		std::vector< EL_UPTR > factors;
+		factors.push_back(EL_UPTR(new Constant<Field>(coefficient)));
+		for (auto a = m.begin(); a != m.end(); a++) {
+			if (a->second == 1) factors.push_back(std::move(atoms.atoms[a->first]->clone()));
+			else factors.push_back(EL_UPTR(new Power<Field>(std::move(atoms.atoms[a->first]->clone()), EL_UPTR(new Constant<Field>(a->second)))));
+		}
+		return make_product<Field>(factors);
+	}
+	EL_UPTR build(const Terms &terms, const Atoms &atoms) const {
+		std::vector< EL_UPTR > parts;
+		for (auto term = terms.begin(); term != terms.end(); term++) parts.push_back(std::move(build(term->first, term->second, atoms)));
+		return make_sum<Field>(parts);
+	}
+	EL_UPTR expanded(const Element<Field> &node, unsigned int depth) const {
+		Atoms atoms;
+		Polynomial p;
+		polynomial(node, depth, atoms, p);
+		return build(Terms(p.begin(), p.end()), atoms);
+	}
+	// Outer sum split over threads, every thread has its own atoms, merged by their printed form
+	void parallel(const Element<Field> &node, Atoms &atoms, Polynomial &out) const {
+		std::vector<Atoms> local(threads);
+		std::vector<Polynomial> parts(threads);
+		std::vector<std::thread> workers;
+		for (unsigned int t = 0; t < threads; t++) {
+			workers.push_back(std::thread([this, &node, &local, &parts, t]() {
+				Polynomial part;
+				for (unsigned int i = t; i < node.arity(); i += threads) {
+					polynomial(*node.getChild(i), 1, local[t], part);
+					add(parts[t], part);
+				}
+			}));
+		}
+		for (auto worker = workers.begin(); worker != workers.end(); worker++) worker->join();
+		out.clear();
+		for (unsigned int t = 0; t < threads; t++) {
+			std::vector<unsigned int> ids(local[t].atoms.size());
+			for (unsigned int k = 0; k < ids.size(); k++) ids[k] = atoms.insert(std::move(local[t].atoms[k]));
+			for (auto term = parts[t].begin(); term != parts[t].end(); term++) {
+				Monomial m(term->first);
+				for (auto a = m.begin(); a != m.end(); a++) a->first = ids[a->first];
+				std::sort(m.begin(), m.end());
+				out[m] += term->second;
+			}
+		}
+		prune(out);
+	}
+	void polynomial(const Element<Field> &node, Atoms &atoms, Polynomial &out) const {
+		if ((threads > 1) && (node.getKind() == KIND_SUM) && (node.arity() >= threads)) parallel(node, atoms, out);
+		else polynomial(node, 0, atoms, out);
+	}
+	EL_UPTR horner(const Terms &terms, const Atoms &atoms) const {
+		std::map<unsigned int, unsigned int> count;
+		for (auto term = terms.begin(); term != terms.end(); term++) {
+			for (auto a = term->first.begin(); a != term->first.end(); a++) if (a->second > 0) count[a->first]++;
+		}
+		unsigned int best = 0, best_count = 1;
+		for (auto c = count.begin(); c != count.end(); c++) {
+			if (c->second > best_count) { best = c->first; best_count = c->second; }
+		}
+		if (best_count < 2) return build(terms, atoms);
+		int e = 0;
+		for (auto term = terms.begin(); term != terms.end(); term++) {
+			for (auto a = term->first.begin(); a != term->first.end(); a++) {
+				if ((a->first == best) && (a->second > 0) && ((e == 0) || (a->second < e))) e = a->second;
+			}
+		}
+		Terms with, without;
+		for (auto term = terms.begin(); term != terms.end(); term++) {
+			Monomial m;
+			bool found = false;
+			for (auto a = term->first.begin(); a != term->first.end(); a++) {
+				if ((a->first == best) && (a->second > 0)) {
+					found = true;
+					if (a->second > e) m.push_back(std::make_pair(a->first, a->second - e));
+				} else m.push_back(*a);
+			}
+			if (found) with.push_back(std::make_pair(m, term->second));
+			else without.push_back(*term);
+		}
+		std::vector< EL_UPTR > factors, parts;
+		factors.push_back(std::move(build(Monomial(1, std::make_pair(best, e)), Field(1), atoms)));
+		factors.push_back(std::move(horner(with, atoms)));
+		parts.push_back(std::move(make_product<Field>(factors)));
+		if (!without.empty()) parts.push_back(std::move(horner(without, atoms)));
+		return make_sum<Field>(parts);
+	}
+	// Multivariate gcd over the coefficient field by recursion on the atoms: the content is the
+	// gcd of the coefficients in the lowest atom, the primitive parts go through a primitive
+	// pseudo-remainder sequence. Every division is checked to be exact, so a Field that rounds
+	// makes gcd fail rather than return a wrong factor.
+	static bool lexLess(const Monomial &a, const Monomial &b) {
+		auto i = a.begin(), j = b.begin();
+		while ((i != a.end()) && (j != b.end())) {
+			if (i->first != j->first) return j->first < i->first;
+			if (i->second != j->second) return i->second < j->second;
+			i++;
+			j++;
+		}
+		return (i == a.end()) && (j != b.end());
+	}
+	static typename Polynomial::const_iterator leading(const Polynomial &p) {
+		auto ret = p.begin();
+		for (auto term = p.begin(); term != p.end(); term++) if (lexLess(ret->first, term->first)) ret = term;
+		return ret;
+	}
+	static bool constant(const Polynomial &p) { return p.empty() || ((p.size() == 1) && p.begin()->first.empty()); }
+	static int degree(const Polynomial &p, unsigned int v) {
+		int ret = 0;
+		for (auto term = p.begin(); term != p.end(); term++) {
+			for (auto a = term->first.begin(); a != term->first.end(); a++) if (a->first == v) ret = std::max(ret, a->second);
+		}
+		return ret;
+	}
+	// Lowest atom in a or b, false for constants
+	static bool lowest(const Polynomial &a, const Polynomial &b, unsigned int &v) {
+		bool found = false;
+		const Polynomial *both[] = { &a, &b };
+		for (unsigned int k = 0; k < 2; k++) {
+			for (auto term = both[k]->begin(); term != both[k]->end(); term++) {
+				if (!term->first.empty() && (!found || (term->first[0].first < v))) { v = term->first[0].first; found = true; }
+			}
+		}
+		return found;
+	}
+	// Coefficient of v^k, v removed from the monomials
+	static void coefficient(const Polynomial &p, unsigned int v, int k, Polynomial &out) {
+		out.clear();
+		for (auto term = p.begin(); term != p.end(); term++) {
+			Monomial m;
+			int e = 0;
+			for (auto a = term->first.begin(); a != term->first.end(); a++) {
+				if (a->first == v) e = a->second;
+				else m.push_back(*a);
+			}
+			if (e == k) out[m] = term->second;
+		}
+	}
+	static void scale(Polynomial &p, const Monomial &m, const Field &c) {
+		Polynomial ret;
+		for (auto term = p.begin(); term != p.end(); term++) ret[merge(term->first, m)] = term->second*c;
+		p.swap(ret);
+		prune(p);
+	}
+	bool subtract(Polynomial &a, const Polynomial &b) const {
+		for (auto term = b.begin(); term != b.end(); term++) a[term->first] -= term->second;
+		prune(a);
+		return a.size() <= max_terms;
+	}
+	// q = a/b when b divides a exactly
+	bool divide(const Polynomial &a, const Polynomial &b, Polynomial &q) const {
+		q.clear();
+		if (b.empty()) return false;
+		auto lb = leading(b);
+		Monomial inverse(lb->first);
+		for (auto x = inverse.begin(); x != inverse.end(); x++) x->second = -x->second;
+		Polynomial r(a), t;
+		while (!r.empty()) {
+			auto lr = leading(r);
+			Monomial m = merge(lr->first, inverse);
+			for (auto x = m.begin(); x != m.end(); x++) if (x->second < 0) return false;
+			Field c = lr->second/lb->second;
+			Monomial erased = lr->first;
+			q[m] += c;
+			t = b;
+			scale(t, m, c);
+			if (!subtract(r, t) || (q.size() > max_terms)) return false;
+			r.erase(erased);
+		}
+		Polynomial check;
+		if (!multiply(q, b, check)) return false;
+		return check == a;
+	}
+	// Pseudo-remainder of a by b in v
+	bool remainder(const Polynomial &a, const Polynomial &b, unsigned int v, Polynomial &r) const {
+		int db = degree(b, v);
+		Polynomial lb, lr, t;
+		coefficient(b, v, db, lb);
+		r = a;
+		while (!r.empty() && (degree(r, v) >= db)) {
+			int dr = degree(r, v);
+			coefficient(r, v, dr, lr);
+			Polynomial next;
+			if (!multiply(r, lb, next)) return false;
+			if (!multiply(b, lr, t)) return false;
+			scale(t, Monomial(1, std::make_pair(v, dr-db)), Field(1));
+			if (!subtract(next, t)) return false;
+			r.swap(next);
+		}
+		return true;
+	}
+	bool content(const Polynomial &p, unsigned int v, Polynomial &c) const {
+		Polynomial k, g;
+		c.clear();
+		for (int e = 0; e <= degree(p, v); e++) {
+			coefficient(p, v, e, k);
+			if (k.empty()) continue;
+			if (!gcd(c, k, g)) return false;
+			c.swap(g);
+		}
+		return true;
+	}
+	bool primitive(const Polynomial &p, unsigned int v, Polynomial &out) const {
+		Polynomial c;
+		return content(p, v, c) && divide(p, c, out);
+	}
+	void normalize(Polynomial &p) const {
+		if (p.empty()) return;
+		Field lc = leading(p)->second;
+		scale(p, Monomial(), Field(1)/lc);
+	}
+	bool gcd(const Polynomial &a, const Polynomial &b, Polynomial &g) const {
+		unsigned int v = 0;
+		if (a.empty() || b.empty()) {
+			g = a.empty() ? b : a;
+			Polynomial check(g), q;
+			normalize(g);
+			return g.empty() || divide(check, g, q);
+		}
+		g.clear();
+		if (!lowest(a, b, v)) { g[Monomial()] = Field(1); return true; }
+		Polynomial ca, cb, pa, pb, r;
+		if (degree(a, v) == 0) return content(b, v, cb) && gcd(a, cb, g);
+		if (degree(b, v) == 0) return content(a, v, ca) && gcd(ca, b, g);
+		if (!content(a, v, ca) || !content(b, v, cb) || !divide(a, ca, pa) || !divide(b, cb, pb)) return false;
+		if (degree(pa, v) < degree(pb, v)) pa.swap(pb);
+		while (!pb.empty()) {
+			if (!remainder(pa, pb, v, r)) return false;
+			pa.swap(pb);
+			if (r.empty()) break;
+			if (degree(r, v) == 0) {
+				pa.clear();
+				pa[Monomial()] = Field(1);
+				break;
+			}
+			if (!primitive(r, v, pb)) return false;
+		}
+		Polynomial pg, cg;
+		if (!primitive(pa, v, pg) || !gcd(ca, cb, cg) || !multiply(pg, cg, g)) return false;
+		normalize(g);
+		return true;
+	}
+	// num/den as polynomials, cancelled and with a monic denominator, false if nothing cancels
+	bool cancel(Polynomial &num, Polynomial &den) const {
+		Polynomial g, q;
+		if (den.empty() || !gcd(num, den, g)) return false;
+		bool changed = !constant(g);
+		if (changed) {
+			if (!divide(num, g, q)) return false;
+			num.swap(q);
+			if (!divide(den, g, q)) return false;
+			den.swap(q);
+		}
+		Field lc = leading(den)->second;
+		if (!(lc == Field(1))) {
+			Polynomial unit;
+			unit[Monomial()] = lc;
+			if (!divide(num, unit, q)) return changed;
+			Polynomial n(q);
+			if (!divide(den, unit, q)) return changed;
+			num.swap(n);
+			den.swap(q);
+			changed = changed || constant(den);
+		}
+		return changed;
+	}
+	EL_UPTR quotient(const Polynomial &num, const Polynomial &den, const Atoms &atoms) const {
+		EL_UPTR top = std::move(horner(Terms(num.begin(), num.end()), atoms));
+		if (constant(den)) return top;
+		return EL_UPTR(new Ratio<Field>(std::move(top), std::move(horner(Terms(den.begin(), den.end()), atoms))));
+	}
+public:
+	Expander(unsigned int _max_terms = DEFAULT_EXPAND_TERMS, unsigned int _max_depth = DEFAULT_EXPAND_DEPTH, unsigned int _threads = 1)
+	: max_terms(_max_terms), max_depth(_max_depth), threads(_threads) {}
+	EL_UPTR expand(const Element<Field> &node) const {
+		Atoms atoms;
+		Polynomial p;
+		polynomial(node, atoms, p);
+		return build(Terms(p.begin(), p.end()), atoms);
+	}
+	// Common factors of numerator and denominator of a Ratio cancelled, nullptr if there are none
+	EL_UPTR cancel(const Element<Field> &ratio) const {
+		Atoms atoms;
+		Polynomial num, den;
+		polynomial(*ratio.getChild(0), 0, atoms, num);
+		polynomial(*ratio.getChild(1), 0, atoms, den);
+		if (num.empty() && !den.empty()) return EL_UPTR(new Constant<Field>(0));
+		if (!cancel(num, den)) return nullptr;
+		return quotient(num, den, atoms);
+	}
+	// Terms of a sum over the least common denominator of its ratios, nullptr if the sum has
+	// no ratio, the budgets are exceeded or, with cheaper set, the result is not cheaper to evaluate
+	EL_UPTR combine(const Element<Field> &sum, bool cheaper = true) const {
+		Atoms atoms;
+		Polynomial num, den, part, g, q, t;
+		std::vector<Polynomial> nums, dens;
+		for (unsigned int i = 0; i < sum.arity(); i++) {
+			const Element<Field> &term = *sum.getChild(i);
+			if (term.getKind() != KIND_RATIO) {
+				polynomial(term, 1, atoms, part);
+				add(num, part);
+				continue;
+			}
+			nums.push_back(Polynomial());
+			dens.push_back(Polynomial());
+			polynomial(*term.getChild(0), 1, atoms, nums.back());
+			polynomial(*term.getChild(1), 1, atoms, dens.back());
+			if (dens.back().empty()) return nullptr;
+		}
+		if (dens.empty()) return nullptr;
+		den = dens[0];
+		for (unsigned int k = 1; k < dens.size(); k++) {
+			if (!gcd(den, dens[k], g) || !divide(dens[k], g, q) || !multiply(den, q, t)) return nullptr;
+			den.swap(t);
+		}
+		if (!multiply(num, den, t)) return nullptr;
+		num.swap(t);
+		for (unsigned int k = 0; k < dens.size(); k++) {
+			if (!divide(den, dens[k], q) || !multiply(nums[k], q, t)) return nullptr;
+			add(num, t);
+		}
+		cancel(num, den);
+		EL_UPTR ret = std::move(quotient(num, den, atoms));
+		if (cheaper && (operations(*ret) >= operations(sum))) return nullptr;
+		return ret;
+	}
+	EL_UPTR together(const Element<Field> &node) const {
+		if (node.getKind() == KIND_SUM) {
+			EL_UPTR combined = std::move(combine(node, false));
+			if (combined) return combined;
+		}
+		Atoms atoms;
+		Polynomial p;
+		polynomial(node, atoms, p);
+		Terms terms(p.begin(), p.end());
+		if (terms.size() < 2) return build(terms, atoms);
+		Monomial common;
+		for (auto a = terms[0].first.begin(); a != terms[0].first.end(); a++) {
+			int e = a->second;
+			for (auto term = terms.begin(); (term != terms.end()) && (e > 0); term++) {
+				auto found = std::find_if(term->first.begin(), term->first.end(), [&a](const std::pair<unsigned int, int> &b) { return b.first == a->first; });
+				e = (found == term->first.end()) ? 0 : std::min(e, found->second);
+			}
+			if (e > 0) common.push_back(std::make_pair(a->first, e));
+		}
+		Field coefficient = terms[0].second;
+		for (auto term = terms.begin(); term != terms.end(); term++) if (!(term->second == coefficient)) coefficient = Field(1);
+		if (common.empty() && (coefficient == Field(1))) return build(terms, atoms);
+		Monomial inverse(common);
+		for (auto a = inverse.begin(); a != inverse.end(); a++) a->second = -a->second;
+		for (auto term = terms.begin(); term != terms.end(); term++) {
+			term->first = merge(term->first, inverse);
+			term->second = term->second/coefficient;
+		}
+		std::vector< EL_UPTR > factors;
+		factors.push_back(std::move(build(common, coefficient, atoms)));
+		factors.push_back(std::move(build(terms, atoms)));
+		return make_product<Field>(factors);
+	}
+	EL_UPTR compress(const Element<Field> &node) const {
+		Atoms atoms;
+		Polynomial p;
+		polynomial(node, atoms, p);
+		EL_UPTR ret = std::move(horner(Terms(p.begin(), p.end()), atoms));
+		if (operations(*ret) < operations(node)) return ret;
+		return node.clone();
+	}
+	// Binary operations needed to evaluate node
+	static unsigned int operations(const Element<Field> &node) {
+		unsigned int ret = (node.arity() > 1) ? node.arity()-1 : node.arity();
+		for (unsigned int i = 0; i < node.arity(); i++) ret += operations(*node.getChild(i));
+		return ret;
+	}
+};
+
+#ifdef EXPAND_UNDEF_MACROS
+#undef EL_PTR
+#undef EL_UPTR
+#undef EXPAND_UNDEF_MACROS
+#endif
+
+}
+}
+
+#endif // VARINT_EXPAND_HPP
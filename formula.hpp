@@ -5,10 +5,18 @@
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <set>
 #include <cmath>
 #include <algorithm>
 #include <memory>
 #include <tuple>
+#include <array>
+#include <string>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_set>
+#include "quadrature.hpp"
+#include "smallvector.hpp"
 
 namespace varint {
 namespace formula {
@@ -19,6 +27,13 @@ namespace formula {
 #define VA_UPTR std::unique_ptr< Variable<Field> >
 
 #define DEFAULT_POWER_PRECISION -6 // 10^(-6)
+#define DEFAULT_EXPAND_TERMS 4096
+#define DEFAULT_EXPAND_DEPTH 32
+#define DEFAULT_SERIES_TERMS 100000
+#define DEFAULT_SERIES_ORDER 12
+#define COLLECTION_INLINE_TERMS 4 // terms stored inside the node
+// FORMULA_PROFILE, defined for the whole program, compiles the Profiler hooks into nevaluate, ievaluate and
+// bevaluate. Without it the hooks cost nothing and a Profiler cannot be put in use.
 
 // Forward definitions
 template<class Field> class Element;
@@ -29,6 +44,17 @@ template<class Field> class Sum;
 template<class Field> class Product;
 template<class Field> class Power;
 template<class Field> class Ratio;
+template<class Field> class Substitution;
+template<class Field> class Rewriter;
+template<class Field> class Expander;
+template<class Field> class Profiler;
+
+// Node kinds, a cheap tag to dispatch on instead of dynamic_cast. KIND_ANY is only used in rewrite patterns.
+enum Kind { KIND_ANY, KIND_CONSTANT, KIND_VARIABLE, KIND_SUM, KIND_PRODUCT, KIND_RATIO, KIND_FUNCTION, KIND_POWER, KIND_SERIES, KIND_SUBSTITUTION, KIND_FORMULA, KIND_INTEGRAL, KIND_PAIRS, KIND_OTHER, KIND_COUNT };
+template<class Target, class Field> Target* kind_cast(Element<Field> *el);
+// Built-in elementary functions, see elementary.hpp
+enum Elementary { ELEMENTARY_NONE, ELEMENTARY_SIN, ELEMENTARY_COS, ELEMENTARY_TAN, ELEMENTARY_ASIN, ELEMENTARY_ACOS, ELEMENTARY_ATAN, ELEMENTARY_SINH, ELEMENTARY_COSH, ELEMENTARY_TANH, ELEMENTARY_EXP, ELEMENTARY_LOG, ELEMENTARY_SQRT, ELEMENTARY_ABS, ELEMENTARY_ATAN2, ELEMENTARY_HYPOT, ELEMENTARY_COUNT };
+template<class Field> class Elementaries;
 
 template<class Field> struct Intersection {
 	EL_UPTR common;
@@ -37,6 +63,8 @@ template<class Field> struct Intersection {
 };
 
 template<class Field> EL_UPTR solve_for(const EL_UPTR& expression) { return nullptr; }
+template<class Field> EL_UPTR make_sum(std::vector< EL_UPTR > &terms);
+template<class Field> EL_UPTR make_product(std::vector< EL_UPTR > &terms);
 
 template<class Field> class Combiner {
 public:
@@ -44,6 +72,8 @@ public:
 	virtual EL_UPTR combine(const EL_UPTR &el1, const EL_UPTR &el2) const { return nullptr; }
 	virtual Field initial() const { return 0; }
 	virtual std::string symbol() const { return ""; }
+	// Kind of the collections built with this combiner
+	virtual Kind kind() const { return KIND_OTHER; }
 };
 
 template<class Field> class Addition : public Combiner<Field> {
@@ -59,6 +89,7 @@ public:
 	}
 	virtual Field initial() const { return 0; }
 	virtual std::string symbol() const { return "+"; }
+	virtual Kind kind() const { return KIND_SUM; }
 };
 
 template<class Field> class Multiplication : public Combiner<Field> {
@@ -66,8 +97,8 @@ public:
 	virtual Field combine(Field a, Field b) const { return a*b; }
 	virtual EL_UPTR combine(const EL_UPTR &el1, const EL_UPTR &el2) const {
 		std::unique_ptr< Power<Field> > ret = std::unique_ptr< Power<Field> >(new Power<Field>());
-		Power<Field> *tmpPow1 = dynamic_cast<Power<Field>*>(el1.get());
-		Power<Field> *tmpPow2 = dynamic_cast<Power<Field>*>(el2.get());
+		Power<Field> *tmpPow1 = kind_cast< Power<Field> >(el1.get());
+		Power<Field> *tmpPow2 = kind_cast< Power<Field> >(el2.get());
 		std::unique_ptr< Sum<Field> > sum = std::unique_ptr< Sum<Field> >(new Sum<Field>());
 		EL_UPTR term1, term2, expr;
 		if (tmpPow1 != nullptr) {
@@ -92,25 +123,208 @@ public:
 	}
 	virtual Field initial() const { return 1; }	
 	virtual std::string symbol() const { return "*"; }
+	virtual Kind kind() const { return KIND_PRODUCT; }
 };
 
+// Set of variable slots a subtree depends on, the first word is stored inline so that
+// formulas in up to 64 variables allocate nothing per node
+class Dependencies {
+protected:
+	unsigned long first;
+	std::unique_ptr< std::vector<unsigned long> > more;
+	enum { WORD = 8*sizeof(unsigned long) };
+	unsigned long word(unsigned int i) const { return i ? (more && (i <= more->size()) ? (*more)[i-1] : 0) : first; }
+	unsigned int words() const { return more ? more->size()+1 : 1; }
+public:
+	Dependencies() : first(0) {}
+	Dependencies(const Dependencies &other) : first(other.first), more(other.more ? new std::vector<unsigned long>(*other.more) : nullptr) {}
+	Dependencies& operator = (const Dependencies &other) {
+		first = other.first;
+		more.reset(other.more ? new std::vector<unsigned long>(*other.more) : nullptr);
+		return *this;
+	}
+	void clear() { first = 0; more.reset(); }
+	void set(unsigned int i) {
+		if (i < WORD) {
+			first |= 1UL << i;
+			return;
+		}
+		if (!more) more.reset(new std::vector<unsigned long>());
+		if (i/WORD > more->size()) more->resize(i/WORD, 0);
+		(*more)[i/WORD-1] |= 1UL << (i%WORD);
+	}
+	bool test(unsigned int i) const { return word(i/WORD) & (1UL << (i%WORD)); }
+	void merge(const Dependencies &other) {
+		first |= other.first;
+		if (!other.more) return;
+		if (!more) more.reset(new std::vector<unsigned long>());
+		if (other.more->size() > more->size()) more->resize(other.more->size(), 0);
+		for (unsigned int i = 0; i < other.more->size(); i++) (*more)[i] |= (*other.more)[i];
+	}
+	bool intersects(const Dependencies &other) const {
+		if (first & other.first) return true;
+		if (!more || !other.more) return false;
+		unsigned int n = std::min(more->size(), other.more->size());
+		for (unsigned int i = 0; i < n; i++) if ((*more)[i] & (*other.more)[i]) return true;
+		return false;
+	}
+	bool empty() const {
+		for (unsigned int i = 0; i < words(); i++) if (word(i)) return false;
+		return true;
+	}
+};
+
+// Interned name: every distinct string is stored once for the whole program and nodes hold a pointer
+// to it, equal names are equal pointers. The table only grows.
+class Symbol {
+protected:
+	const std::string *name;
+	static const std::string* intern(const std::string &_name) {
+		static std::mutex lock;
+		static std::unordered_set<std::string> table;
+		std::lock_guard<std::mutex> guard(lock);
+		return &*table.insert(_name).first;
+	}
+public:
+	Symbol(const std::string &_name = std::string()) : name(intern(_name)) {}
+	Symbol(const char *_name) : name(intern(_name)) {}
+	const std::string& str() const { return *name; }
+	bool operator == (const Symbol &other) const { return name == other.name; }
+	bool operator != (const Symbol &other) const { return name != other.name; }
+};
+
+// Evaluation state of a frozen tree owned by one thread: subtree values by node number. While a scratch
+// is current on a thread, ievaluate keeps its cache there and nodes are only read.
+template<class Field> class Scratch {
+public:
+	std::vector<Field> cache;
+	std::vector<char> cached;
+	// Values of the previous evaluation of each root
+	std::vector< std::vector<Field> > last_values;
+	Scratch(unsigned int nodes = 0, unsigned int roots = 0) : cache(nodes), cached(nodes, 0), last_values(roots) {}
+	static Scratch<Field>*& current() {
+		static thread_local Scratch<Field> *ret = nullptr;
+		return ret;
+	}
+	// Makes a scratch current on this thread while in scope
+	class Use {
+	protected:
+		Scratch<Field> *previous;
+	public:
+		Use(Scratch<Field> &scratch) : previous(current()) { current() = &scratch; }
+		~Use() { current() = previous; }
+	};
+};
+
+// Members are ordered by size so that a node carries no padding
 template<class Field> class Element {
 protected:
-	unsigned int id;
 	EL_PTR parent;
+	// Incremental evaluation: variables this subtree depends on and its last value
+	Dependencies deps;
+	mutable Field cache;
+	unsigned int id;
+	// Position in the scratch of a frozen tree, -1 if not frozen
+	int node;
+	unsigned char kind;
+	mutable bool cached;
 public:
-	Element(EL_PTR _parent = nullptr) : id(0), parent(_parent) {}
-	Element(Element<Field> const &other) {}
+	Element(EL_PTR _parent = nullptr) : parent(_parent), cache(), id(0), node(-1), kind(KIND_OTHER), cached(false) {}
+	Element(Element<Field> const &other) : parent(nullptr), cache(), id(0), node(-1), kind(other.getKind()), cached(false) {}
+	virtual ~Element() {}
 	void setParent(EL_PTR _parent) { parent = _parent; }
+	EL_PTR getParent() const { return parent; }
+	Kind getKind() const { return (Kind)kind; }
+	// Children in a fixed order, getChild(i)->getId() is what replaceById expects
+	virtual unsigned int arity() const { return 0; }
+	virtual EL_PTR getChild(unsigned int i) const { return nullptr; }
 	virtual void canonify() {}
 	virtual EL_UPTR clone(bool empty=false) const = 0;
 	virtual Intersection<Field> intersect(const EL_UPTR& with, const Combiner<Field> &combiner ) const {
 		return { nullptr, std::move(this->clone()), std::move(with->clone()) };
 	} 
 	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const = 0;
-	virtual Field nevaluate(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const { return 0; }
+	// Lazy evaluate(): a view on this tree, the tree must outlive the view
+	virtual EL_UPTR substitute(const std::map<const std::string, EL_SPTR > &values) const { return EL_UPTR(new Substitution<Field>(this, values)); }
+	// Value with the variables given by name, power_precision is the accuracy of series and integrals
+	Field nevaluate(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const {
+#ifdef FORMULA_PROFILE
+		if (Profiler<Field> *profiler = Profiler<Field>::current()) {
+			typename Profiler<Field>::Probe probe(*profiler, this, 1);
+			return ncompute(std::move(values), power_precision);
+		}
+#endif
+		return ncompute(std::move(values), power_precision);
+	}
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const { return 0; }
+	// Binds variables to slots of the value vector used by ievaluate, clones come back unbound
+	virtual void bind(const std::map<const std::string, unsigned int> &index) { deps.clear(); cached = false; }
+	// Recomputes the subtree only if one of its variables is in changed
+	Field ievaluate(const std::vector<Field> &values, const Dependencies &changed) const {
+		if (Scratch<Field> *scratch = Scratch<Field>::current()) {
+			if ((node < 0) || ((unsigned int)node >= scratch->cache.size())) return recompute(values, changed);
+			if (scratch->cached[node] && !deps.intersects(changed)) return hit(scratch->cache[node]);
+			scratch->cache[node] = recompute(values, changed);
+			scratch->cached[node] = 1;
+			return scratch->cache[node];
+		}
+		if (cached && !deps.intersects(changed)) return hit(cache);
+		cache = recompute(values, changed);
+		cached = true;
+		return cache;
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const { return 0; }
+protected:
+	// icompute and cache hits as seen by the profiler running on this thread, if any
+	Field recompute(const std::vector<Field> &values, const Dependencies &changed) const {
+#ifdef FORMULA_PROFILE
+		if (Profiler<Field> *profiler = Profiler<Field>::current()) {
+			typename Profiler<Field>::Probe probe(*profiler, this, 1);
+			return icompute(values, changed);
+		}
+#endif
+		return icompute(values, changed);
+	}
+	const Field& hit(const Field &value) const {
+#ifdef FORMULA_PROFILE
+		if (Profiler<Field> *profiler = Profiler<Field>::current()) profiler->hit(this);
+#endif
+		return value;
+	}
+public:
+	const Dependencies& getDependencies() const { return deps; }
+	// Numbers the nodes for a Scratch and computes whatever nodes would otherwise compute lazily,
+	// after this the subtree must not be changed
+	virtual void freeze(unsigned int &next) {
+		node = next++;
+		for (unsigned int i = 0; i < arity(); i++) getChild(i)->freeze(next);
+	}
+	int getNode() const { return node; }
+	// Batched evaluation at n points of bound variables, values[slot*n+k] is the value of slot at point k
+	void bevaluate(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const {
+#ifdef FORMULA_PROFILE
+		if (Profiler<Field> *profiler = Profiler<Field>::current()) {
+			typename Profiler<Field>::Probe probe(*profiler, this, n);
+			bcompute(values, n, out);
+			return;
+		}
+#endif
+		bcompute(values, n, out);
+	}
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const {
+		std::vector<Field> point(n ? values.size()/n : 0);
+		Dependencies all;
+		for (unsigned int i = 0; i < point.size(); i++) all.set(i);
+		out.resize(n);
+		for (unsigned int k = 0; k < n; k++) {
+			for (unsigned int i = 0; i < point.size(); i++) point[i] = values[i*n+k];
+			out[k] = icompute(point, all);
+		}
+	}
+	virtual EL_UPTR derivative(const std::string &name) const { return EL_UPTR(new Constant<Field>(0)); }
 	virtual std::ostream& print(std::ostream& os) const { os<<""; return os; }
-	virtual void simplifyObject() {}
+	// Applies the standard rewrite rules to the subtree, the node itself is replaced through its parent
+	virtual void simplifyObject() { Rewriter<Field>::standard().simplify(*this); }
 	virtual const std::string stringify() const {
 		std::ostringstream stream;
 		this->print(stream);
@@ -122,6 +336,7 @@ public:
 	void setId(const unsigned int _id) { id = _id; }
 	const unsigned int getId() const { return id; }
 	virtual void collect() {}
+	virtual void variables(std::set<std::string> &names) const {}
 	virtual void replaceById(const unsigned int id, EL_UPTR elem) {}
 	void replace(const EL_UPTR& elem1, EL_UPTR elem2) { this->replaceById(elem1->getId(), std::move(elem2)); }
 	virtual void remove(const EL_UPTR& elem) { this->removeById(elem->getId()); }
@@ -139,6 +354,9 @@ public:
 	}
 };
 
+// Downcast checked through the kind tag, nullptr if el is of another kind
+template<class Target, class Field> Target* kind_cast(Element<Field> *el) { return (el && (el->getKind() == Target::KIND)) ? static_cast<Target*>(el) : nullptr; }
+
 template<class Field, class Derived> class CloneableElement:public Element<Field> {
 public:
 	CloneableElement(EL_PTR _parent=nullptr) : Element<Field>(_parent) {}
@@ -151,11 +369,14 @@ private:
 protected:
 	Field value;
 public:
-	Constant(const Field _value = 0, EL_PTR _parent=nullptr) : value(_value), Base(_parent) {}
+	static const Kind KIND = KIND_CONSTANT;
+	Constant(const Field _value = 0, EL_PTR _parent=nullptr) : value(_value), Base(_parent) { this->kind = KIND; }
 	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const { return std::move(this->clone()); }
-	virtual Field nevaluate(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const { return value; }
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const { return value; }
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const { return value; }
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const { out.assign(n, value); }
 	virtual Intersection<Field> intersect(const EL_UPTR& with, const Combiner<Field> &combiner ) const { 
-		if (Constant<Field> *tmp = dynamic_cast< Constant<Field>* >(with.get())) {
+		if (with->getKind() == KIND) {
 			return { EL_UPTR(new Constant<Field>(combiner.initial())), std::move(this->clone()), std::move(with->clone()) };
 		} else {
 			return { nullptr, std::move(this->clone()), std::move(with->clone()) }; 
@@ -174,31 +395,47 @@ template<class Field> class Variable : public CloneableElement<Field, Variable<F
 private:
 	typedef CloneableElement<Field, Variable<Field> > Base;
 protected:
-	std::string name;
+	Symbol name;
+	int slot;
 public:
-	Variable(const std::string _name, EL_PTR _parent=nullptr) : name(_name), Base(_parent) {}
-	virtual Field nevaluate(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const { return values[name]; }
+	static const Kind KIND = KIND_VARIABLE;
+	Variable(const std::string _name, EL_PTR _parent=nullptr) : name(_name), slot(-1), Base(_parent) { this->kind = KIND; }
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const { auto found = values.find(name.str()); return (found == values.end()) ? Field(0) : found->second; }
+	virtual void bind(const std::map<const std::string, unsigned int> &index) {
+		Base::bind(index);
+		auto found = index.find(name.str());
+		slot = (found == index.end()) ? -1 : found->second;
+		if (slot >= 0) this->deps.set(slot);
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const { return (slot >= 0) ? values[slot] : 0; }
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const {
+		if (slot >= 0) out.assign(values.begin()+slot*n, values.begin()+(slot+1)*n);
+		else out.assign(n, Field(0));
+	}
+	virtual EL_UPTR derivative(const std::string &_name) const { return EL_UPTR(new Constant<Field>(_name==name.str()?1:0)); }
 	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const {
-		if (values.count(name)>0)
-			return std::move((values.at(name))->clone());
+		if (values.count(name.str())>0)
+			return std::move((values.at(name.str()))->clone());
 		else
 			return std::move(this->clone());
 	}
 	virtual Intersection<Field> intersect(const EL_UPTR& with, const Combiner<Field> &combiner ) const { 
-		if (Variable<Field> *tmp = dynamic_cast< Variable<Field>* >(with.get())) {
-			if (tmp->getName()==getName()) {
+		if (Variable<Field> *tmp = kind_cast< Variable<Field> >(with.get())) {
+			if (tmp->getSymbol()==name) {
 				return { std::move(this->clone()), nullptr, nullptr };
 			}
 		}
 		return { nullptr, std::move(this->clone()), std::move(with->clone()) }; 
 	} 
-	virtual bool compareWithString(const std::string &_name) const { return _name==name; }
-	virtual const std::string& getName() const { return name; }
+	virtual bool compareWithString(const std::string &_name) const { return _name==name.str(); }
+	virtual const std::string& getName() const { return name.str(); }
+	const Symbol& getSymbol() const { return name; }
+	virtual void variables(std::set<std::string> &names) const { names.insert(name.str()); }
 	virtual std::ostream& print(std::ostream& os) const {
-		os<<name;
+		os<<name.str();
 		return os;
 	}
-	Variable<Field>& operator = (Variable<Field>& other) { name=other.getName(); return *this; }
+	Variable<Field>& operator = (Variable<Field>& other) { name=other.getSymbol(); return *this; }
 };
 
 template<class Field, const unsigned int nargs> class Function;
@@ -206,20 +443,21 @@ template<class Field, const unsigned int nargs> class Function;
 template<class Field, template <class> class CombinerInner > class Collection : public Element<Field> {
 private:
 	typedef Element<Field> Base;
+public:
+	typedef SmallVector< EL_UPTR, COLLECTION_INLINE_TERMS > Terms;
 protected:
-	bool sorted;
-	const CombinerInner<Field> combiner = CombinerInner<Field>();
-	std::vector< EL_UPTR > terms;
+	// Combiners are stateless, one instance per collection type
+	static const CombinerInner<Field> combiner;
+	Terms terms;
 	unsigned int max_id;
+	bool sorted;
 	struct Less {
-		Less(const Collection<Field, CombinerInner >& c) : curObject(c) {}
-		bool operator () ( const EL_UPTR &i1, const EL_UPTR &i2 ) { return i1->similarity(curObject.combiner) < i2->similarity(curObject.combiner); } 
-		const Collection<Field, CombinerInner >& curObject;
+		bool operator () (const std::pair<std::string, unsigned int> &i1, const std::pair<std::string, unsigned int> &i2) const { return i1.first < i2.first; }
 	};
 public:
-	Collection(EL_PTR _parent = nullptr) : sorted(true), max_id(0), Base(_parent) {}
-	Collection(const Collection<Field, CombinerInner> &other) {
-		const std::vector< EL_UPTR > & otherTerms = other.getTerms();
+	Collection(EL_PTR _parent = nullptr) : max_id(0), sorted(true), Base(_parent) {}
+	Collection(const Collection<Field, CombinerInner> &other) : Base(other), max_id(0), sorted(true) {
+		const Terms &otherTerms = other.getTerms();
 		if (!otherTerms.empty()) {
 			terms.reserve(otherTerms.size());
 			for (auto term = otherTerms.begin(); term != otherTerms.end(); term++) {
@@ -227,7 +465,7 @@ public:
 			}
 		}
 	}
-	Collection(const std::vector< EL_UPTR >& _terms, EL_PTR _parent = nullptr) : sorted(true), max_id(0), Base(_parent) { 
+	Collection(const std::vector< EL_UPTR >& _terms, EL_PTR _parent = nullptr) : max_id(0), sorted(true), Base(_parent) { 
 		if (!_terms.empty()) {
 			terms.reserve(_terms.size());
 			for (auto term = _terms.begin(); term != _terms.end(); term++) {
@@ -235,15 +473,60 @@ public:
 			}
 		}
 	}
+	// Takes the terms without copying them
+	Collection(std::vector< EL_UPTR >&& _terms, EL_PTR _parent = nullptr) : max_id(0), sorted(true), Base(_parent) { append(_terms.begin(), _terms.end()); }
 	virtual void canonify() { for (auto term = terms.begin(); term != terms.end(); term++) (*term)->canonify(); }
-	virtual void compress() {}
-	virtual void together() {}
-	virtual Field nevaluate(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const {
+	virtual void variables(std::set<std::string> &names) const { for (auto term = terms.begin(); term != terms.end(); term++) (*term)->variables(names); }
+	virtual unsigned int arity() const { return terms.size(); }
+	virtual EL_PTR getChild(unsigned int i) const { return terms[i].get(); }
+	// Fully expanded sum of monomials, see Expander for the budgets
+	virtual void expand(unsigned int max_terms = DEFAULT_EXPAND_TERMS, unsigned int max_depth = DEFAULT_EXPAND_DEPTH, unsigned int threads = 1) { assign(Expander<Field>(max_terms, max_depth, threads).expand(*this)); }
+	// Smallest form to evaluate, nested by common factors
+	virtual void compress(unsigned int max_terms = DEFAULT_EXPAND_TERMS, unsigned int max_depth = DEFAULT_EXPAND_DEPTH) { assign(Expander<Field>(max_terms, max_depth).compress(*this)); }
+	// Factors common to all terms pulled out
+	virtual void together(unsigned int max_terms = DEFAULT_EXPAND_TERMS, unsigned int max_depth = DEFAULT_EXPAND_DEPTH) { assign(Expander<Field>(max_terms, max_depth).together(*this)); }
+	// Puts result in place of this collection, through the parent if there is one (this is then destroyed)
+	void assign(EL_UPTR result) {
+		if (this->parent != nullptr) {
+			this->parent->replaceById(this->getId(), std::move(result));
+		} else if (result->getKind() == this->kind) {
+			Collection<Field, CombinerInner> *other = static_cast< Collection<Field, CombinerInner> *>(result.get());
+			terms.clear();
+			for (auto term = other->terms.begin(); term != other->terms.end(); term++) append(std::move(*term));
+		} else {
+			terms.clear();
+			append(std::move(result));
+		}
+	}
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const {
 		Field result = combiner.initial();
 		for (auto term = terms.begin(); term != terms.end(); term++)
 			result = combiner.combine(result,(*term)->nevaluate(values, power_precision));
 		return result;
 	}
+	virtual void bind(const std::map<const std::string, unsigned int> &index) {
+		Base::bind(index);
+		for (auto term = terms.begin(); term != terms.end(); term++) {
+			(*term)->bind(index);
+			this->deps.merge((*term)->getDependencies());
+		}
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const {
+		Field result = combiner.initial();
+		for (auto term = terms.begin(); term != terms.end(); term++)
+			result = combiner.combine(result,(*term)->ievaluate(values, changed));
+		return result;
+	}
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const {
+		std::vector<Field> tmp;
+		out.assign(n, combiner.initial());
+		bool add = (combiner.kind() == KIND_SUM);
+		for (auto term = terms.begin(); term != terms.end(); term++) {
+			(*term)->bevaluate(values, n, tmp);
+			if (add) for (unsigned int k = 0; k < n; k++) out[k] += tmp[k];
+			else for (unsigned int k = 0; k < n; k++) out[k] *= tmp[k];
+		}
+	}
 	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const {
 		EL_UPTR ret = std::move(this->clone(true));
 		for (auto term = terms.begin(); term != terms.end(); term++) {
@@ -251,62 +534,79 @@ public:
 		}
 		return std::move(ret);
 	}
-	virtual void simplifyObject() {
-		sort();
-		collectConstants();
-		std::vector< EL_UPTR > *tmpVec = new std::vector< EL_UPTR >();
-		auto term=terms.begin();
-		while (term!=terms.end()) {
-			(*term)->simplifyObject();
-			if (Collection<Field, CombinerInner> *tmpTerm = dynamic_cast< Collection<Field, CombinerInner> *>((*term).get())) {
-				for(auto _term=tmpTerm->getTerms().begin();_term!=tmpTerm->getTerms().end();_term++) {
-					tmpVec->push_back(std::move((*_term)->clone()));
-				}
-				terms.erase(term);
-			} else term++;
-		}
-		if (tmpVec->size() > 0) {
-			appendTerms(*tmpVec);
-			sort();
-			collectConstants();
-		}
-		delete tmpVec;
-
-		if (terms.size() == 1) {
-			if (this->parent != nullptr)
-				this->parent->replaceById(this->getId(), std::move((*(terms.begin()))->clone()));
-		} else if (terms.size() == 0) {
-			if (this->parent != nullptr)
-				this->parent->removeById(this->getId());
+	// Moves the terms of nested collections of the same kind into this one
+	// One pass over the terms, kept terms are compacted in place
+	virtual bool flatten() {
+		std::vector< EL_UPTR > nested;
+		auto kept = terms.begin();
+		for (auto term = terms.begin(); term != terms.end(); term++) {
+			if ((*term)->getKind() == this->kind) {
+				Collection<Field, CombinerInner> *tmpTerm = static_cast< Collection<Field, CombinerInner> *>((*term).get());
+				for (auto _term = tmpTerm->terms.begin(); _term != tmpTerm->terms.end(); _term++) nested.push_back(std::move(*_term));
+			} else *(kept++) = std::move(*term);
 		}
+		terms.erase(kept, terms.end());
+		append(nested.begin(), nested.end());
+		return !nested.empty();
 	}
 	virtual void collectConstants() {
 		Field res = combiner.initial();
-		auto term = terms.begin();
-		while (term != terms.end()) {
-			if (Constant<Field> *cur = dynamic_cast<Constant<Field> *>((*term).get())) {
-				res = combiner.combine(res, cur->getValue());
-				terms.erase(term);
-			} else term++;
+		auto kept = terms.begin();
+		for (auto term = terms.begin(); term != terms.end(); term++) {
+			if (Constant<Field> *cur = kind_cast< Constant<Field> >((*term).get())) res = combiner.combine(res, cur->getValue());
+			else *(kept++) = std::move(*term);
+		}
+		terms.erase(kept, terms.end());
+		if (res != combiner.initial()) {
+			EL_UPTR constant(new Constant<Field>(res));
+			constant->setId(max_id++);
+			constant->setParent(this);
+			terms.insert(terms.begin(), std::move(constant));
+		}
+	}
+	// The similarity key of each term is computed once, ids follow the new order which keeps replaceById direct
+	virtual void sort() {
+		std::vector< std::pair<std::string, unsigned int> > keys(terms.size());
+		for (unsigned int i = 0; i < terms.size(); i++) keys[i] = std::make_pair(terms[i]->similarity(combiner), i);
+		std::stable_sort(keys.begin(), keys.end(), Less());
+		Terms order;
+		order.reserve(terms.size());
+		for (unsigned int i = 0; i < keys.size(); i++) {
+			terms[keys[i].second]->setId(i);
+			order.push_back(std::move(terms[keys[i].second]));
 		}
-		if (res != combiner.initial()) terms.insert(terms.begin(), EL_UPTR(new Constant<Field>(res)));
+		terms = std::move(order);
+		max_id = terms.size();
+		sorted = true;
 	}
-	virtual void sort() { std::sort(terms.begin(), terms.end(), Less(*this)); sorted = true; }
 	void append(EL_UPTR term) { if (term) { term->setId(max_id++); term->setParent(this); terms.push_back( std::move(term) ); sorted = false; } }
+	// Moves the terms of [first, last) in, the source is left with empty pointers
+	template<class Iterator> void append(Iterator first, Iterator last) {
+		terms.reserve(terms.size()+std::distance(first, last));
+		for (; first != last; first++) append(std::move(*first));
+	}
+	// Appends term(i) for i = 0..n-1
+	template<class Generator> void generate(unsigned int n, Generator term) {
+		terms.reserve(terms.size()+n);
+		for (unsigned int i = 0; i < n; i++) append(term(i));
+	}
+	void reserve(unsigned int n) { terms.reserve(n); }
 	void clear() { terms.clear(); }
 	unsigned int size() { return terms.size(); }
 	virtual EL_UPTR clone(bool empty=false) const = 0;
 	virtual void collect() {
 		for (auto _term = terms.begin(); _term != terms.end(); _term++) (*_term)->collect();
-		simplifyObject();
+		this->simplifyObject();
 	}
+	// Ids are handed out in append order, so until the terms are reordered term _id is at position _id
 	virtual void replaceById(const unsigned int _id, EL_UPTR elem) {
-		for(auto term=terms.begin(); term != terms.end(); term++) {
-			if((*term)->getId()==_id) {
-				elem->setId(_id);
-				elem->setParent(this);
-				*term = std::move(elem);
-			}
+		auto term = terms.begin();
+		if ((_id < terms.size()) && (terms[_id]->getId() == _id)) term += _id;
+		else while ((term != terms.end()) && ((*term)->getId() != _id)) term++;
+		if (term != terms.end()) {
+			elem->setId(_id);
+			elem->setParent(this);
+			*term = std::move(elem);
 		}
 		sorted = false;
 	}
@@ -320,12 +620,12 @@ public:
 	}
 	virtual Intersection<Field> intersect(const EL_UPTR& with, const Combiner<Field> &combiner ) const = 0;
 	virtual const EL_UPTR& term(unsigned int i) const { return terms.at(i); }
-	virtual const std::vector< EL_UPTR >& getTerms() const { return terms; }
-	virtual void replaceTerms(const std::vector< EL_UPTR > &other) { terms.clear(); appendTerms(other); }
-	virtual void appendTerms(const std::vector< EL_UPTR > &other) { for(auto term=other.begin(); term!=other.end(); term++) this->append(std::move((*term)->clone())); }
+	virtual const Terms& getTerms() const { return terms; }
+	virtual void replaceTerms(const Terms &other) { terms.clear(); appendTerms(other); }
+	virtual void appendTerms(const Terms &other) { for(auto term=other.begin(); term!=other.end(); term++) this->append(std::move((*term)->clone())); }
 	virtual std::ostream& print(std::ostream& os) const {
 		bool brackets = false;
-		if (this->parent && dynamic_cast< Collection<Field, CombinerInner> *>(this->parent)) {
+		if (this->parent && ((this->parent->getKind() == this->kind) || ((this->kind == KIND_SUM) && (this->parent->getKind() == KIND_PRODUCT)))) {
 			brackets = true;
 		}
 		if (brackets) os<<"(";
@@ -340,17 +640,19 @@ public:
 	}
 	Collection<Field, CombinerInner>& operator = (const Collection<Field,CombinerInner>& other) { 
 		Element<Field>::operator=(other); 
-		const std::vector< EL_UPTR >& otherTerms = other.getTerms();
+		const Terms &otherTerms = other.getTerms();
 		if (!otherTerms.empty()) {
 			terms.reserve(otherTerms.size());
 			for (auto term=otherTerms.begin();term!=otherTerms.end();term++) {
-				terms.append(std::move((*term)->clone()));
+				terms.push_back(std::move((*term)->clone()));
 			}
 		}
 		return *this; 
 	}
 };
 
+template<class Field, template <class> class CombinerInner > const CombinerInner<Field> Collection<Field, CombinerInner>::combiner = CombinerInner<Field>();
+
 template<class Field, template <class> class CombinerInner, class Derived> class CloneableCollection: public Collection<Field, CombinerInner > {
 private:
 	typedef Collection< Field, CombinerInner > Base;
@@ -358,6 +660,7 @@ public:
 	CloneableCollection(EL_PTR _parent = nullptr) : Base(_parent) {}
 	CloneableCollection(const CloneableCollection<Field, CombinerInner, Derived> &other) : Base(static_cast<const Derived&>(other)) {}
 	CloneableCollection(const std::vector< EL_UPTR >& _terms, EL_PTR _parent = nullptr) : Base(_terms, _parent) {}
+	CloneableCollection(std::vector< EL_UPTR >&& _terms, EL_PTR _parent = nullptr) : Base(std::move(_terms), _parent) {}
 	virtual EL_UPTR clone(bool empty=false) const { return empty?EL_UPTR(new Derived()):EL_UPTR(new Derived(static_cast<const Derived&>(*this))); }
 };
 
@@ -365,17 +668,26 @@ template<class Field> class Sum :  public CloneableCollection<Field, Addition, S
 private:
 	typedef CloneableCollection<Field, Addition, Sum<Field> > Base;
 public:
-	Sum(EL_PTR _parent=nullptr) : Base(_parent) {}
-	Sum(const std::vector< EL_UPTR >& _terms, EL_PTR _parent=nullptr) : Base(_terms, _parent) {}
+	static const Kind KIND = KIND_SUM;
+	Sum(EL_PTR _parent=nullptr) : Base(_parent) { this->kind = KIND; }
+	Sum(const std::vector< EL_UPTR >& _terms, EL_PTR _parent=nullptr) : Base(_terms, _parent) { this->kind = KIND; }
+	Sum(std::vector< EL_UPTR >&& _terms, EL_PTR _parent=nullptr) : Base(std::move(_terms), _parent) { this->kind = KIND; }
+	virtual EL_UPTR derivative(const std::string &name) const {
+		std::vector< EL_UPTR > parts;
+		for (auto term = this->terms.begin(); term != this->terms.end(); term++) {
+			parts.push_back(std::move((*term)->derivative(name)));
+		}
+		return make_sum<Field>(parts);
+	}
 	virtual Intersection<Field> intersect(const EL_UPTR& with, const Combiner<Field> &combiner ) const {
 		EL_UPTR common, remainder1, remainder2;
-		if (Sum<Field> *tmp = dynamic_cast<Sum<Field> *>(with.get())) {
+		if (Sum<Field> *tmp = kind_cast< Sum<Field> >(with.get())) {
 			Sum<Field>* _common = new Sum<Field>();
 			Sum<Field>* _remainder1 = new Sum<Field>();
 			Sum<Field>* _remainder2 = new Sum<Field>();
 			auto a=this->terms.begin();
 			auto b=tmp->getTerms().begin();
-			if (dynamic_cast<const Addition<Field> *>(&combiner)) {
+			if (combiner.kind() == KIND_SUM) {
 				while((a!=this->terms.end())&&(b!=tmp->getTerms().end())) {
 					if ((*a)->similarity(combiner)<(*b)->similarity(combiner)) {
 						a++;
@@ -414,7 +726,7 @@ public:
 					remainder2 = nullptr;
 					delete _remainder2;
 				}
-			} else if (dynamic_cast<const Multiplication<Field> *>(&combiner)) {
+			} else if (combiner.kind() == KIND_PRODUCT) {
 				while((a!=this->terms.end())&&(b!=tmp->getTerms().end())) {
 					if ((*a)->similarity(combiner)!=(*b)->similarity(combiner)) {
 						break;
@@ -495,11 +807,13 @@ public:
 		}
 		delete tmpSum;
 		if (this->parent != nullptr) {
+			// this is destroyed by the replacement
+			finalSum->simplifyObject();
 			this->parent->replaceById(this->getId(), EL_UPTR(finalSum));
-		} else {
-			this->replaceTerms(finalSum->getTerms());
-			delete finalSum;
+			return;
 		}
+		this->replaceTerms(finalSum->getTerms());
+		delete finalSum;
 		this->simplifyObject();
 	}
 };
@@ -508,14 +822,30 @@ template<class Field> class Product : public CloneableCollection<Field, Multipli
 private:
 	typedef CloneableCollection<Field, Multiplication, Product<Field> > Base;
 public:
-	Product(EL_PTR _parent = nullptr) : Base(_parent) {}
-	Product(const std::vector< EL_UPTR > &_terms, EL_PTR _parent) : Base(_terms, _parent) {}
+	static const Kind KIND = KIND_PRODUCT;
+	Product(EL_PTR _parent = nullptr) : Base(_parent) { this->kind = KIND; }
+	Product(const std::vector< EL_UPTR > &_terms, EL_PTR _parent) : Base(_terms, _parent) { this->kind = KIND; }
+	Product(std::vector< EL_UPTR >&& _terms, EL_PTR _parent=nullptr) : Base(std::move(_terms), _parent) { this->kind = KIND; }
+	virtual EL_UPTR derivative(const std::string &name) const {
+		std::vector< EL_UPTR > parts;
+		for (auto term = this->terms.begin(); term != this->terms.end(); term++) {
+			if ((*term)->getKind() == KIND_CONSTANT) continue;
+			EL_UPTR tmp = std::move((*term)->derivative(name));
+			if ((*tmp)==Field(0)) continue;
+			std::vector< EL_UPTR > factors;
+			for (auto other = this->terms.begin(); other != this->terms.end(); other++) {
+				if (other != term) factors.push_back(std::move((*other)->clone()));
+			}
+			factors.push_back(std::move(tmp));
+			parts.push_back(std::move(make_product<Field>(factors)));
+		}
+		return make_sum<Field>(parts);
+	}
 	virtual const std::string similarity(const Addition<Field> &combiner) const {
 		std::string ret;
 		bool first = true;
 		for (auto term = this->terms.begin(); term != this->terms.end(); term++) {
-			Constant<Field> *tmp_const = dynamic_cast< Constant<Field> *>((*term).get());
-			if (tmp_const) continue;
+			if ((*term)->getKind() == KIND_CONSTANT) continue;
 			if (first) ret += (*term)->stringify();
 			else ret += (this->combiner).symbol() + (*term)->stringify();
 		}
@@ -523,13 +853,13 @@ public:
 	}
 	virtual Intersection<Field> intersect(const EL_UPTR& with, const Combiner<Field> &combiner ) const { 
 		EL_UPTR common, remainder1, remainder2;
-		if (Product<Field> *tmp = dynamic_cast<Product<Field> *>(with.get())) {
+		if (Product<Field> *tmp = kind_cast< Product<Field> >(with.get())) {
 			Product<Field>* _common = new Product<Field>();
 			Product<Field>* _remainder1 = new Product<Field>();
 			Product<Field>* _remainder2 = new Product<Field>();
 			auto a=this->terms.begin();
 			auto b=tmp->getTerms().begin();
-			if (dynamic_cast<const Addition<Field> *>(&combiner)) {
+			if (combiner.kind() == KIND_SUM) {
 				while((a!=this->terms.end())&&(b!=tmp->getTerms().end())) {
 					if ((*a)->similarity(combiner) < (*b)->similarity(combiner)) {
 						a++;
@@ -544,7 +874,7 @@ public:
 				common = EL_UPTR(_common);
 				remainder1 = EL_UPTR(_remainder1);
 				remainder2 = EL_UPTR(_remainder2);
-			} else if (dynamic_cast<const Multiplication<Field> *>(&combiner)) {
+			} else if (combiner.kind() == KIND_PRODUCT) {
 				while((a!=this->terms.end())&&(b!=tmp->getTerms().end())) {
 					if ((*a)->similarity(combiner)!=(*b)->similarity(combiner)) {
 						break;
@@ -568,7 +898,7 @@ public:
 			common = std::move(with->clone());
 			remainder2 = nullptr;
 			for (auto term = this->terms.begin(); term != this->terms.end(); term++) {
-				if (dynamic_cast< Constant<Field> *>((*term).get())) continue;
+				if ((*term)->getKind() == KIND_CONSTANT) continue;
 				Intersection<Field> t = (*term)->intersect(common, *tmpCombiner);
 				if (t.common != nullptr) {
 					common = std::move(t.common);
@@ -583,7 +913,7 @@ public:
 			if (common != nullptr) {
 				Product<Field>* tmpProd = new Product<Field>();
 				for(auto term = this->terms.begin(); term != this->terms.end(); term++) {
-					if (dynamic_cast< Constant<Field> *>((*term).get())) continue;
+					if ((*term)->getKind() == KIND_CONSTANT) continue;
 					Intersection<Field> t = (*term)->intersect(common, combiner);
 					if (t.remainder1 != nullptr) tmpProd->append(std::move(t.remainder1));
 				}
@@ -598,8 +928,7 @@ public:
 		std::string ret;
 		bool first = true;
 		for (auto term = this->terms.begin(); term != this->terms.end(); term++) {
-			Constant<Field> *tmp_const = dynamic_cast< Constant<Field> *>((*term).get());
-			if (tmp_const) continue;
+			if ((*term)->getKind() == KIND_CONSTANT) continue;
 			if (first) ret += (*term)->stringify();
 			else ret += (this->combiner).symbol() + (*term)->stringify();
 		}
@@ -618,11 +947,11 @@ public:
 				if (std::next(term)==this->terms.end()) tmpProd->append(std::move((*term)->clone()));
 				Intersection<Field> _int = { nullptr, nullptr, nullptr};
 				bool firstContant = false;
-				if (dynamic_cast< Constant<Field> *>((*(tmpProd->getTerms().begin())).get())) {
+				if ((*(tmpProd->getTerms().begin()))->getKind() == KIND_CONSTANT) {
 					// If first element is a constant
 					firstContant = true;
 					if (tmpProd->getTerms().size() > 3) {
-						_int = tmpProd->intersect(*(++tmpProd->getTerms().begin()), this->combiner);
+						_int = tmpProd->intersect(tmpProd->getTerms()[1], this->combiner);
 					}
 				} else {
 					_int = tmpProd->intersect(*(tmpProd->getTerms().begin()), this->combiner);
@@ -630,7 +959,7 @@ public:
 				if (_int.common) {
 					Product<Field> *_tmpProd = new Product<Field>();
 					Power<Field> *commonPow = new Power<Field>();
-					if (Power<Field> * tmpPow = dynamic_cast< Power<Field> *>(_int.common.get())) {
+					if (Power<Field> * tmpPow = kind_cast< Power<Field> >(_int.common.get())) {
 						Sum<Field> *tmpSum = new Sum<Field>();
 						tmpSum->append(EL_UPTR(new Constant<Field>(firstContant?tmpProd->getTerms().size()-1:tmpProd->getTerms().size())));
 						tmpSum->append(std::move(tmpPow->getPower()->clone()));
@@ -655,11 +984,13 @@ public:
 		}
 		delete tmpProd;
 		if (this->parent != nullptr) {
+			// this is destroyed by the replacement
+			finalProd->simplifyObject();
 			this->parent->replaceById(this->getId(), EL_UPTR(finalProd));
-		} else {
-			this->replaceTerms(finalProd->getTerms());
-			delete finalProd;
+			return;
 		}
+		this->replaceTerms(finalProd->getTerms());
+		delete finalProd;
 		this->simplifyObject();
 	}
 };
@@ -672,11 +1003,39 @@ protected:
 	EL_UPTR denominator;
 	enum { NUMERATOR_ID, DENOMINATOR_ID };
 public:
-	Ratio(EL_PTR _parent=nullptr) : Base(_parent) {}
-	Ratio(const Ratio<Field> &other) : numerator(std::move((other.getNumerator())->clone())), denominator(std::move((other.getDenominator())->clone())) { if (numerator) { numerator->setParent(this); numerator->setId(NUMERATOR_ID); } if (denominator) { denominator->setParent(this); denominator->setId(DENOMINATOR_ID); } }
-	Ratio(EL_UPTR _numerator, EL_UPTR _denominator, EL_PTR _parent=nullptr) : numerator(std::move(_numerator)), denominator(std::move(_denominator)), Base(_parent) { if (numerator) { numerator->setParent(this); numerator->setId(NUMERATOR_ID); } if (denominator) { denominator->setParent(this); denominator->setId(DENOMINATOR_ID); } }
+	static const Kind KIND = KIND_RATIO;
+	Ratio(EL_PTR _parent=nullptr) : Base(_parent) { this->kind = KIND; }
+	Ratio(const Ratio<Field> &other) : Base(other), numerator(std::move((other.getNumerator())->clone())), denominator(std::move((other.getDenominator())->clone())) { if (numerator) { numerator->setParent(this); numerator->setId(NUMERATOR_ID); } if (denominator) { denominator->setParent(this); denominator->setId(DENOMINATOR_ID); } this->kind = KIND; }
+	Ratio(EL_UPTR _numerator, EL_UPTR _denominator, EL_PTR _parent=nullptr) : numerator(std::move(_numerator)), denominator(std::move(_denominator)), Base(_parent) { if (numerator) { numerator->setParent(this); numerator->setId(NUMERATOR_ID); } if (denominator) { denominator->setParent(this); denominator->setId(DENOMINATOR_ID); } this->kind = KIND; }
 	virtual Element<Field>* copy() { return new Ratio<Field>(*this); }
-	virtual Field nevaluate(std::map<const std::string, Field> values) { return numerator->nevaluate(values)/denominator->nevaluate(values); }
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const { return numerator->nevaluate(values, power_precision)/denominator->nevaluate(values, power_precision); }
+	virtual void bind(const std::map<const std::string, unsigned int> &index) {
+		Base::bind(index);
+		numerator->bind(index);
+		denominator->bind(index);
+		this->deps.merge(numerator->getDependencies());
+		this->deps.merge(denominator->getDependencies());
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const { return numerator->ievaluate(values, changed)/denominator->ievaluate(values, changed); }
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const {
+		std::vector<Field> tmp;
+		numerator->bevaluate(values, n, out);
+		denominator->bevaluate(values, n, tmp);
+		for (unsigned int k = 0; k < n; k++) out[k] /= tmp[k];
+	}
+	virtual EL_UPTR derivative(const std::string &name) const {
+		std::vector< EL_UPTR > parts, left, right;
+		left.push_back(std::move(numerator->derivative(name)));
+		left.push_back(std::move(denominator->clone()));
+		right.push_back(EL_UPTR(new Constant<Field>(-1)));
+		right.push_back(std::move(numerator->clone()));
+		right.push_back(std::move(denominator->derivative(name)));
+		parts.push_back(std::move(make_product<Field>(left)));
+		parts.push_back(std::move(make_product<Field>(right)));
+		EL_UPTR top = std::move(make_sum<Field>(parts));
+		if ((*top)==Field(0)) return std::move(top);
+		return EL_UPTR(new Ratio<Field>(std::move(top), EL_UPTR(new Power<Field>(std::move(denominator->clone()), EL_UPTR(new Constant<Field>(2))))));
+	}
 	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const {
 		Ratio<Field> *ret = new Ratio<Field>();
 		ret->setNumerator(numerator->evaluate(values));
@@ -696,25 +1055,17 @@ public:
 	virtual const EL_UPTR& getNumerator() const {
 		return numerator;
 	}
+	virtual void variables(std::set<std::string> &names) const { numerator->variables(names); denominator->variables(names); }
 	virtual const EL_UPTR& getDenominator() const {
 		return denominator;
 	}
-	virtual void simplifyObject() {
-		numerator->simplifyObject();
-		denominator->simplifyObject();
-		if (this->parent != nullptr) {
-			if ((*denominator)==1) {
-				this->parent->replaceById(this->getId(), std::move(this->numerator->clone()));
-			} else if ((*numerator)==0) {
-				this->parent->replaceById(this->getId(), EL_UPTR(new Constant<Field>(0)));
-			}
-		}
-	}
+	virtual unsigned int arity() const { return 2; }
+	virtual EL_PTR getChild(unsigned int i) const { return (i==NUMERATOR_ID) ? numerator.get() : denominator.get(); }
 	virtual void replaceById(const unsigned int _id, EL_UPTR elem) { 
 		if (_id==NUMERATOR_ID) {
-			numerator = std::move(elem);
+			setNumerator(std::move(elem));
 		} else if (_id==DENOMINATOR_ID) {
-			denominator = std::move(elem);
+			setDenominator(std::move(elem));
 		}
 	}
 	virtual void remove(const unsigned int _id) { 
@@ -734,32 +1085,83 @@ template<class Field, const unsigned int nargs=1> class Function : public Clonea
 private:
 	typedef CloneableElement<Field, Function<Field, nargs> > Base;
 protected:
-	std::string name;
+	Symbol name;
+	Elementary function;
 	std::array< EL_UPTR, nargs > expressions;
 public:
-	Function(const std::string _name, EL_PTR _parent=nullptr) : name(_name), Base(_parent) {}
-	Function(const Function<Function, nargs>& other) {
-		const std::array< EL_UPTR, nargs >& otherArray = other.getExpressions();
-		name = other.getName();
-		for (auto part=otherArray.begin(); part!=otherArray.end(); part++) {
-			setExpression(std::move((*part)->clone()));
+	static const Kind KIND = KIND_FUNCTION;
+	Function(const std::string _name, EL_PTR _parent=nullptr) : name(_name), function(Elementaries<Field>::find(_name, nargs)), Base(_parent) { this->kind = KIND; }
+	Function(const Function<Field, nargs>& other) : Base(other), name(other.getSymbol()), function(other.getFunction()) {
+		for (unsigned int i=0; i < nargs; i++) {
+			if (other.getExpression(i)) setExpression(i, std::move(other.getExpression(i)->clone()));
+		}
+	}
+	Function(const std::array< EL_UPTR, nargs >& _parts, EL_PTR _parent=nullptr) : function(ELEMENTARY_NONE), Base(_parent) {
+		for (unsigned int i=0; i < nargs; i++) {
+			setExpression(i, std::move(_parts[i]->clone()));
+		}
+		this->kind = KIND;
+	}
+	Function(const Elementary _function, const std::array< EL_UPTR, nargs >& _parts, EL_PTR _parent=nullptr) : name(Elementaries<Field>::name(_function)), function(_function), Base(_parent) {
+		for (unsigned int i=0; i < nargs; i++) {
+			setExpression(i, std::move(_parts[i]->clone()));
+		}
+		this->kind = KIND;
+	}
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const {
+		if (function == ELEMENTARY_NONE) return 0;
+		std::array< Field, nargs > args;
+		for (unsigned int i=0; i < nargs; i++) args[i] = expressions[i]->nevaluate(values, power_precision);
+		return Elementaries<Field>::scalar(function, args.data());
+	}
+	virtual void bind(const std::map<const std::string, unsigned int> &index) {
+		Base::bind(index);
+		for (unsigned int i=0; i < nargs; i++) {
+			expressions[i]->bind(index);
+			this->deps.merge(expressions[i]->getDependencies());
+		}
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const {
+		if (function == ELEMENTARY_NONE) return 0;
+		std::array< Field, nargs > args;
+		for (unsigned int i=0; i < nargs; i++) args[i] = expressions[i]->ievaluate(values, changed);
+		return Elementaries<Field>::scalar(function, args.data());
+	}
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const {
+		if (function == ELEMENTARY_NONE) { out.assign(n, Field(0)); return; }
+		std::vector<Field> args(nargs*n), tmp;
+		for (unsigned int i=0; i < nargs; i++) {
+			expressions[i]->bevaluate(values, n, tmp);
+			std::copy(tmp.begin(), tmp.end(), args.begin()+i*n);
 		}
+		out.resize(n);
+		Elementaries<Field>::batch(function, args.data(), n, out.data());
 	}
-	Function(const std::array< EL_UPTR, nargs >& _parts, EL_PTR _parent=nullptr) : Base(_parent) {
-		for (auto part=_parts.begin(); part!=_parts.end(); part++) {
-			setExpression(std::move((*part)->clone()));
+	// Chain rule through the registered partial derivatives
+	virtual EL_UPTR derivative(const std::string &_name) const {
+		if (function == ELEMENTARY_NONE) return Base::derivative(_name);
+		std::vector< EL_PTR > args;
+		for (unsigned int i=0; i < nargs; i++) args.push_back(expressions[i].get());
+		std::vector< EL_UPTR > parts;
+		for (unsigned int i=0; i < nargs; i++) {
+			EL_UPTR tmp = std::move(expressions[i]->derivative(_name));
+			if ((*tmp)==Field(0)) continue;
+			std::vector< EL_UPTR > factors;
+			factors.push_back(std::move(Elementaries<Field>::partial(function, args, i)));
+			factors.push_back(std::move(tmp));
+			parts.push_back(std::move(make_product<Field>(factors)));
 		}
+		return make_sum<Field>(parts);
 	}
-	virtual Field nevaluate(std::map<const std::string, Field> values) { return 0; }
 	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const { 
 		EL_UPTR ret = std::move(this->clone());
+		for (unsigned int i=0; i < nargs; i++) ret->replaceById(i, std::move(expressions[i]->evaluate(values)));
 		return std::move(ret);
 	}
 	virtual void setExpression(const unsigned int index, EL_UPTR _expression) { expressions[index] = std::move(_expression); if (expressions[index]) { expressions[index]->setParent(this); expressions[index]->setId(index); } }
-	virtual void simplifyObject() {
-		for (unsigned int i=0; i < nargs; i++) expressions[i]->simplifyObject();
-	}
-	virtual void replaceById(const unsigned int _id, Element<Field> *elem) {
+	virtual unsigned int arity() const { return nargs; }
+	virtual EL_PTR getChild(unsigned int i) const { return expressions[i].get(); }
+	virtual void replaceById(const unsigned int _id, EL_UPTR elem) {
 		expressions[_id] = std::move(elem);
 		expressions[_id]->setParent(this);
 		expressions[_id]->setId(_id);
@@ -768,25 +1170,23 @@ public:
 		expressions[_id] = std::move(EL_UPTR(new Constant<Field>(0)));
 	}
 	virtual std::ostream& print(std::ostream &os) const {
-		os<<*name<<"(";
+		os<<name.str()<<"(";
 		for(unsigned int i=0; i<nargs; i++) {
-			os<<*expressions[i];
 			if (i>0) os<<",";
+			os<<*expressions[i];
 		}
 		os<<")";
+		return os;
 	}
-	virtual const std::string getName() const {
-		return name;
-	}
+	virtual const std::string& getName() const { return name.str(); }
+	const Symbol& getSymbol() const { return name; }
+	Elementary getFunction() const { return function; }
+	virtual void variables(std::set<std::string> &names) const { for (unsigned int i=0; i < nargs; i++) expressions[i]->variables(names); }
 	virtual const std::array< EL_UPTR, nargs >& getExpressions() const {
 		return expressions;
 	}
 	virtual const EL_UPTR& getExpression(const unsigned int i) const { 
-		if (i < nargs) {
-			return expressions[i];
-		} else {
-			return nullptr;
-		}
+		return expressions.at(i);
 	}
 };
 
@@ -794,14 +1194,50 @@ template<class Field> class Function<Field, 1> : public CloneableElement<Field,
 private:
 	typedef CloneableElement<Field, Function<Field> > Base;
 protected:
-	std::string name;
+	Symbol name;
+	// ELEMENTARY_NONE for names outside the registry, those evaluate to their argument
+	Elementary function;
 	EL_UPTR expression;
 public:
-	Function(const std::string _name, EL_UPTR _expression=nullptr, EL_PTR _parent=nullptr) : name(_name), expression(std::move(_expression)), Base(_parent) { if (expression) { expression->setParent(this); expression->setId(0); } }
-	Function(const Function<Field>& other) : name(other.getName()), expression(std::move((other.getExpression())->clone())) { if (expression) { expression->setParent(this); expression->setId(0); } }
-	virtual Field nevaluate(std::map<const std::string, Field> values) { return expression->nevaluate(values); }
+	static const Kind KIND = KIND_FUNCTION;
+	Function(const std::string _name, EL_UPTR _expression=nullptr, EL_PTR _parent=nullptr) : name(_name), function(Elementaries<Field>::find(_name, 1)), expression(std::move(_expression)), Base(_parent) { if (expression) { expression->setParent(this); expression->setId(0); } this->kind = KIND; }
+	Function(const Elementary _function, EL_UPTR _expression=nullptr, EL_PTR _parent=nullptr) : name(Elementaries<Field>::name(_function)), function(_function), expression(std::move(_expression)), Base(_parent) { if (expression) { expression->setParent(this); expression->setId(0); } this->kind = KIND; }
+	Function(const Function<Field>& other) : Base(other), name(other.getSymbol()), function(other.getFunction()), expression(std::move((other.getExpression())->clone())) { if (expression) { expression->setParent(this); expression->setId(0); } }
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const {
+		Field arg = expression->nevaluate(values, power_precision);
+		return (function == ELEMENTARY_NONE) ? arg : Elementaries<Field>::scalar(function, &arg);
+	}
+	virtual void bind(const std::map<const std::string, unsigned int> &index) {
+		Base::bind(index);
+		if (expression) {
+			expression->bind(index);
+			this->deps.merge(expression->getDependencies());
+		}
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const {
+		Field arg = expression->ievaluate(values, changed);
+		return (function == ELEMENTARY_NONE) ? arg : Elementaries<Field>::scalar(function, &arg);
+	}
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const {
+		if (function == ELEMENTARY_NONE) { expression->bevaluate(values, n, out); return; }
+		std::vector<Field> arg;
+		expression->bevaluate(values, n, arg);
+		out.resize(n);
+		Elementaries<Field>::batch(function, arg.data(), n, out.data());
+	}
+	// f(u)' = f'(u)*u'
+	virtual EL_UPTR derivative(const std::string &_name) const {
+		if (function == ELEMENTARY_NONE) return Base::derivative(_name);
+		EL_UPTR tmp = std::move(expression->derivative(_name));
+		if ((*tmp)==Field(0)) return std::move(tmp);
+		std::vector< EL_UPTR > factors;
+		factors.push_back(std::move(Elementaries<Field>::partial(function, std::vector< EL_PTR >(1, expression.get()), 0)));
+		factors.push_back(std::move(tmp));
+		return make_product<Field>(factors);
+	}
 	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const { 
 		EL_UPTR ret = std::move(this->clone());
+		if (expression) ret->replaceById(0, std::move(expression->evaluate(values)));
 		return std::move(ret);
 	}
 	virtual void replaceById(const unsigned int _id, EL_UPTR elem) {
@@ -812,18 +1248,18 @@ public:
 	virtual void removeById(const unsigned int _id) {
 		expression = std::move(EL_UPTR(new Constant<Field>(0)));
 	}
-	virtual void simplifyObject() {
-		expression->simplifyObject();
-	}
-	virtual const std::string getName() const {
-		return name;
-	}
+	virtual unsigned int arity() const { return expression ? 1 : 0; }
+	virtual EL_PTR getChild(unsigned int i) const { return expression.get(); }
+	virtual const std::string& getName() const { return name.str(); }
+	const Symbol& getSymbol() const { return name; }
+	Elementary getFunction() const { return function; }
 	virtual void setExpression(EL_UPTR _expression) { expression = std::move(_expression); if (expression) { expression->setParent(this); expression->setId(0); } }
+	virtual void variables(std::set<std::string> &names) const { if (expression) expression->variables(names); }
 	virtual const EL_UPTR& getExpression() const { 
 		return expression;
 	}
 	virtual std::ostream& print(std::ostream &os) const {
-		os<<name<<"("<<*expression<<")";
+		os<<name.str()<<"("<<*expression<<")";
 		return os;
 	}
 };
@@ -856,11 +1292,59 @@ private:
 protected:
 	EL_UPTR power;
 public:
-	Power(EL_UPTR _expression=nullptr, EL_UPTR _power=nullptr, EL_PTR _parent=nullptr) : Base("power", std::move(_expression), _parent), power(std::move(_power)) { if (power) { power->setParent(this); power->setId(POWER_ID); } }
-	Power(const Power<Field>& other) : Base("power",std::move((other.getExpression())->clone())), power(std::move((other.getPower())->clone())) { if (power) { power->setParent(this); power->setId(POWER_ID); } }
+	static const Kind KIND = KIND_POWER;
+	Power(EL_UPTR _expression=nullptr, EL_UPTR _power=nullptr, EL_PTR _parent=nullptr) : Base("power", std::move(_expression), _parent), power(std::move(_power)) { if (power) { power->setParent(this); power->setId(POWER_ID); } this->kind = KIND; }
+	Power(const Power<Field>& other) : Base("power",std::move((other.getExpression())->clone())), power(std::move((other.getPower())->clone())) { if (power) { power->setParent(this); power->setId(POWER_ID); } this->kind = KIND; }
 	virtual void setPower(EL_UPTR _power) { power = std::move(_power); if (power) { power->setParent(this); power->setId(POWER_ID); } }
 	virtual const EL_UPTR& getPower() const { return power; }
-	virtual Field nevaluate(const std::map<const std::string, Field> values) { return pow(this->expression->nevaluate(values), power->nevaluate(values)); }
+	virtual void variables(std::set<std::string> &names) const { this->expression->variables(names); power->variables(names); }
+	virtual unsigned int arity() const { return 2; }
+	virtual EL_PTR getChild(unsigned int i) const { return (i==POWER_ID) ? power.get() : this->expression.get(); }
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const { return pow(this->expression->nevaluate(values, power_precision), power->nevaluate(values, power_precision)); }
+	virtual void bind(const std::map<const std::string, unsigned int> &index) {
+		Base::bind(index);
+		power->bind(index);
+		this->deps.merge(power->getDependencies());
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const { return pow(this->expression->ievaluate(values, changed), power->ievaluate(values, changed)); }
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const {
+		std::vector<Field> tmp;
+		this->expression->bevaluate(values, n, out);
+		if ((*power)==Field(2)) {
+			for (unsigned int k = 0; k < n; k++) out[k] *= out[k];
+			return;
+		}
+		power->bevaluate(values, n, tmp);
+		for (unsigned int k = 0; k < n; k++) out[k] = pow(out[k], tmp[k]);
+	}
+	virtual EL_UPTR derivative(const std::string &name) const {
+		std::vector< EL_UPTR > parts, left, right;
+		EL_UPTR dexpr = std::move(this->expression->derivative(name));
+		EL_UPTR dpower = std::move(power->derivative(name));
+		if (!((*dexpr)==Field(0))) {
+			// d(f^g) = g*f^(g-1)*f' + f^g*log(f)*g'
+			EL_UPTR lowered;
+			if (Constant<Field> *tmpConst = kind_cast< Constant<Field> >(power.get())) {
+				lowered = EL_UPTR(new Constant<Field>(tmpConst->getValue()-1));
+			} else {
+				std::vector< EL_UPTR > tmpSum;
+				tmpSum.push_back(std::move(power->clone()));
+				tmpSum.push_back(EL_UPTR(new Constant<Field>(-1)));
+				lowered = std::move(make_sum<Field>(tmpSum));
+			}
+			left.push_back(std::move(power->clone()));
+			left.push_back(EL_UPTR(new Power<Field>(std::move(this->expression->clone()), std::move(lowered))));
+			left.push_back(std::move(dexpr));
+			parts.push_back(std::move(make_product<Field>(left)));
+		}
+		if (!((*dpower)==Field(0))) {
+			right.push_back(std::move(this->clone()));
+			right.push_back(EL_UPTR(new Function<Field>("log", std::move(this->expression->clone()))));
+			right.push_back(std::move(dpower));
+			parts.push_back(std::move(make_product<Field>(right)));
+		}
+		return make_sum<Field>(parts);
+	}
 	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const {
 		return EL_UPTR(new Power<Field>(std::move(this->expression->evaluate(values)), std::move(power->evaluate(values))));
 	}
@@ -869,13 +1353,13 @@ public:
 			this->expression = std::move(elem);
 			if (this->expression) {
 				this->expression->setParent(this);
-				this->expression->setId(0);
+				this->expression->setId(EXPRESSION_ID);
 			}
 		} else if (_id==POWER_ID) {
 			power = std::move(elem);
 			if (power) {
 				power->setParent(this);
-				power->setId(0);
+				power->setId(POWER_ID);
 			}
 		}
 	}
@@ -889,25 +1373,6 @@ public:
 	virtual const std::string similarity(const Multiplication<Field> &combiner) const {
 		return this->expression->similarity(combiner);
 	}
-	virtual void simplifyObject() {
-		this->expression->simplifyObject();
-		power->simplifyObject();
-		if (this->parent != nullptr) {
-			if ((*power)==1) {
-				this->parent->replaceById(this->getId(), std::move(this->expression->clone()));
-			} else if ((*power)==0) {
-				this->parent->replaceById(this->getId(), EL_UPTR(new Constant<Field>(1)));
-			} else {
-				if (Product<Field> *tmpProd = dynamic_cast< Product<Field> *>(this->expression.get())) {
-					Product<Field> *res = new Product<Field>();
-					for(auto term=tmpProd->getTerms().begin();term!=tmpProd->getTerms().end();term++) {
-						res->append(EL_UPTR(new Power(std::move((*term)->clone()),std::move(power->clone()))));
-					}
-					this->parent->replaceById(this->getId(), EL_UPTR(res));
-				}
-			}
-		}
-	}
 	virtual std::ostream& print(std::ostream &os) const {
 		os<<"{"<<*(this->expression)<<"}^{"<<*power<<"}";
 		return os;
@@ -915,30 +1380,195 @@ public:
 };
 
 #define INDEX_ID 1
+// Sequence transformation applied to the partial sums of a series
+enum Acceleration { ACCELERATION_NONE, ACCELERATION_AITKEN, ACCELERATION_RICHARDSON, ACCELERATION_LEVIN };
+
+// Sum of expression over index = starting_index, starting_index+1, ... Factors of the expression that depend
+// on the index only are the coefficients, they are computed once per node and reused by every evaluation.
 template<class Field> class InfiniteSum : public CloneableFunction<Field, 1, InfiniteSum<Field> > {
 private:
 	typedef CloneableFunction<Field, 1, InfiniteSum<Field> > Base;
 protected:
 	VA_UPTR index;
 	int starting_index;
+	Acceleration acceleration;
+	int slot;
+	mutable EL_UPTR coefficient;
+	mutable EL_UPTR rest;
+	mutable std::vector<Field> coefficients;
+	mutable unsigned int used;
+	void prepare() const {
+		if (rest) return;
+		std::vector< EL_UPTR > fixed, varying;
+		EL_PTR expr = this->expression.get();
+		unsigned int n = (expr->getKind() == KIND_PRODUCT) ? expr->arity() : 1;
+		for (unsigned int i = 0; i < n; i++) {
+			EL_PTR factor = (expr->getKind() == KIND_PRODUCT) ? expr->getChild(i) : expr;
+			std::set<std::string> names;
+			factor->variables(names);
+			if (names.empty() || ((names.size() == 1) && names.count(index->getName()))) fixed.push_back(std::move(factor->clone()));
+			else varying.push_back(std::move(factor->clone()));
+		}
+		coefficient = std::move(make_product<Field>(fixed));
+		rest = std::move(make_product<Field>(varying));
+		coefficients.clear();
+	}
+	void reset() { coefficient.reset(); rest.reset(); coefficients.clear(); slot = -1; }
+	Field coefficientAt(int n) const {
+		unsigned int i = n-starting_index;
+		// A frozen node is only read, coefficients past the precomputed ones are not kept
+		if ((coefficients.size() <= i) && Scratch<Field>::current()) {
+			std::map<const std::string, Field> values;
+			values[index->getName()] = Field((long long)n);
+			return coefficient->nevaluate(values);
+		}
+		while (coefficients.size() <= i) {
+			std::map<const std::string, Field> values;
+			values[index->getName()] = Field((long long)(starting_index+coefficients.size()));
+			coefficients.push_back(coefficient->nevaluate(values));
+		}
+		return coefficients[i];
+	}
+	// Accelerated limit of the partial sums sums[0..m] of the nonzero terms
+	Field accelerate(const std::vector<Field> &sums, const std::vector<Field> &terms) const {
+		unsigned int m = sums.size()-1;
+		if (acceleration == ACCELERATION_AITKEN) {
+			if (m < 2) return sums[m];
+			Field d1 = sums[m]-sums[m-1], d2 = d1-(sums[m-1]-sums[m-2]);
+			return (d2 == Field(0)) ? sums[m] : sums[m]-d1*d1/d2;
+		}
+		unsigned int k = std::min(m, (unsigned int)DEFAULT_SERIES_ORDER), first = m-k;
+		Field num = 0, den = 0, binomial = 1;
+		for (unsigned int j = 0; j <= k; j++) {
+			Field weight;
+			if (acceleration == ACCELERATION_RICHARDSON) {
+				// Salzer: sums[i] = S + c_1/(i+1) + c_2/(i+1)^2 + ...
+				weight = pow(Field((long long)(first+j+1))/Field((long long)(first+k+1)), Field((long long)k))*binomial;
+				if ((k-j)%2) weight = -weight;
+				num += weight*sums[first+j];
+				den += weight;
+			} else {
+				// Levin u-transform with remainder estimates (i+1)*terms[i]
+				weight = binomial*pow(Field((long long)(first+j+1))/Field((long long)(first+k+1)), Field((long long)k-1))/(Field((long long)(first+j+1))*terms[first+j]);
+				if (j%2) weight = -weight;
+				num += weight*sums[first+j];
+				den += weight;
+			}
+			binomial = binomial*Field((long long)(k-j))/Field((long long)(j+1));
+		}
+		return num/den;
+	}
+	// Partial sums of term(n) until the limit is stable to 10^power_precision over two nonzero terms in a row.
+	// Zero terms say nothing about the tail (leading zeros, only every k-th power present), they are skipped.
+	template<class Term> Field limit(Term term, int power_precision) const {
+		using std::abs;
+		using std::pow;
+		Field tolerance = pow(Field(10), Field(power_precision)), best = 0, sum = 0;
+		std::vector<Field> sums, terms;
+		unsigned int stable = 0, count = 0;
+		for (int n = starting_index; n <= last(); n++) {
+			Field a = term(n);
+			count++;
+			if (a == Field(0)) continue;
+			sum += a;
+			sums.push_back(sum);
+			terms.push_back(a);
+			Field next = ((acceleration == ACCELERATION_NONE) || bounded()) ? sum : accelerate(sums, terms);
+			Field scale = abs(next) < Field(1) ? Field(1) : abs(next);
+			Field change = (acceleration == ACCELERATION_NONE) ? a : next-best;
+			if ((sums.size() > 2) && (abs(change) <= tolerance*scale)) stable++;
+			else stable = 0;
+			best = next;
+			if (!bounded() && (stable >= 2)) break;
+		}
+		if (!Scratch<Field>::current()) used = count;
+		return best;
+	}
+	virtual int last() const { return starting_index+DEFAULT_SERIES_TERMS; }
+	virtual bool bounded() const { return false; }
 public:
-	InfiniteSum(EL_UPTR _expression, VA_UPTR _index, int _starting_index = 1, EL_PTR _parent=nullptr) : Base("infinite_sum",std::move(_expression),_parent), index(std::move(_index)) { if (index) { index->setId(INDEX_ID); index->setParent(this); } }
-	InfiniteSum(const InfiniteSum<Field>& other) : Base("infinite_sum", std::move((other->getExpression())->clone())), index(std::move((other->getIndex())->clone())) { if (index) { index->setId(INDEX_ID); index->setParent(this); } }
+	static const Kind KIND = KIND_SERIES;
+	InfiniteSum(EL_UPTR _expression, VA_UPTR _index, int _starting_index = 1, EL_PTR _parent=nullptr) : Base("infinite_sum",std::move(_expression),_parent), index(std::move(_index)), starting_index(_starting_index), acceleration(ACCELERATION_LEVIN), slot(-1), used(0) { if (index) { index->setId(INDEX_ID); index->setParent(this); } this->kind = KIND; }
+	InfiniteSum(const InfiniteSum<Field>& other) : Base(other), index(static_cast<Variable<Field>*>(other.getIndex()->clone().release())), starting_index(other.getStartingIndex()), acceleration(other.getAcceleration()), slot(-1), used(0) { if (index) { index->setId(INDEX_ID); index->setParent(this); } this->kind = KIND; }
 	virtual void setIndex(VA_UPTR _index) {
 		index = std::move(_index);
 		if (index) {
 			index->setParent(this);
 			index->setId(INDEX_ID);
 		}
+		reset();
 	}
 	virtual const VA_UPTR& getIndex() const { return index; }
-	virtual void setStartingIndex(int _i) { starting_index = _i; }
-	virtual void simplifyObject() {
-		this->expression->simplifyObject();
-		index->simplifyObject();
+	virtual void setStartingIndex(int _i) { starting_index = _i; reset(); }
+	int getStartingIndex() const { return starting_index; }
+	void setAcceleration(Acceleration _acceleration) { acceleration = _acceleration; }
+	Acceleration getAcceleration() const { return acceleration; }
+	// Terms used by the last evaluation
+	unsigned int lastTerms() const { return used; }
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const {
+		prepare();
+		const std::string &name = index->getName();
+		return limit([&](int n) -> Field {
+			Field c = coefficientAt(n);
+			if (c == Field(0)) return c;
+			values[name] = Field((long long)n);
+			return c*rest->nevaluate(values, power_precision);
+		}, power_precision);
+	}
+	// The index takes the slot after the bound variables, subtrees that do not depend on it stay cached over the terms
+	virtual void bind(const std::map<const std::string, unsigned int> &bound) {
+		Element<Field>::bind(bound);
+		prepare();
+		std::map<const std::string, unsigned int> inner(bound);
+		slot = 0;
+		for (auto entry = bound.begin(); entry != bound.end(); entry++) slot = std::max(slot, (int)entry->second+1);
+		inner[index->getName()] = slot;
+		rest->bind(inner);
+		this->deps.merge(rest->getDependencies());
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const {
+		if (slot < 0) return 0;
+		std::vector<Field> local(values);
+		if (local.size() <= (unsigned int)slot) local.resize(slot+1);
+		Dependencies step(changed);
+		step.set(slot);
+		return limit([&](int n) -> Field {
+			Field c = coefficientAt(n);
+			if (c == Field(0)) return c;
+			local[slot] = Field((long long)n);
+			return c*rest->ievaluate(local, step);
+		}, DEFAULT_POWER_PRECISION);
+	}
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const { Element<Field>::bcompute(values, n, out); }
+	virtual void freeze(unsigned int &next) {
+		prepare();
+		coefficientAt(starting_index+4*DEFAULT_SERIES_ORDER);
+		Base::freeze(next);
+	}
+	// Term by term
+	virtual EL_UPTR derivative(const std::string &name) const {
+		if (name == index->getName()) return EL_UPTR(new Constant<Field>(0));
+		EL_UPTR ret = std::move(this->clone());
+		ret->replaceById(EXPRESSION_ID, std::move(this->expression->derivative(name)));
+		return std::move(ret);
 	}
+	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const {
+		std::map<const std::string, EL_UPTR > inner;
+		for (auto value = values.begin(); value != values.end(); value++) {
+			if (value->first != index->getName()) inner[value->first] = std::move(value->second->clone());
+		}
+		return Base::evaluate(inner);
+	}
+	virtual void variables(std::set<std::string> &names) const {
+		std::set<std::string> inner;
+		this->expression->variables(inner);
+		inner.erase(index->getName());
+		names.insert(inner.begin(), inner.end());
+	}
+	virtual void replaceById(const unsigned int _id, EL_UPTR elem) { Base::replaceById(_id, std::move(elem)); reset(); }
+	virtual void setExpression(EL_UPTR _expression) { Base::setExpression(std::move(_expression)); reset(); }
 	virtual std::ostream& print(std::ostream &os) const {
-		os<<"\\sum\\limit_{"<<*index<<"}^{\\infty}{"<<*(this->expression)<<"}";
+		os<<"\\sum_{"<<*index<<"="<<starting_index<<"}^{\\infty}{"<<*(this->expression)<<"}";
 		return os;
 	}
 };
@@ -946,22 +1576,440 @@ public:
 template<class Field> class FiniteSum : public InfiniteSum<Field> {
 protected:
 	int ending_index;
+	virtual int last() const { return ending_index; }
+	virtual bool bounded() const { return true; }
+public:
+	FiniteSum(EL_UPTR _expression, VA_UPTR _index, int _starting_index, int _ending_index, EL_PTR _parent=nullptr) : InfiniteSum<Field>(std::move(_expression), std::move(_index), _starting_index, _parent), ending_index(_ending_index) { this->setAcceleration(ACCELERATION_NONE); }
+	FiniteSum(const FiniteSum<Field>& other) : InfiniteSum<Field>(other), ending_index(other.getEndingIndex()) {}
+	virtual EL_UPTR clone(bool empty=false) const { return EL_UPTR(new FiniteSum<Field>(*this)); }
+	int getEndingIndex() const { return ending_index; }
+	virtual std::ostream& print(std::ostream &os) const {
+		os<<"\\sum_{"<<*(this->index)<<"="<<this->starting_index<<"}^{"<<ending_index<<"}{"<<*(this->expression)<<"}";
+		return os;
+	}
 };
 
+// sum of coefficient(n)*argument^n over n, the coefficients are computed once
 template<class Field> class TaylorSeries : public InfiniteSum<Field> {
 protected:
 	//std::vector<Range<Field> *> convergence_region;
+	static EL_UPTR term(EL_UPTR _coefficient, EL_UPTR _argument, const VA_UPTR &_index) {
+		std::vector< EL_UPTR > factors;
+		factors.push_back(std::move(_coefficient));
+		factors.push_back(EL_UPTR(new Power<Field>(std::move(_argument), std::move(_index->clone()))));
+		return make_product<Field>(factors);
+	}
+public:
+	TaylorSeries(EL_UPTR _coefficient, EL_UPTR _argument, VA_UPTR _index, int _starting_index = 0, EL_PTR _parent=nullptr) : InfiniteSum<Field>(nullptr, std::move(_index), _starting_index, _parent) {
+		this->setExpression(std::move(term(std::move(_coefficient), std::move(_argument), this->index)));
+	}
+	TaylorSeries(const TaylorSeries<Field>& other) : InfiniteSum<Field>(other) {}
+	virtual EL_UPTR clone(bool empty=false) const { return EL_UPTR(new TaylorSeries<Field>(*this)); }
 };
 
+#define LOWER_ID 1
+#define UPPER_ID 2
+// Integral of expression over variable, the variable is bound inside the integral
 template<class Field> class Integral : public Element<Field> {
+private:
+	typedef Element<Field> Base;
 protected:
-	std::vector<Variable<Field>*> int_variables;
-	Element<Field> *expression;
+	EL_UPTR expression;
+	VA_UPTR variable;
+public:
+	Integral(EL_UPTR _expression, VA_UPTR _variable, EL_PTR _parent=nullptr) : Base(_parent), variable(std::move(_variable)) { setExpression(std::move(_expression)); this->kind = KIND_INTEGRAL; }
+	Integral(const Integral<Field> &other) : Base(other), variable(static_cast<Variable<Field>*>(other.getVariable()->clone().release())) { setExpression(std::move(other.getExpression()->clone())); }
+	virtual void setExpression(EL_UPTR _expression) { expression = std::move(_expression); if (expression) { expression->setParent(this); expression->setId(EXPRESSION_ID); } }
+	virtual const EL_UPTR& getExpression() const { return expression; }
+	virtual const VA_UPTR& getVariable() const { return variable; }
+	virtual unsigned int arity() const { return 1; }
+	virtual EL_PTR getChild(unsigned int i) const { return expression.get(); }
+	virtual void replaceById(const unsigned int _id, EL_UPTR elem) { setExpression(std::move(elem)); }
+	virtual void removeById(const unsigned int _id) { setExpression(EL_UPTR(new Constant<Field>(0))); }
+	virtual void variables(std::set<std::string> &names) const {
+		std::set<std::string> inner;
+		expression->variables(inner);
+		inner.erase(variable->getName());
+		names.insert(inner.begin(), inner.end());
+	}
+	virtual std::ostream& print(std::ostream &os) const {
+		os<<"\\int{"<<*expression<<"}\\,d"<<*variable;
+		return os;
+	}
 };
 
+// Numeric integral over [lower, upper], fixed Gauss-Legendre rules or adaptive Gauss-Kronrod.
+// All nodes of a rule go through the integrand in one bevaluate pass.
 template<class Field> class DefiniteIntegral : public Integral<Field> {
+private:
+	typedef Integral<Field> Base;
 protected:
-//	std::vector<Range<Field> *> *boundary;
+	EL_UPTR lower;
+	EL_UPTR upper;
+	// Gauss-Legendre points per interval, 0 for adaptive Gauss-Kronrod
+	unsigned int points;
+	// Equal intervals of a fixed rule, the most segments of the adaptive rule
+	unsigned int intervals;
+	int slot;
+	// Integrand bound to its own variables for nevaluate, names[0] is the integration variable
+	mutable EL_UPTR integrand;
+	mutable std::vector<std::string> names;
+	mutable unsigned int evaluations;
+	void prepare() const {
+		if (integrand) return;
+		std::set<std::string> inner;
+		this->expression->variables(inner);
+		inner.erase(this->variable->getName());
+		names.assign(1, this->variable->getName());
+		names.insert(names.end(), inner.begin(), inner.end());
+		std::map<const std::string, unsigned int> index;
+		for (unsigned int i = 0; i < names.size(); i++) index[names[i]] = i;
+		integrand = std::move(this->expression->clone());
+		integrand->bind(index);
+	}
+	// Integral of tree over [a,b] with the other slots fixed to row
+	Field integrate(const Element<Field> &tree, const std::vector<Field> &row, unsigned int var, Field a, Field b, int power_precision) const {
+		using std::pow;
+		unsigned int count = 0;
+		auto f = [&](const std::vector<Field> &nodes, std::vector<Field> &out) {
+			unsigned int n = nodes.size();
+			std::vector<Field> batch(row.size()*n);
+			for (unsigned int i = 0; i < row.size(); i++) std::fill(batch.begin()+i*n, batch.begin()+(i+1)*n, row[i]);
+			std::copy(nodes.begin(), nodes.end(), batch.begin()+var*n);
+			tree.bevaluate(batch, n, out);
+			count += n;
+		};
+		Field ret = points ? quadrature::integrate_gauss(points, f, a, b, intervals) : quadrature::integrate_adaptive(f, a, b, pow(Field(10), Field(power_precision)), intervals);
+		if (!Scratch<Field>::current()) evaluations = count;
+		return ret;
+	}
+public:
+	static const Kind KIND = KIND_INTEGRAL;
+	DefiniteIntegral(EL_UPTR _expression, VA_UPTR _variable, EL_UPTR _lower, EL_UPTR _upper, EL_PTR _parent=nullptr) : Base(std::move(_expression), std::move(_variable), _parent), points(0), intervals(DEFAULT_QUADRATURE_INTERVALS), slot(-1), evaluations(0) { setLower(std::move(_lower)); setUpper(std::move(_upper)); }
+	DefiniteIntegral(const DefiniteIntegral<Field> &other) : Base(other), points(other.getPoints()), intervals(other.getIntervals()), slot(-1), evaluations(0) { setLower(std::move(other.getLower()->clone())); setUpper(std::move(other.getUpper()->clone())); }
+	virtual EL_UPTR clone(bool empty=false) const { return EL_UPTR(new DefiniteIntegral<Field>(*this)); }
+	// points Gauss-Legendre nodes (1 to 8) on each of intervals equal parts, points = 0 for adaptive Gauss-Kronrod
+	void setRule(unsigned int _points, unsigned int _intervals) { points = _points; intervals = _intervals; }
+	unsigned int getPoints() const { return points; }
+	unsigned int getIntervals() const { return intervals; }
+	// Integrand evaluations of the last nevaluate
+	unsigned int lastEvaluations() const { return evaluations; }
+	virtual void setExpression(EL_UPTR _expression) { Base::setExpression(std::move(_expression)); integrand.reset(); }
+	virtual void freeze(unsigned int &next) { prepare(); Base::freeze(next); }
+	void setLower(EL_UPTR elem) { lower = std::move(elem); lower->setParent(this); lower->setId(LOWER_ID); }
+	void setUpper(EL_UPTR elem) { upper = std::move(elem); upper->setParent(this); upper->setId(UPPER_ID); }
+	const EL_UPTR& getLower() const { return lower; }
+	const EL_UPTR& getUpper() const { return upper; }
+	virtual unsigned int arity() const { return 3; }
+	virtual EL_PTR getChild(unsigned int i) const { return (i==LOWER_ID) ? lower.get() : ((i==UPPER_ID) ? upper.get() : this->expression.get()); }
+	virtual void replaceById(const unsigned int _id, EL_UPTR elem) {
+		if (_id==LOWER_ID) setLower(std::move(elem));
+		else if (_id==UPPER_ID) setUpper(std::move(elem));
+		else setExpression(std::move(elem));
+	}
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const {
+		prepare();
+		Field a = lower->nevaluate(values, power_precision), b = upper->nevaluate(values, power_precision);
+		std::vector<Field> row(names.size());
+		for (unsigned int i = 1; i < names.size(); i++) row[i] = values[names[i]];
+		return integrate(*integrand, row, 0, a, b, power_precision);
+	}
+	// The integration variable takes the slot after the bound variables
+	virtual void bind(const std::map<const std::string, unsigned int> &index) {
+		Element<Field>::bind(index);
+		std::map<const std::string, unsigned int> inner(index);
+		slot = 0;
+		for (auto entry = index.begin(); entry != index.end(); entry++) slot = std::max(slot, (int)entry->second+1);
+		inner[this->variable->getName()] = slot;
+		this->expression->bind(inner);
+		lower->bind(index);
+		upper->bind(index);
+		this->deps.merge(this->expression->getDependencies());
+		this->deps.merge(lower->getDependencies());
+		this->deps.merge(upper->getDependencies());
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const {
+		if (slot < 0) return 0;
+		std::vector<Field> row(values);
+		if (row.size() <= (unsigned int)slot) row.resize(slot+1);
+		return integrate(*(this->expression), row, slot, lower->ievaluate(values, changed), upper->ievaluate(values, changed), DEFAULT_POWER_PRECISION);
+	}
+	// Leibniz rule
+	virtual EL_UPTR derivative(const std::string &name) const {
+		const std::string &var = this->variable->getName();
+		if (name == var) return EL_UPTR(new Constant<Field>(0));
+		std::vector< EL_UPTR > parts;
+		EL_UPTR inner = std::move(this->expression->derivative(name));
+		if (!((*inner)==Field(0))) {
+			EL_UPTR ret = std::move(this->clone());
+			ret->replaceById(EXPRESSION_ID, std::move(inner));
+			parts.push_back(std::move(ret));
+		}
+		for (unsigned int i = LOWER_ID; i <= UPPER_ID; i++) {
+			EL_PTR bound = getChild(i);
+			EL_UPTR dbound = std::move(bound->derivative(name));
+			if ((*dbound)==Field(0)) continue;
+			std::map<const std::string, EL_UPTR > at;
+			at[var] = std::move(bound->clone());
+			std::vector< EL_UPTR > factors;
+			if (i == LOWER_ID) factors.push_back(EL_UPTR(new Constant<Field>(-1)));
+			factors.push_back(std::move(this->expression->evaluate(at)));
+			factors.push_back(std::move(dbound));
+			parts.push_back(std::move(make_product<Field>(factors)));
+		}
+		return make_sum<Field>(parts);
+	}
+	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const {
+		std::map<const std::string, EL_UPTR > inner;
+		for (auto value = values.begin(); value != values.end(); value++) {
+			if (value->first != this->variable->getName()) inner[value->first] = std::move(value->second->clone());
+		}
+		EL_UPTR ret = std::move(this->clone());
+		ret->replaceById(EXPRESSION_ID, std::move(this->expression->evaluate(inner)));
+		ret->replaceById(LOWER_ID, std::move(lower->evaluate(values)));
+		ret->replaceById(UPPER_ID, std::move(upper->evaluate(values)));
+		return std::move(ret);
+	}
+	virtual void variables(std::set<std::string> &names) const {
+		Base::variables(names);
+		lower->variables(names);
+		upper->variables(names);
+	}
+	virtual std::ostream& print(std::ostream &os) const {
+		os<<"\\int_{"<<*lower<<"}^{"<<*upper<<"}{"<<*(this->expression)<<"}\\,d"<<*(this->variable);
+		return os;
+	}
+};
+
+#define PAIRS_ALL -1
+#define PAIRS_BATCH 256 // pairs per bevaluate pass
+
+// Sum of pair(p_i, p_j) over the pairs i<j of particles, p_i are the coordinate names of particle i and pair
+// is written in the placeholders first (for p_i) and second (for p_j). Only the pair expression is stored:
+// the particles and the derivatives of pair are shared by copies and derivatives, so the sum and its whole
+// gradient take memory linear in the number of particles. The derivative by a coordinate of particle k is
+// the sum over the pairs of k, fixed = k. Pair expressions are bound and frozen once to their own slots and
+// are evaluated with an empty Scratch, which turns their node caches off, so copies of a formula on other
+// threads only read them.
+template<class Field> class PairSum : public CloneableElement<Field, PairSum<Field> > {
+private:
+	typedef CloneableElement<Field, PairSum<Field> > Base;
+protected:
+	typedef std::shared_ptr< const Element<Field> > Pair;
+	struct Shared {
+		std::vector< std::vector<std::string> > particles;
+		std::vector<std::string> first, second;
+		// Other variables of the pair expression, slots after the placeholders
+		std::vector<std::string> parameters;
+		std::map< std::string, std::pair<unsigned int, unsigned int> > where;
+		std::map<const std::string, unsigned int> index;
+		std::mutex lock;
+		std::map< std::pair<const Element<Field>*, std::string>, Pair > derivatives;
+		// Slots of the coordinates from the last bind, nodes bound the same way share them
+		std::shared_ptr< const std::vector<int> > slots;
+		Pair bound(EL_UPTR expr) {
+			unsigned int nodes = 0;
+			expr->bind(index);
+			expr->freeze(nodes);
+			return Pair(expr.release());
+		}
+	};
+	std::shared_ptr<Shared> shared;
+	Pair pair;
+	int fixed;
+	// With fixed >= 0, the pairs (fixed, j > fixed) if fixed_first, else the pairs (i < fixed, fixed)
+	bool fixed_first;
+	std::shared_ptr< const std::vector<int> > slots;
+	std::vector<int> parameter_slots;
+	PairSum(std::shared_ptr<Shared> _shared, Pair _pair, int _fixed, bool _fixed_first) : Base(nullptr), shared(_shared), pair(_pair), fixed(_fixed), fixed_first(_fixed_first) { this->kind = KIND; }
+	// Derivative of a pair expression, computed once for every node sharing the particles
+	Pair derivativeOf(const Pair &expr, const std::string &name) const {
+		std::lock_guard<std::mutex> guard(shared->lock);
+		Pair &ret = shared->derivatives[std::make_pair(expr.get(), name)];
+		if (!ret) ret = shared->bound(expr->derivative(name));
+		return ret;
+	}
+	EL_UPTR part(const Pair &expr, int _fixed, bool _fixed_first) const {
+		if (expr->compareWithField(Field(0))) return EL_UPTR(new Constant<Field>(0));
+		return EL_UPTR(new PairSum<Field>(shared, expr, _fixed, _fixed_first));
+	}
+	// expr with the placeholders replaced by the coordinates of particles a and b
+	EL_UPTR instance(const Pair &expr, unsigned int a, unsigned int b) const {
+		std::map<const std::string, EL_UPTR > at;
+		for (unsigned int c = 0; c < shared->first.size(); c++) {
+			at[shared->first[c]] = EL_UPTR(new Variable<Field>(shared->particles[a][c]));
+			at[shared->second[c]] = EL_UPTR(new Variable<Field>(shared->particles[b][c]));
+		}
+		return std::move(expr->evaluate(at));
+	}
+	// Particles [begin, end) that take part in the pairs of this node
+	void range(unsigned int &begin, unsigned int &end) const {
+		unsigned int n = shared->particles.size();
+		begin = (fixed_first && (fixed >= 0)) ? fixed : 0;
+		end = (!fixed_first && (fixed >= 0)) ? fixed+1 : n;
+	}
+	// Pairs of particle a with the particles [begin, end), a takes the first placeholders if a_first
+	Field row(const std::vector<Field> &coordinates, const std::vector<Field> &parameters, unsigned int a, unsigned int begin, unsigned int end, bool a_first) const {
+		unsigned int d = shared->first.size(), width = 2*d+parameters.size();
+		Field ret = 0;
+		std::vector<Field> batch, out;
+		static thread_local Scratch<Field> empty;
+		typename Scratch<Field>::Use use(empty);
+		for (unsigned int start = begin; start < end; start += PAIRS_BATCH) {
+			unsigned int m = std::min(end-start, (unsigned int)PAIRS_BATCH);
+			batch.resize(width*m);
+			for (unsigned int c = 0; c < d; c++) {
+				unsigned int mine = a_first ? c : d+c, other = a_first ? d+c : c;
+				for (unsigned int k = 0; k < m; k++) {
+					batch[mine*m+k] = coordinates[a*d+c];
+					batch[other*m+k] = coordinates[(start+k)*d+c];
+				}
+			}
+			for (unsigned int i = 0; i < parameters.size(); i++) std::fill(batch.begin()+(2*d+i)*m, batch.begin()+(2*d+i+1)*m, parameters[i]);
+			pair->bevaluate(batch, m, out);
+			for (unsigned int k = 0; k < m; k++) ret += out[k];
+		}
+		return ret;
+	}
+	// coordinates[p*d+c] is coordinate c of particle p
+	Field accumulate(const std::vector<Field> &coordinates, const std::vector<Field> &parameters) const {
+		unsigned int n = shared->particles.size();
+		if (fixed == PAIRS_ALL) {
+			Field ret = 0;
+			for (unsigned int i = 0; i+1 < n; i++) ret += row(coordinates, parameters, i, i+1, n, true);
+			return ret;
+		}
+		if (fixed_first) return row(coordinates, parameters, fixed, fixed+1, n, true);
+		return row(coordinates, parameters, fixed, 0, fixed, false);
+	}
+public:
+	static const Kind KIND = KIND_PAIRS;
+	PairSum(EL_UPTR _pair, const std::vector< std::vector<std::string> > &_particles, const std::vector<std::string> &_first, const std::vector<std::string> &_second, EL_PTR _parent=nullptr) : Base(_parent), shared(new Shared()), fixed(PAIRS_ALL), fixed_first(true) {
+		shared->particles = _particles;
+		shared->first = _first;
+		shared->second = _second;
+		unsigned int d = _first.size();
+		for (unsigned int p = 0; p < _particles.size(); p++) {
+			for (unsigned int c = 0; c < d; c++) shared->where[_particles[p][c]] = std::make_pair(p, c);
+		}
+		std::set<std::string> names;
+		_pair->variables(names);
+		for (unsigned int c = 0; c < d; c++) {
+			names.erase(_first[c]);
+			names.erase(_second[c]);
+			shared->index[_first[c]] = c;
+			shared->index[_second[c]] = d+c;
+		}
+		shared->parameters.assign(names.begin(), names.end());
+		for (unsigned int i = 0; i < shared->parameters.size(); i++) shared->index[shared->parameters[i]] = 2*d+i;
+		pair = shared->bound(std::move(_pair));
+		this->kind = KIND;
+	}
+	PairSum(const PairSum<Field> &other) : Base(other), shared(other.shared), pair(other.pair), fixed(other.fixed), fixed_first(other.fixed_first) {}
+	const std::vector< std::vector<std::string> >& getParticles() const { return shared->particles; }
+	const Element<Field>& getPair() const { return *pair; }
+	int getFixed() const { return fixed; }
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const {
+		unsigned int d = shared->first.size(), begin, end;
+		range(begin, end);
+		std::vector<Field> coordinates(shared->particles.size()*d), parameters(shared->parameters.size());
+		for (unsigned int p = begin; p < end; p++) {
+			for (unsigned int c = 0; c < d; c++) {
+				auto found = values.find(shared->particles[p][c]);
+				if (found != values.end()) coordinates[p*d+c] = found->second;
+			}
+		}
+		for (unsigned int i = 0; i < parameters.size(); i++) {
+			auto found = values.find(shared->parameters[i]);
+			if (found != values.end()) parameters[i] = found->second;
+		}
+		return accumulate(coordinates, parameters);
+	}
+	virtual void bind(const std::map<const std::string, unsigned int> &index) {
+		Base::bind(index);
+		unsigned int d = shared->first.size(), begin, end;
+		range(begin, end);
+		std::vector<int> resolved(shared->particles.size()*d, -1);
+		for (unsigned int p = 0; p < shared->particles.size(); p++) {
+			for (unsigned int c = 0; c < d; c++) {
+				auto found = index.find(shared->particles[p][c]);
+				if (found == index.end()) continue;
+				resolved[p*d+c] = found->second;
+				if ((p >= begin) && (p < end)) this->deps.set(found->second);
+			}
+		}
+		{
+			std::lock_guard<std::mutex> guard(shared->lock);
+			if (!shared->slots || (*(shared->slots) != resolved)) shared->slots.reset(new std::vector<int>(std::move(resolved)));
+			slots = shared->slots;
+		}
+		parameter_slots.assign(shared->parameters.size(), -1);
+		for (unsigned int i = 0; i < parameter_slots.size(); i++) {
+			auto found = index.find(shared->parameters[i]);
+			if (found == index.end()) continue;
+			parameter_slots[i] = found->second;
+			this->deps.set(found->second);
+		}
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const {
+		if (!slots) return 0;
+		std::vector<Field> coordinates(slots->size()), parameters(parameter_slots.size());
+		for (unsigned int i = 0; i < coordinates.size(); i++) if ((*slots)[i] >= 0) coordinates[i] = values[(*slots)[i]];
+		for (unsigned int i = 0; i < parameters.size(); i++) if (parameter_slots[i] >= 0) parameters[i] = values[parameter_slots[i]];
+		return accumulate(coordinates, parameters);
+	}
+	virtual EL_UPTR derivative(const std::string &name) const {
+		auto found = shared->where.find(name);
+		if (found == shared->where.end()) {
+			if (!std::count(shared->parameters.begin(), shared->parameters.end(), name)) return EL_UPTR(new Constant<Field>(0));
+			return part(derivativeOf(pair, name), fixed, fixed_first);
+		}
+		int p = found->second.first;
+		unsigned int c = found->second.second;
+		std::vector< EL_UPTR > parts;
+		if (fixed == PAIRS_ALL) {
+			parts.push_back(std::move(part(derivativeOf(pair, shared->first[c]), p, true)));
+			parts.push_back(std::move(part(derivativeOf(pair, shared->second[c]), p, false)));
+		} else if (p == fixed) {
+			parts.push_back(std::move(part(derivativeOf(pair, fixed_first ? shared->first[c] : shared->second[c]), fixed, fixed_first)));
+		} else if (fixed_first && (p > fixed)) {
+			parts.push_back(std::move(instance(derivativeOf(pair, shared->second[c]), fixed, p)));
+		} else if (!fixed_first && (p < fixed)) {
+			parts.push_back(std::move(instance(derivativeOf(pair, shared->first[c]), p, fixed)));
+		}
+		return make_sum<Field>(parts);
+	}
+	// Substitution needs the terms, the pairs are written out one by one
+	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const {
+		unsigned int n = shared->particles.size();
+		std::unique_ptr< Sum<Field> > ret(new Sum<Field>());
+		if (fixed == PAIRS_ALL) {
+			ret->reserve(n*(n-1)/2);
+			for (unsigned int i = 0; i+1 < n; i++) {
+				for (unsigned int j = i+1; j < n; j++) ret->append(std::move(instance(pair, i, j)->evaluate(values)));
+			}
+		} else if (fixed_first) {
+			ret->generate(n-fixed-1, [&](unsigned int k) { return std::move(instance(pair, fixed, fixed+1+k)->evaluate(values)); });
+		} else {
+			ret->generate(fixed, [&](unsigned int k) { return std::move(instance(pair, k, fixed)->evaluate(values)); });
+		}
+		return std::move(ret);
+	}
+	virtual void variables(std::set<std::string> &names) const {
+		unsigned int begin, end;
+		range(begin, end);
+		for (unsigned int p = begin; p < end; p++) names.insert(shared->particles[p].begin(), shared->particles[p].end());
+		std::set<std::string> inner;
+		pair->variables(inner);
+		for (auto name = shared->parameters.begin(); name != shared->parameters.end(); name++) if (inner.count(*name)) names.insert(*name);
+	}
+	virtual std::ostream& print(std::ostream &os) const {
+		if (fixed == PAIRS_ALL) os<<"\\sum_{i<j}{";
+		else if (fixed_first) os<<"\\sum_{j>"<<fixed<<"}{";
+		else os<<"\\sum_{i<"<<fixed<<"}{";
+		os<<*pair<<"}";
+		return os;
+	}
 };
 
 template<class Field> class Differential : public Element<Field> {
@@ -970,23 +2018,152 @@ protected:
 	Element<Field> *expression;
 };
 
+// Source tree seen through a table of variable bindings. Nothing is copied until
+// the view is mutated, then the substituted tree is built once and owned by the view.
+template<class Field> class Substitution : public CloneableElement<Field, Substitution<Field> > {
+private:
+	typedef CloneableElement<Field, Substitution<Field> > Base;
+protected:
+	const Element<Field> *source;
+	std::map<const std::string, EL_SPTR > bindings;
+	EL_UPTR materialized;
+	EL_UPTR build() const {
+		std::map<const std::string, EL_UPTR > values;
+		for (auto binding = bindings.begin(); binding != bindings.end(); binding++) values[binding->first] = std::move(binding->second->clone());
+		return std::move(source->evaluate(values));
+	}
+public:
+	static const Kind KIND = KIND_SUBSTITUTION;
+	Substitution(const Element<Field> *_source, const std::map<const std::string, EL_SPTR > &_bindings, EL_PTR _parent=nullptr) : Base(_parent), source(_source), bindings(_bindings) { this->kind = KIND; }
+	Substitution(const Substitution<Field> &other) : Base(other), source(other.getSource()), bindings(other.getBindings()) {
+		if (other.isMaterialized()) {
+			materialized = std::move(other.getMaterialized()->clone());
+			materialized->setParent(this);
+		}
+	}
+	const Element<Field>* getSource() const { return source; }
+	const std::map<const std::string, EL_SPTR >& getBindings() const { return bindings; }
+	bool isMaterialized() const { return materialized != nullptr; }
+	const EL_UPTR& getMaterialized() const { return materialized; }
+	// Builds the substituted tree, after this the view is its only child
+	void materialize() {
+		if (materialized) return;
+		materialized = std::move(build());
+		materialized->setParent(this);
+		materialized->setId(0);
+	}
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const {
+		if (materialized) return materialized->nevaluate(values, power_precision);
+		std::map<const std::string, Field> inner(values);
+		for (auto binding = bindings.begin(); binding != bindings.end(); binding++) inner[binding->first] = binding->second->nevaluate(values, power_precision);
+		return source->nevaluate(inner, power_precision);
+	}
+	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const {
+		if (materialized) return std::move(materialized->evaluate(values));
+		return std::move(build()->evaluate(values));
+	}
+	virtual EL_UPTR derivative(const std::string &name) const {
+		if (materialized) return std::move(materialized->derivative(name));
+		return std::move(build()->derivative(name));
+	}
+	virtual void variables(std::set<std::string> &names) const {
+		if (materialized) { materialized->variables(names); return; }
+		std::set<std::string> inner;
+		source->variables(inner);
+		for (auto name = inner.begin(); name != inner.end(); name++) {
+			auto binding = bindings.find(*name);
+			if (binding == bindings.end()) names.insert(*name);
+			else binding->second->variables(names);
+		}
+	}
+	virtual void bind(const std::map<const std::string, unsigned int> &index) {
+		Base::bind(index);
+		materialize();
+		materialized->bind(index);
+		this->deps.merge(materialized->getDependencies());
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const { return materialized ? materialized->ievaluate(values, changed) : 0; }
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const {
+		if (materialized) materialized->bevaluate(values, n, out);
+		else out.assign(n, Field(0));
+	}
+	virtual void canonify() { materialize(); materialized->canonify(); }
+	virtual unsigned int arity() const { return materialized ? 1 : 0; }
+	virtual EL_PTR getChild(unsigned int i) const { return materialized.get(); }
+	virtual void simplifyObject() { materialize(); Base::simplifyObject(); }
+	virtual void collect() { materialize(); materialized->collect(); }
+	virtual void replaceById(const unsigned int _id, EL_UPTR elem) {
+		materialized = std::move(elem);
+		materialized->setParent(this);
+		materialized->setId(0);
+	}
+	virtual void removeById(const unsigned int _id) { materialized = EL_UPTR(new Constant<Field>(0)); }
+	virtual std::ostream& print(std::ostream& os) const {
+		if (materialized) return materialized->print(os);
+		os<<"\\left.{"<<*source<<"}\\right|_{";
+		for (auto binding = bindings.begin(); binding != bindings.end(); binding++) {
+			if (binding != bindings.begin()) os<<",";
+			os<<binding->first<<"="<<*(binding->second);
+		}
+		os<<"}";
+		return os;
+	}
+};
+
 	
 template<class Field> class Formula : public CloneableElement<Field, Formula<Field> > {
 private:
 	EL_UPTR root;
 	typedef CloneableElement<Field, Formula<Field> > Base;
+	std::map<const std::string, unsigned int> bound;
+	mutable std::vector<Field> last_values;
+	mutable Dependencies changed;
 public:
-	Formula(const Formula<Field> &_formula) : Base(nullptr), root(std::move((_formula.getRoot())->clone())) {}
-	Formula(EL_UPTR _root, EL_PTR _parent=nullptr) : root(std::move(_root)), Base(_parent)  { root->setParent(this); }
+	using Element<Field>::ievaluate;
+	static const Kind KIND = KIND_FORMULA;
+	Formula(const Formula<Field> &_formula) : Base(_formula), root(std::move((_formula.getRoot())->clone())) { root->setParent(this); if (!_formula.getBinding().empty()) bind(_formula.getBinding()); }
+	Formula(EL_UPTR _root, EL_PTR _parent=nullptr) : root(std::move(_root)), Base(_parent)  { root->setParent(this); this->kind = KIND; }
 	virtual EL_UPTR evaluate(const std::map<const std::string, EL_UPTR > &values) const { return std::move(root->evaluate(values)); }
-	virtual Field nevaluate(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const { return root->nevaluate(values); }
-	virtual void simplifyObject() {	root->simplifyObject();	}
+	virtual Field ncompute(std::map<const std::string, Field> values, int power_precision = DEFAULT_POWER_PRECISION) const { return root->nevaluate(values, power_precision); }
+	// A formula that is not part of a tree must have a slot for each of its free variables
+	virtual void bind(const std::map<const std::string, unsigned int> &index) {
+		if (this->parent == nullptr) require_bound(*root, index);
+		Base::bind(index);
+		root->bind(index);
+		this->deps.merge(root->getDependencies());
+		bound = index;
+		last_values.clear();
+	}
+	const std::map<const std::string, unsigned int>& getBinding() const { return bound; }
+	// Variable names[i] takes values[i] in ievaluate, throws std::invalid_argument if a variable is not in names
+	void bind(const std::vector<std::string> &names) {
+		std::map<const std::string, unsigned int> index;
+		for (unsigned int i = 0; i < names.size(); i++) index[names[i]] = i;
+		bind(index);
+	}
+	virtual Field icompute(const std::vector<Field> &values, const Dependencies &changed) const { return root->ievaluate(values, changed); }
+	virtual void bcompute(const std::vector<Field> &values, unsigned int n, std::vector<Field> &out) const { root->bevaluate(values, n, out); }
+	// Compares with the previous call and recomputes only subtrees whose variables changed
+	Field ievaluate(const std::vector<Field> &values) const {
+		changed.clear();
+		for (unsigned int i = 0; i < values.size(); i++) {
+			if ((i >= last_values.size()) || (values[i] != last_values[i])) changed.set(i);
+		}
+		last_values = values;
+		return root->ievaluate(values, changed);
+	}
+	virtual EL_UPTR derivative(const std::string &name) const { return std::move(root->derivative(name)); }
+	virtual unsigned int arity() const { return 1; }
+	virtual EL_PTR getChild(unsigned int i) const { return root.get(); }
 	virtual std::ostream& print(std::ostream& os) const {
 		os<<*root;
 		return os;
 	}
 	virtual void replaceById(const unsigned int _id, EL_UPTR elem) {
 		root = std::move(elem);
+		root->setParent(this);
+		if (!bound.empty()) root->bind(bound);
+		last_values.clear();
 	}
 	virtual void collect() {
 		root->collect();
@@ -995,14 +2172,72 @@ public:
 		root = EL_UPTR(new Constant<Field>(0));
 	}
 	virtual const EL_UPTR& getRoot() const { return root; }
+	void expand(unsigned int max_terms = DEFAULT_EXPAND_TERMS, unsigned int max_depth = DEFAULT_EXPAND_DEPTH, unsigned int threads = 1) { replaceById(0, Expander<Field>(max_terms, max_depth, threads).expand(*root)); }
+	void compress(unsigned int max_terms = DEFAULT_EXPAND_TERMS, unsigned int max_depth = DEFAULT_EXPAND_DEPTH) { replaceById(0, Expander<Field>(max_terms, max_depth).compress(*root)); }
+	void together(unsigned int max_terms = DEFAULT_EXPAND_TERMS, unsigned int max_depth = DEFAULT_EXPAND_DEPTH) { replaceById(0, Expander<Field>(max_terms, max_depth).together(*root)); }
+	virtual void variables(std::set<std::string> &names) const { root->variables(names); }
 };
 
+// Throws std::invalid_argument naming the first free variable of el without a slot in index
+template<class Field> void require_bound(const Element<Field> &el, const std::map<const std::string, unsigned int> &index) {
+	std::set<std::string> names;
+	el.variables(names);
+	for (auto name = names.begin(); name != names.end(); name++) {
+		if (index.count(*name) == 0) throw std::invalid_argument("variable "+*name+" is not bound");
+	}
+}
+
+template<class Field> EL_UPTR make_sum(std::vector< EL_UPTR > &terms) {
+	std::vector< EL_UPTR > nonzero;
+	for (auto term = terms.begin(); term != terms.end(); term++) {
+		if (!((**term)==Field(0))) nonzero.push_back(std::move(*term));
+	}
+	if (nonzero.size() == 0) return EL_UPTR(new Constant<Field>(0));
+	if (nonzero.size() == 1) return std::move(nonzero[0]);
+	Sum<Field> *ret = new Sum<Field>();
+	for (auto term = nonzero.begin(); term != nonzero.end(); term++) ret->append(std::move(*term));
+	return EL_UPTR(ret);
+}
+
+// Sum of term(i) for i = 0..n-1, built in one pass without copies
+template<class Field, class Generator> std::unique_ptr< Sum<Field> > generate_sum(unsigned int n, Generator term) {
+	std::unique_ptr< Sum<Field> > ret(new Sum<Field>());
+	ret->generate(n, term);
+	return ret;
+}
+
+template<class Field, class Generator> std::unique_ptr< Product<Field> > generate_product(unsigned int n, Generator term) {
+	std::unique_ptr< Product<Field> > ret(new Product<Field>());
+	ret->generate(n, term);
+	return ret;
+}
+
+template<class Field> EL_UPTR make_product(std::vector< EL_UPTR > &terms) {
+	std::vector< EL_UPTR > nontrivial;
+	for (auto term = terms.begin(); term != terms.end(); term++) {
+		if ((**term)==Field(0)) return EL_UPTR(new Constant<Field>(0));
+		if (!((**term)==Field(1))) nontrivial.push_back(std::move(*term));
+	}
+	if (nontrivial.size() == 0) return EL_UPTR(new Constant<Field>(1));
+	if (nontrivial.size() == 1) return std::move(nontrivial[0]);
+	Product<Field> *ret = new Product<Field>();
+	for (auto term = nontrivial.begin(); term != nontrivial.end(); term++) ret->append(std::move(*term));
+	return EL_UPTR(ret);
+}
+
+}
+}
+
+#include "elementary.hpp"
+#include "rewrite.hpp"
+#include "expand.hpp"
+#include "frozen.hpp"
+#include "profile.hpp"
+#include "plan.hpp"
+
 #undef EL_PTR
 #undef EL_UPTR
 #undef EL_SPTR
 #undef VA_UPTR
 
-}
-}
-
 #endif // VARINT_FORMULA_HPP
\ No newline at end of file
@@ -0,0 +1,115 @@
+#ifndef VARINT_FROZEN_HPP
+#define VARINT_FROZEN_HPP
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <atomic>
+#include "formula.hpp"
+
+namespace varint {
+namespace formula {
+
+#ifndef EL_UPTR
+#define EL_PTR Element<Field> *
+#define EL_UPTR std::unique_ptr< Element<Field> >
+#define FROZEN_UNDEF_MACROS
+#endif
+
+// Immutable handle on a formula and its gradient that any number of threads can evaluate at once.
+// The trees are bound and numbered once and never written afterwards, every thread keeps its
+// incremental cache in its own Scratch. Copies share the trees.
+template<class Field> class FrozenFormula {
+protected:
+	struct Tree {
+		// Root 0 is the formula, root i+1 its derivative by names[i]
+		std::vector< std::unique_ptr< Formula<Field> > > roots;
+		std::vector<std::string> names;
+		unsigned int nodes;
+		// Never reused, unlike the address of a freed tree
+		unsigned long id;
+	};
+	std::shared_ptr<const Tree> tree;
+	static unsigned long nextId() {
+		static std::atomic<unsigned long> next(0);
+		return ++next;
+	}
+	// Scratches of the calls without one, one per tree on each thread, dropped after their tree
+	Scratch<Field>& local() const {
+		static thread_local std::map< unsigned long, std::pair< std::weak_ptr<const Tree>, Scratch<Field> > > scratches;
+		auto found = scratches.find(tree->id);
+		if (found != scratches.end()) return found->second.second;
+		for (auto entry = scratches.begin(); entry != scratches.end(); ) {
+			if (entry->second.first.expired()) entry = scratches.erase(entry);
+			else entry++;
+		}
+		std::pair< std::weak_ptr<const Tree>, Scratch<Field> > &entry = scratches[tree->id];
+		entry.first = tree;
+		entry.second = scratch();
+		return entry.second;
+	}
+	Field evaluateRoot(unsigned int r, const std::vector<Field> &values, Scratch<Field> &scratch) const {
+		std::vector<Field> &last = scratch.last_values[r];
+		Dependencies changed;
+		for (unsigned int i = 0; i < values.size(); i++) {
+			if ((i >= last.size()) || (values[i] != last[i])) changed.set(i);
+		}
+		last = values;
+		return tree->roots[r]->getRoot()->ievaluate(values, changed);
+	}
+public:
+	FrozenFormula(const Element<Field> &source, const std::vector<std::string> &names, bool gradient = true) {
+		std::shared_ptr<Tree> building(new Tree());
+		building->names = names;
+		building->nodes = 0;
+		building->id = nextId();
+		building->roots.push_back(std::unique_ptr< Formula<Field> >(new Formula<Field>(source.clone())));
+		if (gradient) {
+			for (auto name = names.begin(); name != names.end(); name++) building->roots.push_back(std::unique_ptr< Formula<Field> >(new Formula<Field>(source.derivative(*name))));
+		}
+		for (auto root = building->roots.begin(); root != building->roots.end(); root++) {
+			(*root)->bind(names);
+			(*root)->freeze(building->nodes);
+		}
+		tree = building;
+	}
+	const std::vector<std::string>& getNames() const { return tree->names; }
+	bool hasGradient() const { return tree->roots.size() > 1; }
+	const Formula<Field>& getRoot(unsigned int r = 0) const { return *(tree->roots[r]); }
+	// Fresh evaluation state for one thread
+	Scratch<Field> scratch() const { return Scratch<Field>(tree->nodes, tree->roots.size()); }
+	// values[i] is the value of getNames()[i], scratch belongs to the calling thread
+	Field evaluate(const std::vector<Field> &values, Scratch<Field> &scratch) const {
+		typename Scratch<Field>::Use use(scratch);
+		return evaluateRoot(0, values, scratch);
+	}
+	Field evaluate(const std::vector<Field> &values) const { return evaluate(values, local()); }
+	// out[i] is the partial derivative by getNames()[i]
+	void gradient(const std::vector<Field> &values, Scratch<Field> &scratch, std::vector<Field> &out) const {
+		typename Scratch<Field>::Use use(scratch);
+		out.resize(tree->names.size());
+		for (unsigned int i = 0; i < out.size(); i++) out[i] = (i+1 < tree->roots.size()) ? evaluateRoot(i+1, values, scratch) : Field(0);
+	}
+	void gradient(const std::vector<Field> &values, std::vector<Field> &out) const { gradient(values, local(), out); }
+	// Names missing from values are taken as 0
+	Field nevaluate(const std::map<const std::string, Field> &values) const {
+		std::vector<Field> row(tree->names.size());
+		for (unsigned int i = 0; i < row.size(); i++) {
+			auto found = values.find(tree->names[i]);
+			if (found != values.end()) row[i] = found->second;
+		}
+		return evaluate(row);
+	}
+};
+
+#ifdef FROZEN_UNDEF_MACROS
+#undef EL_PTR
+#undef EL_UPTR
+#undef FROZEN_UNDEF_MACROS
+#endif
+
+}
+}
+
+#endif // VARINT_FROZEN_HPP
@@ -0,0 +1,131 @@
+#ifndef VARINT_GALERKIN_HPP
+#define VARINT_GALERKIN_HPP
+
+#include "libvarint.hpp"
+#include "quadrature.hpp"
+
+namespace varint {
+
+// Galerkin discrete Lagrangian: q(t) is a polynomial of degree `order` through equally spaced
+// control points q^0..q^order, the action over a step is computed with Quadrature.
+// With GaussLegendre<order> the scheme is of order 2*order.
+template<class PhaseSpace, unsigned int order = 2, class Quadrature = quadrature::GaussLegendre<order> > class GalerkinIntegrator : public BaseIntegrator<PhaseSpace> {
+private:
+	typedef BaseIntegrator<PhaseSpace> Base;
+	static_assert(order >= 1, "Galerkin integrator needs at least linear interpolation");
+public:
+	typedef typename Base::Field Field;
+protected:
+	// Lagrange basis and its derivative at quadrature nodes, [node*(order+1) + control point]
+	Field phi[Quadrature::points*(order+1)];
+	Field dphi[Quadrature::points*(order+1)];
+	// Basis derivative at the end of the step
+	Field dphi_end[order+1];
+	static Field basis(unsigned int k, Field tau) {
+		Field ret = 1;
+		for (unsigned int m = 0; m <= order; m++) if (m != k) ret *= (tau*order - m)/(Field(k) - m);
+		return ret;
+	}
+	static Field basisDerivative(unsigned int k, Field tau) {
+		Field ret = 0;
+		for (unsigned int l = 0; l <= order; l++) {
+			if (l == k) continue;
+			Field term = Field(order)/(Field(k) - l);
+			for (unsigned int m = 0; m <= order; m++) if ((m != k) && (m != l)) term *= (tau*order - m)/(Field(k) - m);
+			ret += term;
+		}
+		return ret;
+	}
+public:
+	GalerkinIntegrator(formula::Formula<Field> _L, double _t0, double _t1, double _t_step, PhaseSpace _initial_pos)
+	: BaseIntegrator<PhaseSpace>(_L, _t0, _t1, _t_step, _initial_pos) {
+		this->setSlots(Quadrature::points);
+		for (unsigned int j = 0; j < Quadrature::points; j++) {
+			for (unsigned int k = 0; k <= order; k++) {
+				phi[j*(order+1)+k] = basis(k, Quadrature::nodes[j]);
+				dphi[j*(order+1)+k] = basisDerivative(k, Quadrature::nodes[j]);
+			}
+		}
+		for (unsigned int k = 0; k <= order; k++) dphi_end[k] = basisDerivative(k, 1);
+	}
+	virtual void step() {
+		unsigned int n = this->position.size();
+		std::vector<Field> x(order*n), g;
+		for (unsigned int k = 1; k <= order; k++) {
+			for (unsigned int i = 0; i < n; i++) x[(k-1)*n+i] = this->position.q[i] + this->t_step*this->position.v[i]*k/order;
+		}
+		this->solve(x);
+		stageGradients(x, g);
+		for (unsigned int i = 0; i < n; i++) {
+			Field v = dphi_end[0]*this->position.q[i];
+			for (unsigned int k = 1; k <= order; k++) v += dphi_end[k]*x[(k-1)*n+i];
+			this->position.v[i] = v/this->t_step;
+			this->position.p[i] = g[order*n+i];
+			this->position.q[i] = x[(order-1)*n+i];
+		}
+		this->project();
+		this->t += this->t_step;
+	}
+	// Discrete action of the step with control points x, L is evaluated at all quadrature nodes in one pass
+	Field action(const std::vector<Field> &x) const {
+		const unsigned int m = Quadrature::points;
+		unsigned int n = this->position.size();
+		std::vector<Field> qv(2*n*m), L;
+		for (unsigned int j = 0; j < m; j++) {
+			const Field *ph = phi + j*(order+1);
+			const Field *dph = dphi + j*(order+1);
+			for (unsigned int i = 0; i < n; i++) {
+				Field q = ph[0]*this->position.q[i], v = dph[0]*this->position.q[i];
+				for (unsigned int k = 1; k <= order; k++) {
+					q += ph[k]*x[(k-1)*n+i];
+					v += dph[k]*x[(k-1)*n+i];
+				}
+				qv[i*m+j] = q;
+				qv[(n+i)*m+j] = v/this->t_step;
+			}
+		}
+		this->lagrangians(qv, m, L);
+		Field ret = 0;
+		for (unsigned int j = 0; j < m; j++) ret += Quadrature::weights[j]*L[j];
+		return ret*this->t_step;
+	}
+protected:
+	// g[k*n+i] = dS/dq^k_i where S is the quadrature of the action over the step
+	void stageGradients(const std::vector<Field> &x, std::vector<Field> &g) const {
+		unsigned int n = this->position.size();
+		std::vector<Field> q(n), v(n), fq, fv;
+		g.assign((order+1)*n, 0);
+		for (unsigned int j = 0; j < Quadrature::points; j++) {
+			const Field *ph = phi + j*(order+1);
+			const Field *dph = dphi + j*(order+1);
+			for (unsigned int i = 0; i < n; i++) {
+				q[i] = ph[0]*this->position.q[i];
+				v[i] = dph[0]*this->position.q[i];
+				for (unsigned int k = 1; k <= order; k++) {
+					q[i] += ph[k]*x[(k-1)*n+i];
+					v[i] += dph[k]*x[(k-1)*n+i];
+				}
+				v[i] /= this->t_step;
+			}
+			this->gradient(q, v, fq, fv, j);
+			for (unsigned int k = 0; k <= order; k++) {
+				for (unsigned int i = 0; i < n; i++) g[k*n+i] += Quadrature::weights[j]*(this->t_step*ph[k]*fq[i] + dph[k]*fv[i]);
+			}
+		}
+	}
+	// p_k + dS/dq^0 = 0 and dS/dq^k = 0 for the inner control points
+	virtual void residual(const std::vector<Field> &x, std::vector<Field> &r) {
+		unsigned int n = this->position.size();
+		std::vector<Field> g;
+		stageGradients(x, g);
+		r.assign(order*n, 0);
+		for (unsigned int i = 0; i < n; i++) r[i] = this->position.p[i] + g[i];
+		for (unsigned int k = 1; k < order; k++) {
+			for (unsigned int i = 0; i < n; i++) r[k*n+i] = g[k*n+i];
+		}
+	}
+};
+
+}
+
+#endif // VARINT_GALERKIN_HPP
@@ -1,15 +1,50 @@
 #ifndef VARINT_HAMILTON_HPP
 #define VARINT_HAMILTON_HPP
 
-#include "lie"
+#include "libvarint.hpp"
 
 namespace varint {
 
+// Midpoint discrete Lagrangian L_d(q0,q1) = h L((q0+q1)/2, (q1-q0)/h), second order
 template<class PhaseSpace> class HamiltonIntegrator : public BaseIntegrator<PhaseSpace> {
-	HamiltonIntegrator(Fomula<S> _L, double _t0, double _t1, double _t_step, S _initial_pos) 
+private:
+	typedef BaseIntegrator<PhaseSpace> Base;
+public:
+	typedef typename Base::Field Field;
+	HamiltonIntegrator(formula::Formula<Field> _L, double _t0, double _t1, double _t_step, PhaseSpace _initial_pos)
 	: BaseIntegrator<PhaseSpace>(_L, _t0, _t1, _t_step, _initial_pos) {}
-}
+	virtual void step() {
+		std::vector<Field> x(this->position.q), fq, fv;
+		for (unsigned int i = 0; i < x.size(); i++) x[i] += this->t_step*this->position.v[i];
+		// r = p + h/2 dL/dq - M (x-q)/h - dL/dv(v = 0), so -M/h is the leading part of the Jacobian
+		if (!this->massSolve(x, this->t_step)) this->solve(x);
+		midpoint(x, fq, fv);
+		for (unsigned int i = 0; i < x.size(); i++) {
+			this->position.p[i] = this->t_step*fq[i]/2 + fv[i];
+			this->position.v[i] = (x[i] - this->position.q[i])/this->t_step;
+		}
+		this->position.q = x;
+		this->project();
+		this->t += this->t_step;
+	}
+protected:
+	void midpoint(const std::vector<Field> &q1, std::vector<Field> &fq, std::vector<Field> &fv) const {
+		std::vector<Field> qm(q1.size()), vm(q1.size());
+		for (unsigned int i = 0; i < q1.size(); i++) {
+			qm[i] = (this->position.q[i] + q1[i])/2;
+			vm[i] = (q1[i] - this->position.q[i])/this->t_step;
+		}
+		this->gradient(qm, vm, fq, fv);
+	}
+	// p_k + D_1 L_d(q_k, q_{k+1}) = 0
+	virtual void residual(const std::vector<Field> &x, std::vector<Field> &r) {
+		std::vector<Field> fq, fv;
+		midpoint(x, fq, fv);
+		r.resize(x.size());
+		for (unsigned int i = 0; i < x.size(); i++) r[i] = this->position.p[i] + this->t_step*fq[i]/2 - fv[i];
+	}
+};
 
 }
 
-#endif
\ No newline at end of file
+#endif
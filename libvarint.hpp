@@ -1,42 +1,600 @@
 #ifndef VARINT_HPP
 #define VARINT_HPP
 
-#include "hamiltonint"
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cstddef>
+#include "formula.hpp"
+#include "lie.hpp"
+#include "sparse.hpp"
 
 namespace varint {
 
+#define DEFAULT_NEWTON_TOLERANCE 1e-12
+#define DEFAULT_NEWTON_ITERATIONS 50
+#define SPARSE_JACOBIAN_DENSITY 0.25
+
+template<class PhaseSpace> class BaseIntegrator;
+
+// Dependence of L on the velocities: M = d^2L/dv^2 depends on velocities, only on coordinates, or is constant
+enum Kinetic { KINETIC_GENERAL, KINETIC_QUADRATIC, KINETIC_CONSTANT };
+
 template<class PhaseSpace> class PhaseSpaceIterator {
 private:
 	BaseIntegrator<PhaseSpace> & integrator;
 	double cur_timestep;
 public:
-	PhaseSpaceIterator(BaseIntegrator<PhaseSpaceIterator> & _integrator, double _cur_timestep) 
+	PhaseSpaceIterator(BaseIntegrator<PhaseSpace> & _integrator, double _cur_timestep)
 	: integrator(_integrator), cur_timestep(_cur_timestep) {}
-	PhaseSpaceIterator & operator++() { integrator.step(); return *this; }
-
-}
+	PhaseSpaceIterator & operator++() { integrator.step(); cur_timestep = integrator.getTime(); return *this; }
+	PhaseSpaceIterator operator++(int) { PhaseSpaceIterator ret(*this); ++(*this); return ret; }
+	const PhaseSpace & operator*() const { return integrator.getPosition(); }
+	const PhaseSpace * operator->() const { return &integrator.getPosition(); }
+	double getTime() const { return cur_timestep; }
+	// Against the live end time of the integrator, which a terminal event may move after end() was taken
+	bool operator != (const PhaseSpaceIterator &other) const { return cur_timestep + integrator.getTimeStep()/2 < std::min(other.getTime(), integrator.getEndTime()); }
+	bool operator == (const PhaseSpaceIterator &other) const { return !(*this != other); }
+};
 
-template<class PhaseSpace> BaseIntegrator {
-private:
-	Formula<S> formula;
-	double t0;
-	double t1;
-	double t_step;
-	PhaseSpace initial_position;
+template<class PhaseSpace> class BaseIntegrator {
 public:
+	typedef typename PhaseSpace::Field Field;
+	// Precision of the matrices of the mixed precision mode
+	typedef float Lower;
 	typedef PhaseSpaceIterator<PhaseSpace> iterator;
 	typedef ptrdiff_t difference_type;
 	typedef size_t size_type;
 	typedef PhaseSpace value_type;
 	typedef PhaseSpace * pointer;
 	typedef PhaseSpace & reference;
-	iterator begin() { return iterator( *this, t0); }
+protected:
+	formula::Formula<Field> formula;
+	double t0;
+	double t1;
+	double t_step;
+	PhaseSpace initial_position;
+	PhaseSpace position;
+	double t;
+	// dL/dq_i and dL/dv_i
+	std::vector< formula::Formula<Field> > dLdq;
+	std::vector< formula::Formula<Field> > dLdv;
+	// All of dLdq and dLdv in one plan that computes their common subtrees once, one copy per evaluation
+	// point so that every copy only recomputes what changed since its previous evaluation
+	mutable std::vector< formula::EvaluationPlan<Field> > gradient_plan;
+	mutable std::vector< std::vector<Field> > slot_values;
+	Field newton_tolerance;
+	unsigned int newton_iterations;
+	// coupling[i] holds coordinates that dL/dq_i, dL/dv_i depend on
+	std::vector< std::set<unsigned int> > coupling;
+	SparsePattern pattern;
+	SparseMatrix<Field> sparse_jacobian;
+	bool use_sparse;
+	// Holonomic constraints g_a(q) = 0 and their gradients dg_a/dq_i, evaluated together by constraint_plan
+	std::vector< formula::Formula<Field> > constraints;
+	std::vector< std::vector< formula::Formula<Field> > > constraint_dq;
+	mutable std::vector< formula::EvaluationPlan<Field> > constraint_plan;
+	mutable std::vector<Field> constraint_values;
+	// G(q_k) at the start of the step, [a*n+i], fixed during the Newton iterations of the step
+	std::vector<Field> start_jacobian;
+	Kinetic kinetic;
+	bool mass_solve;
+	// Entries of M that are not identically zero by row, (column, entry), evaluated together by mass_plan
+	std::vector< std::vector< std::pair<unsigned int, formula::Formula<Field> > > > mass;
+	std::vector< formula::EvaluationPlan<Field> > mass_plan;
+	bool mass_diagonal;
+	// LU factors of M (the diagonal if M is diagonal) and row pivots, kept for the whole run if M is constant,
+	// mass_lower instead of mass_lu in the mixed precision mode
+	std::vector<Field> mass_lu;
+	std::vector<Lower> mass_lower;
+	std::vector<unsigned int> mass_pivot;
+	bool mass_factored;
+	// Mixed precision: M and the Newton matrices factored in Lower, residuals and updates in Field.
+	// The largest relative rounding bound of the Lower entries of M and relative residual of a Lower solve.
+	bool mixed;
+	Field mass_bound;
+	Field solve_error;
+public:
+	iterator begin() { reset(); return iterator( *this, t0); }
 	iterator end() { return iterator( *this, t1); }
 public:
-	BaseIntegrator(Fomula<S> _F, double _t0, double _t1, double _t_step, S _initial_pos) 
-	: formula(_F), t0(_t0), t1(_t1), t_step(_t_step), initial_position(_initial_pos) {}
-	void step() {  }
-}
-	
+	BaseIntegrator(formula::Formula<Field> _F, double _t0, double _t1, double _t_step, PhaseSpace _initial_pos)
+	: formula(_F), t0(_t0), t1(_t1), t_step(_t_step), initial_position(_initial_pos), t(_t0), newton_tolerance(DEFAULT_NEWTON_TOLERANCE), newton_iterations(DEFAULT_NEWTON_ITERATIONS), use_sparse(false), kinetic(KINETIC_GENERAL), mass_solve(true), mass_diagonal(true), mass_factored(false), mixed(false), mass_bound(0), solve_error(0) {
+		std::vector<std::string> names(initial_position.coordinates);
+		names.insert(names.end(), initial_position.velocities.begin(), initial_position.velocities.end());
+		std::vector<const formula::Element<Field>*> roots;
+		for (unsigned int i = 0; i < initial_position.size(); i++) {
+			dLdq.push_back(formula::Formula<Field>(std::move(formula.derivative(initial_position.coordinates[i]))));
+			dLdv.push_back(formula::Formula<Field>(std::move(formula.derivative(initial_position.velocities[i]))));
+		}
+		for (unsigned int i = 0; i < initial_position.size(); i++) roots.push_back(&dLdq[i]);
+		for (unsigned int i = 0; i < initial_position.size(); i++) roots.push_back(&dLdv[i]);
+		gradient_plan.push_back(formula::EvaluationPlan<Field>(roots, names));
+		formula.bind(names);
+		slot_values.resize(1);
+		detectKinetic(names);
+		reset();
+	}
+protected:
+	// Only binds F, for integrators that leave all the steps to another integrator and never need its gradient
+	BaseIntegrator(formula::Formula<Field> _F, double _t0, double _t1, PhaseSpace _initial_pos)
+	: formula(_F), t0(_t0), t1(_t1), t_step(0), initial_position(_initial_pos), position(_initial_pos), t(_t0), newton_tolerance(DEFAULT_NEWTON_TOLERANCE), newton_iterations(DEFAULT_NEWTON_ITERATIONS), use_sparse(false), kinetic(KINETIC_GENERAL), mass_solve(true), mass_diagonal(true), mass_factored(false), mixed(false), mass_bound(0), solve_error(0) {
+		std::vector<std::string> names(initial_position.coordinates);
+		names.insert(names.end(), initial_position.velocities.begin(), initial_position.velocities.end());
+		formula.bind(names);
+	}
+public:
+	virtual ~BaseIntegrator() {}
+	virtual void step() {  }
+	virtual void reset() {
+		std::vector<Field> fq;
+		position = initial_position;
+		t = t0;
+		mass_bound = solve_error = 0;
+		gradient(position.q, position.v, fq, position.p);
+		project();
+	}
+	const PhaseSpace & getPosition() const { return position; }
+	double getTime() const { return t; }
+	double getTimeStep() const { return t_step; }
+	double getEndTime() const { return t1; }
+	virtual void setNewtonTolerance(Field _tolerance) { newton_tolerance = _tolerance; }
+	virtual void setNewtonIterations(unsigned int _iterations) { newton_iterations = _iterations; }
+	virtual Kinetic getKinetic() const { return kinetic; }
+	// Steps of quadratic Lagrangians iterate with the factored mass matrix instead of Newton, on by default
+	virtual void setMassSolve(bool _enabled) { mass_solve = _enabled; }
+	// Evaluates and factors M, and factors the Newton Jacobians, in Lower, off by default. The residuals, their
+	// convergence test and the updates of the unknowns stay in Field, so the steps converge to the same tolerance.
+	virtual void setMixedPrecision(bool _mixed) { mixed = _mixed; mass_factored = false; }
+	virtual bool getMixedPrecision() const { return mixed; }
+	// Since the last reset: the largest first order rounding bound of an entry of M evaluated in Lower, relative
+	// to the largest entry, and the largest |J d - r|/|r| of a Newton step d solved in Lower
+	virtual Field getMassBound() const { return mass_bound; }
+	virtual Field getSolveError() const { return solve_error; }
+	virtual const SparsePattern & getPattern() const { return pattern; }
+	// Adds the holonomic constraint g(q) = 0, the initial position must satisfy it
+	virtual void addConstraint(const formula::Formula<Field> &g) {
+		std::vector<std::string> names(initial_position.coordinates);
+		names.insert(names.end(), initial_position.velocities.begin(), initial_position.velocities.end());
+		constraints.push_back(g);
+		constraint_dq.push_back(std::vector< formula::Formula<Field> >());
+		for (unsigned int i = 0; i < initial_position.size(); i++) {
+			constraint_dq.back().push_back(formula::Formula<Field>(std::move(g.derivative(initial_position.coordinates[i]))));
+		}
+		// Roots g_a, dg_a/dq_0, ..., dg_a/dq_n-1 for every a
+		std::vector<const formula::Element<Field>*> roots;
+		for (unsigned int a = 0; a < constraints.size(); a++) {
+			roots.push_back(&constraints[a]);
+			for (unsigned int i = 0; i < initial_position.size(); i++) roots.push_back(&constraint_dq[a][i]);
+		}
+		constraint_plan.clear();
+		constraint_plan.push_back(formula::EvaluationPlan<Field>(roots, names));
+		constraint_values.clear();
+		pattern = SparsePattern();
+	}
+	virtual unsigned int numConstraints() const { return constraints.size(); }
+	// g_a(q) and G[a*n+i] = dg_a/dq_i, only the terms depending on changed coordinates are recomputed
+	void constraintJacobian(const std::vector<Field> &q, std::vector<Field> &g, std::vector<Field> &G) const {
+		unsigned int n = q.size(), c = constraints.size();
+		formula::EvaluationPlan<Field> &plan = constraint_plan[0];
+		// The velocities stay 0, the constraints do not depend on them
+		constraint_values.resize(2*n, 0);
+		std::copy(q.begin(), q.end(), constraint_values.begin());
+		plan.evaluate(constraint_values);
+		g.resize(c);
+		G.resize(c*n);
+		for (unsigned int a = 0; a < c; a++) {
+			g[a] = plan.getOutput(a*(n+1));
+			for (unsigned int i = 0; i < n; i++) G[a*n+i] = plan.getOutput(a*(n+1)+1+i);
+		}
+	}
+	std::map<const std::string, Field> values(const std::vector<Field> &q, const std::vector<Field> &v) const {
+		std::map<const std::string, Field> ret;
+		for (unsigned int i = 0; i < q.size(); i++) {
+			ret[position.coordinates[i]] = q[i];
+			ret[position.velocities[i]] = v[i];
+		}
+		return ret;
+	}
+	Field lagrangian(const std::vector<Field> &q, const std::vector<Field> &v) const { return formula.nevaluate(values(q, v)); }
+	// L at n points in one pass, qv[i*n+k] is q_i at point k and qv[(size+i)*n+k] is v_i
+	void lagrangians(const std::vector<Field> &qv, unsigned int n, std::vector<Field> &out) const { formula.bevaluate(qv, n, out); }
+	void setSlots(unsigned int n) {
+		while (gradient_plan.size() < n) gradient_plan.push_back(gradient_plan[0]);
+		slot_values.resize(gradient_plan.size());
+	}
+	virtual void gradient(const std::vector<Field> &q, const std::vector<Field> &v, std::vector<Field> &fq, std::vector<Field> &fv, unsigned int slot = 0) const {
+		unsigned int n = q.size();
+		std::vector<Field> &vals = slot_values[slot];
+		formula::EvaluationPlan<Field> &plan = gradient_plan[slot];
+		vals.resize(2*n);
+		std::copy(q.begin(), q.end(), vals.begin());
+		std::copy(v.begin(), v.end(), vals.begin()+n);
+		plan.evaluate(vals);
+		fq.resize(n);
+		fv.resize(n);
+		for (unsigned int i = 0; i < n; i++) {
+			fq[i] = plan.getOutput(i);
+			fv[i] = plan.getOutput(n+i);
+		}
+	}
+	Field energy() const {
+		Field ret = -lagrangian(position.q, position.v);
+		for (unsigned int i = 0; i < position.size(); i++) ret += position.p[i]*position.v[i];
+		return ret;
+	}
+protected:
+	// M_ij = d^2L/dv_i dv_j from the simplified derivatives of dL/dv_i by the velocities it mentions
+	void detectKinetic(const std::vector<std::string> &names) {
+		unsigned int n = initial_position.size();
+		std::set<std::string> velocities(initial_position.velocities.begin(), initial_position.velocities.end());
+		kinetic = KINETIC_CONSTANT;
+		mass.clear();
+		mass.resize(n);
+		mass_plan.clear();
+		for (unsigned int i = 0; i < n; i++) {
+			std::set<std::string> vars;
+			dLdv[i].variables(vars);
+			for (unsigned int j = 0; j < n; j++) {
+				if (vars.count(initial_position.velocities[j]) == 0) continue;
+				formula::Formula<Field> entry(std::move(dLdv[i].derivative(initial_position.velocities[j])));
+				entry.simplifyObject();
+				std::set<std::string> depends;
+				entry.variables(depends);
+				for (auto name = depends.begin(); name != depends.end(); name++) {
+					if (velocities.count(*name) > 0) {
+						kinetic = KINETIC_GENERAL;
+						mass.clear();
+						return;
+					}
+					kinetic = KINETIC_QUADRATIC;
+				}
+				if (i != j) mass_diagonal = false;
+				mass[i].push_back(std::make_pair(j, entry));
+			}
+		}
+		std::vector<const formula::Element<Field>*> roots;
+		for (unsigned int i = 0; i < n; i++) {
+			for (auto entry = mass[i].begin(); entry != mass[i].end(); entry++) roots.push_back(&entry->second);
+		}
+		mass_plan.push_back(formula::EvaluationPlan<Field>(roots, names));
+	}
+	// Factors M(q), once per run if M is constant, fails if L is not quadratic in the velocities or M is singular
+	bool factorMass(const std::vector<Field> &q) {
+		if (kinetic == KINETIC_GENERAL) return false;
+		if ((kinetic == KINETIC_CONSTANT) && mass_factored) return true;
+		unsigned int n = q.size();
+		std::vector<Field> values(q);
+		values.resize(2*n, 0);
+		formula::EvaluationPlan<Field> &plan = mass_plan[0];
+		mass_factored = false;
+		if (mixed) {
+			std::vector<Lower> entries;
+			std::vector<Field> bounds;
+			plan.bevaluate(values, 1, entries, &bounds);
+			Field largest = 0, bound = 0;
+			for (unsigned int r = 0; r < entries.size(); r++) {
+				largest = std::max(largest, Field(std::abs(entries[r])));
+				bound = std::max(bound, bounds[r]);
+			}
+			if (largest > 0) mass_bound = std::max(mass_bound, bound/largest);
+			if (!factorEntries(entries, mass_lower)) return false;
+		} else {
+			plan.evaluate(values);
+			std::vector<Field> entries(plan.size());
+			for (unsigned int r = 0; r < entries.size(); r++) entries[r] = plan.getOutput(r);
+			if (!factorEntries(entries, mass_lu)) return false;
+		}
+		mass_factored = true;
+		return true;
+	}
+	// M from the outputs of mass_plan, then its LU factors or its diagonal
+	template<class T> bool factorEntries(const std::vector<T> &entries, std::vector<T> &lu) {
+		unsigned int n = mass.size(), r = 0;
+		lu.assign(mass_diagonal ? n : n*n, T(0));
+		for (unsigned int i = 0; i < n; i++) {
+			for (auto entry = mass[i].begin(); entry != mass[i].end(); entry++) lu[mass_diagonal ? i : i*n+entry->first] = entries[r++];
+		}
+		if (!mass_diagonal) return factorLinear(lu, n, mass_pivot);
+		for (unsigned int i = 0; i < n; i++) if (lu[i] == T(0)) return false;
+		return true;
+	}
+	template<class T> void solveMass(const std::vector<T> &lu, std::vector<T> &b) const {
+		if (!mass_diagonal) {
+			solveFactored(lu, mass_pivot, b);
+			return;
+		}
+		for (unsigned int i = 0; i < b.size(); i++) b[i] /= lu[i];
+	}
+	void solveMass(std::vector<Field> &b) const {
+		if (!mixed) {
+			solveMass(mass_lu, b);
+			return;
+		}
+		std::vector<Lower> lower(b.begin(), b.end());
+		solveMass(mass_lower, lower);
+		std::copy(lower.begin(), lower.end(), b.begin());
+	}
+	// Iterations x = x + scale M(q_k)^-1 r(x) for schemes whose residual is -M (x-q)/scale plus smaller terms,
+	// one residual evaluation per iteration and no Jacobian. Leaves x unchanged if they do not converge.
+	bool massSolve(std::vector<Field> &x, Field scale) {
+		if (!mass_solve || !constraints.empty() || !factorMass(position.q)) return false;
+		std::vector<Field> r, x0(x);
+		Field last = std::numeric_limits<Field>::infinity();
+		for (unsigned int iter = 0; iter < newton_iterations; iter++) {
+			residual(x, r);
+			Field norm = 0;
+			for (unsigned int i = 0; i < r.size(); i++) norm = std::max(norm, std::abs(r[i]));
+			if (norm < newton_tolerance) return true;
+			if (!(norm < last)) break;
+			last = norm;
+			solveMass(r);
+			for (unsigned int i = 0; i < x.size(); i++) x[i] += scale*r[i];
+		}
+		x = x0;
+		return false;
+	}
+	// Discrete Euler-Lagrange equations of a concrete scheme, r(x) = 0
+	virtual void residual(const std::vector<Field> &x, std::vector<Field> &r) { r.assign(x.size(), 0); }
+	// Row of p_k + D_1 L_d = 0 for coordinate i and position of q_k+1 in x, for a residual of size unknowns
+	virtual unsigned int startRow(unsigned int i) const { return i; }
+	virtual unsigned int endIndex(unsigned int i, unsigned int size) const { return size - position.size() + i; }
+	// SHAKE: x = (scheme unknowns, multipliers l), the constraint forces -G(q_k)^T l enter the start rows
+	// and the end point satisfies g(q_k+1) = 0
+	void equations(const std::vector<Field> &x, std::vector<Field> &r) {
+		if (constraints.empty()) {
+			residual(x, r);
+			return;
+		}
+		unsigned int n = position.size(), c = constraints.size(), size = x.size() - c;
+		std::vector<Field> y(x.begin(), x.begin() + size), q(n), g, G;
+		residual(y, r);
+		for (unsigned int a = 0; a < c; a++) {
+			for (unsigned int i = 0; i < n; i++) r[startRow(i)] -= start_jacobian[a*n+i]*x[size+a];
+		}
+		for (unsigned int i = 0; i < n; i++) q[i] = y[endIndex(i, size)];
+		constraintJacobian(q, g, G);
+		r.insert(r.end(), g.begin(), g.end());
+	}
+	// RATTLE: p = p - G^T m with m such that the velocity of p is tangent to the constraints, G v = 0,
+	// v solves dL/dv(q, v) = p by Newton iterations
+	void project() {
+		if (constraints.empty()) return;
+		unsigned int n = position.size(), c = constraints.size(), size = n + c;
+		std::vector<Field> g, G, fq, fv, fvh, r(size), J;
+		constraintJacobian(position.q, g, G);
+		std::vector<Field> v(position.v), m(c, 0);
+		for (unsigned int iter = 0; iter < newton_iterations; iter++) {
+			gradient(position.q, v, fq, fv);
+			Field norm = 0;
+			for (unsigned int i = 0; i < n; i++) {
+				r[i] = fv[i] - position.p[i];
+				for (unsigned int a = 0; a < c; a++) r[i] += G[a*n+i]*m[a];
+			}
+			for (unsigned int a = 0; a < c; a++) {
+				r[n+a] = 0;
+				for (unsigned int i = 0; i < n; i++) r[n+a] += G[a*n+i]*v[i];
+			}
+			for (unsigned int i = 0; i < size; i++) norm = std::max(norm, std::abs(r[i]));
+			if (norm < newton_tolerance) break;
+			J.assign(size*size, 0);
+			for (unsigned int j = 0; j < n; j++) {
+				std::vector<Field> vh(v);
+				Field h = std::sqrt(std::numeric_limits<Field>::epsilon())*(1 + std::abs(v[j]));
+				vh[j] += h;
+				gradient(position.q, vh, fq, fvh);
+				for (unsigned int i = 0; i < n; i++) J[i*size+j] = (fvh[i] - fv[i])/h;
+			}
+			for (unsigned int a = 0; a < c; a++) {
+				for (unsigned int i = 0; i < n; i++) J[i*size+n+a] = J[(n+a)*size+i] = G[a*n+i];
+			}
+			if (!solveLinear(J, r)) break;
+			for (unsigned int i = 0; i < n; i++) v[i] -= r[i];
+			for (unsigned int a = 0; a < c; a++) m[a] -= r[n+a];
+		}
+		for (unsigned int i = 0; i < n; i++) {
+			for (unsigned int a = 0; a < c; a++) position.p[i] -= G[a*n+i]*m[a];
+		}
+		position.v = v;
+	}
+	// coupling[i] from the variables of dL/dq_i and dL/dv_i
+	void couple() {
+		unsigned int n = position.size();
+		std::map<std::string, unsigned int> index;
+		for (unsigned int i = 0; i < n; i++) {
+			index[position.coordinates[i]] = i;
+			index[position.velocities[i]] = i;
+		}
+		coupling.assign(n, std::set<unsigned int>());
+		for (unsigned int i = 0; i < n; i++) {
+			std::set<std::string> names;
+			dLdq[i].variables(names);
+			dLdv[i].variables(names);
+			coupling[i].insert(i);
+			for (auto name = names.begin(); name != names.end(); name++) {
+				if (index.count(*name) > 0) coupling[i].insert(index[*name]);
+			}
+		}
+	}
+	// Rows and columns of the constraints and multipliers appended after size unknowns
+	void constrain(unsigned int size) {
+		unsigned int n = position.size();
+		std::map<std::string, unsigned int> index;
+		for (unsigned int i = 0; i < n; i++) index[position.coordinates[i]] = i;
+		for (unsigned int a = 0; a < constraints.size(); a++) {
+			std::set<std::string> names;
+			constraints[a].variables(names);
+			for (auto name = names.begin(); name != names.end(); name++) {
+				if (index.count(*name) == 0) continue;
+				pattern.insert(size+a, endIndex(index[*name], size));
+				pattern.insert(startRow(index[*name]), size+a);
+			}
+		}
+	}
+	// Jacobian sparsity of a residual made of size/n blocks of coordinates, every block couples with every other
+	virtual void analyze(unsigned int size) {
+		unsigned int n = position.size(), unknowns = size - constraints.size(), blocks = unknowns/n;
+		couple();
+		pattern = SparsePattern(size);
+		for (unsigned int bi = 0; bi < blocks; bi++) {
+			for (unsigned int bj = 0; bj < blocks; bj++) {
+				for (unsigned int i = 0; i < n; i++) {
+					for (auto j = coupling[i].begin(); j != coupling[i].end(); j++) pattern.insert(bi*n+i, bj*n+*j);
+				}
+			}
+		}
+		constrain(unknowns);
+		pattern.colorize();
+		use_sparse = pattern.nonzeros() < SPARSE_JACOBIAN_DENSITY*size*size;
+	}
+	// Finite differences over column colors, one residual evaluation per color
+	virtual void sparseJacobian(const std::vector<Field> &x, const std::vector<Field> &r) {
+		std::vector<Field> xh(x), rh, h(x.size());
+		sparse_jacobian.resize(x.size());
+		for (unsigned int c = 0; c < pattern.numColors(); c++) {
+			const std::vector<unsigned int> &group = pattern.group(c);
+			for (auto j = group.begin(); j != group.end(); j++) {
+				h[*j] = std::sqrt(std::numeric_limits<Field>::epsilon())*(1 + std::abs(x[*j]));
+				xh[*j] = x[*j] + h[*j];
+			}
+			equations(xh, rh);
+			for (auto j = group.begin(); j != group.end(); j++) {
+				const std::vector<unsigned int> &rows = pattern.column(*j);
+				for (auto i = rows.begin(); i != rows.end(); i++) sparse_jacobian.set(*i, *j, (rh[*i] - r[*i])/h[*j]);
+				xh[*j] = x[*j];
+			}
+		}
+	}
+	virtual void jacobian(const std::vector<Field> &x, const std::vector<Field> &r, std::vector<Field> &J) {
+		unsigned int n = x.size();
+		std::vector<Field> xh(x), rh;
+		J.assign(n*n, 0);
+		for (unsigned int j = 0; j < n; j++) {
+			Field h = std::sqrt(std::numeric_limits<Field>::epsilon())*(1 + std::abs(x[j]));
+			xh[j] = x[j] + h;
+			equations(xh, rh);
+			for (unsigned int i = 0; i < n; i++) J[i*n+j] = (rh[i] - r[i])/h;
+			xh[j] = x[j];
+		}
+	}
+	// In-place LU with partial pivoting, the multipliers are stored below the diagonal, row k was swapped with pivot[k]
+	template<class T> static bool factorLinear(std::vector<T> &J, unsigned int n, std::vector<unsigned int> &pivot) {
+		pivot.resize(n);
+		for (unsigned int k = 0; k < n; k++) {
+			pivot[k] = k;
+			for (unsigned int i = k+1; i < n; i++) if (std::abs(J[i*n+k]) > std::abs(J[pivot[k]*n+k])) pivot[k] = i;
+			if (J[pivot[k]*n+k] == 0) return false;
+			if (pivot[k] != k) for (unsigned int j = 0; j < n; j++) std::swap(J[k*n+j], J[pivot[k]*n+j]);
+			for (unsigned int i = k+1; i < n; i++) {
+				T f = J[i*n+k]/J[k*n+k];
+				J[i*n+k] = f;
+				if (f == 0) continue;
+				for (unsigned int j = k+1; j < n; j++) J[i*n+j] -= f*J[k*n+j];
+			}
+		}
+		return true;
+	}
+	template<class T> static void solveFactored(const std::vector<T> &J, const std::vector<unsigned int> &pivot, std::vector<T> &b) {
+		unsigned int n = b.size();
+		for (unsigned int k = 0; k < n; k++) if (pivot[k] != k) std::swap(b[k], b[pivot[k]]);
+		for (unsigned int k = 0; k < n; k++) {
+			for (unsigned int i = k+1; i < n; i++) b[i] -= J[i*n+k]*b[k];
+		}
+		for (unsigned int k = n; k-- > 0; ) {
+			for (unsigned int j = k+1; j < n; j++) b[k] -= J[k*n+j]*b[j];
+			b[k] /= J[k*n+k];
+		}
+	}
+	virtual bool solveLinear(std::vector<Field> &J, std::vector<Field> &b) {
+		std::vector<unsigned int> pivot;
+		if (mixed) return solveLower(J, b);
+		if (!factorLinear(J, b.size(), pivot)) return false;
+		solveFactored(J, pivot, b);
+		return true;
+	}
+	// J d = b with J factored in Lower, J is left unchanged for the residual of d that goes to solve_error
+	bool solveLower(const std::vector<Field> &J, std::vector<Field> &b) {
+		unsigned int n = b.size();
+		std::vector<Lower> lu(J.begin(), J.end()), d(b.begin(), b.end());
+		std::vector<unsigned int> pivot;
+		if (!factorLinear(lu, n, pivot)) return false;
+		solveFactored(lu, pivot, d);
+		Field norm = 0, defect = 0;
+		for (unsigned int i = 0; i < n; i++) {
+			Field sum = -b[i];
+			for (unsigned int j = 0; j < n; j++) sum += J[i*n+j]*Field(d[j]);
+			defect = std::max(defect, std::abs(sum));
+			norm = std::max(norm, std::abs(b[i]));
+		}
+		if (norm > 0) solve_error = std::max(solve_error, defect/norm);
+		std::copy(d.begin(), d.end(), b.begin());
+		return true;
+	}
+	// The same for the sparse Jacobian
+	bool solveSparse(std::vector<Field> &b) {
+		if (!mixed) return sparse_jacobian.solve(b);
+		unsigned int n = b.size();
+		SparseMatrix<Lower> lower(n);
+		std::vector<Lower> d(b.begin(), b.end());
+		for (unsigned int i = 0; i < n; i++) {
+			const std::map<unsigned int, Field> &row = sparse_jacobian.row(i);
+			for (auto entry = row.begin(); entry != row.end(); entry++) lower.set(i, entry->first, Lower(entry->second));
+		}
+		if (!lower.solve(d)) return false;
+		Field norm = 0, defect = 0;
+		for (unsigned int i = 0; i < n; i++) {
+			const std::map<unsigned int, Field> &row = sparse_jacobian.row(i);
+			Field sum = -b[i];
+			for (auto entry = row.begin(); entry != row.end(); entry++) sum += entry->second*Field(d[entry->first]);
+			defect = std::max(defect, std::abs(sum));
+			norm = std::max(norm, std::abs(b[i]));
+		}
+		if (norm > 0) solve_error = std::max(solve_error, defect/norm);
+		std::copy(d.begin(), d.end(), b.begin());
+		return true;
+	}
+	// Newton iterations on the scheme unknowns x, with constraints also on their multipliers
+	bool solve(std::vector<Field> &x) {
+		std::vector<Field> r, J, g;
+		unsigned int size = x.size();
+		if (!constraints.empty()) {
+			constraintJacobian(position.q, g, start_jacobian);
+			x.resize(size + constraints.size(), 0);
+		}
+		if (pattern.size() != x.size()) analyze(x.size());
+		bool ret = false;
+		for (unsigned int iter = 0; iter < newton_iterations; iter++) {
+			equations(x, r);
+			Field norm = 0;
+			for (unsigned int i = 0; i < r.size(); i++) norm = std::max(norm, std::abs(r[i]));
+			if (norm < newton_tolerance) {
+				ret = true;
+				break;
+			}
+			if (use_sparse) {
+				sparseJacobian(x, r);
+				if (!solveSparse(r)) break;
+			} else {
+				jacobian(x, r, J);
+				if (!solveLinear(J, r)) break;
+			}
+			for (unsigned int i = 0; i < x.size(); i++) x[i] -= r[i];
+		}
+		x.resize(size);
+		return ret;
+	}
+};
+
 }
-#endif // VARINT_HPP
\ No newline at end of file
+
+#include "hamilton.hpp"
+#include "galerkin.hpp"
+#include "multirate.hpp"
+#include "adaptive.hpp"
+
+#endif // VARINT_HPP
@@ -0,0 +1,34 @@
+#ifndef VARINT_LIE_HPP
+#define VARINT_LIE_HPP
+
+#include <vector>
+#include <string>
+#include <iostream>
+
+namespace varint {
+
+// Flat phase space R^n, coordinates and velocities are bound to Formula variables by name
+template<class _Field = double> class VectorSpace {
+public:
+	typedef _Field Field;
+	std::vector<std::string> coordinates;
+	std::vector<std::string> velocities;
+	std::vector<Field> q;
+	std::vector<Field> v;
+	std::vector<Field> p;
+	VectorSpace() {}
+	VectorSpace(const std::vector<std::string> &_coordinates, const std::vector<std::string> &_velocities, const std::vector<Field> &_q, const std::vector<Field> &_v)
+	: coordinates(_coordinates), velocities(_velocities), q(_q), v(_v), p(_q.size(), 0) {}
+	unsigned int size() const { return q.size(); }
+	friend std::ostream& operator<<(std::ostream& os, const VectorSpace<Field>& space) {
+		for (unsigned int i = 0; i < space.size(); i++) {
+			if (i > 0) os<<" ";
+			os<<space.coordinates[i]<<"="<<space.q[i]<<" "<<space.velocities[i]<<"="<<space.v[i];
+		}
+		return os;
+	}
+};
+
+}
+
+#endif // VARINT_LIE_HPP
@@ -0,0 +1,236 @@
+#ifndef VARINT_MULTIRATE_HPP
+#define VARINT_MULTIRATE_HPP
+
+#include <vector>
+#include <string>
+#include <set>
+#include <algorithm>
+#include "libvarint.hpp"
+
+namespace varint {
+
+// Multirate discrete Lagrangian over a macro step H = t_step with m substeps of h = H/m.
+// Coordinates tagged fast take the m midpoint substeps, slow coordinates move linearly over the step.
+// The terms of L that mention no fast variable (L_S) are evaluated once at the macro midpoint,
+// the rest (L_F) at every substep midpoint with the slow coordinates interpolated:
+//   L_d = H L_S(s_1/2, (s1-s0)/H) + sum_k h L_F(s_(k+1/2)/m, (f^k+f^k+1)/2, (s1-s0)/H, (f^k+1-f^k)/h)
+// The inner fast points are fixed by the discrete Euler-Lagrange equations, so the step stays symplectic.
+// With one substep the scheme is the midpoint rule of HamiltonIntegrator.
+template<class PhaseSpace> class MultirateIntegrator : public BaseIntegrator<PhaseSpace> {
+private:
+	typedef BaseIntegrator<PhaseSpace> Base;
+public:
+	typedef typename Base::Field Field;
+protected:
+	unsigned int substeps;
+	// Positions of slow and fast coordinates in the phase space
+	std::vector<unsigned int> slow;
+	std::vector<unsigned int> fast;
+	// place[i] is the position of coordinate i in slow or fast
+	std::vector<unsigned int> place;
+	formula::Formula<Field> slow_lagrangian;
+	formula::Formula<Field> fast_lagrangian;
+	// Gradients of L_S (one slot) and of L_F (one slot per substep), [slot][i]
+	std::vector< std::vector< formula::Formula<Field> > > slow_dq, slow_dv, fast_dq, fast_dv;
+	mutable std::vector< std::vector<Field> > slow_values, fast_values;
+	// Coordinate and velocity names of the tagged coordinates
+	static std::set<std::string> tagged(const PhaseSpace &space, const std::vector<std::string> &coordinates) {
+		std::set<std::string> ret;
+		for (unsigned int i = 0; i < space.size(); i++) {
+			if (std::find(coordinates.begin(), coordinates.end(), space.coordinates[i]) == coordinates.end()) continue;
+			ret.insert(space.coordinates[i]);
+			ret.insert(space.velocities[i]);
+		}
+		return ret;
+	}
+	// Sum of the terms of L that mention (with = true) or do not mention one of names
+	static formula::Formula<Field> part(const formula::Formula<Field> &L, const std::set<std::string> &names, bool with) {
+		std::vector< std::unique_ptr< formula::Element<Field> > > terms;
+		const formula::Element<Field> *root = L.getRoot().get();
+		bool sum = root->getKind() == formula::KIND_SUM;
+		for (unsigned int i = 0; i < (sum ? root->arity() : 1); i++) {
+			const formula::Element<Field> *term = sum ? root->getChild(i) : root;
+			std::set<std::string> vars;
+			term->variables(vars);
+			bool mentions = false;
+			for (auto var = vars.begin(); var != vars.end(); var++) if (names.count(*var) > 0) mentions = true;
+			if (mentions == with) terms.push_back(term->clone());
+		}
+		return formula::Formula<Field>(formula::make_sum<Field>(terms));
+	}
+	void derive(const formula::Formula<Field> &L, std::vector< std::vector< formula::Formula<Field> > > &dq, std::vector< std::vector< formula::Formula<Field> > > &dv, unsigned int slots) {
+		std::vector<std::string> names(this->initial_position.coordinates);
+		names.insert(names.end(), this->initial_position.velocities.begin(), this->initial_position.velocities.end());
+		dq.resize(1);
+		dv.resize(1);
+		for (unsigned int i = 0; i < this->initial_position.size(); i++) {
+			dq[0].push_back(formula::Formula<Field>(std::move(L.derivative(this->initial_position.coordinates[i]))));
+			dv[0].push_back(formula::Formula<Field>(std::move(L.derivative(this->initial_position.velocities[i]))));
+			dq[0][i].bind(names);
+			dv[0][i].bind(names);
+		}
+		while (dq.size() < slots) {
+			dq.push_back(dq[0]);
+			dv.push_back(dv[0]);
+		}
+	}
+	// Same as BaseIntegrator::gradient for one part of the split
+	void partGradient(const std::vector< std::vector< formula::Formula<Field> > > &dq, const std::vector< std::vector< formula::Formula<Field> > > &dv, std::vector<Field> &vals, const std::vector<Field> &q, const std::vector<Field> &v, std::vector<Field> &fq, std::vector<Field> &fv, unsigned int slot) const {
+		unsigned int n = q.size();
+		formula::Dependencies changed;
+		if (vals.size() != 2*n) vals.assign(2*n, 0);
+		for (unsigned int i = 0; i < n; i++) {
+			if (q[i] != vals[i]) { vals[i] = q[i]; changed.set(i); }
+			if (v[i] != vals[n+i]) { vals[n+i] = v[i]; changed.set(n+i); }
+		}
+		fq.resize(n);
+		fv.resize(n);
+		for (unsigned int i = 0; i < n; i++) {
+			fq[i] = dq[slot][i].ievaluate(vals, changed);
+			fv[i] = dv[slot][i].ievaluate(vals, changed);
+		}
+	}
+public:
+	MultirateIntegrator(formula::Formula<Field> _L, double _t0, double _t1, double _t_step, PhaseSpace _initial_pos, const std::vector<std::string> &_fast, unsigned int _substeps)
+	: BaseIntegrator<PhaseSpace>(_L, _t0, _t1, _t_step, _initial_pos), substeps(_substeps ? _substeps : 1),
+	  slow_lagrangian(part(_L, tagged(_initial_pos, _fast), false)), fast_lagrangian(part(_L, tagged(_initial_pos, _fast), true)) {
+		for (unsigned int i = 0; i < this->initial_position.size(); i++) {
+			bool tag = std::find(_fast.begin(), _fast.end(), this->initial_position.coordinates[i]) != _fast.end();
+			place.push_back(tag ? fast.size() : slow.size());
+			(tag ? fast : slow).push_back(i);
+		}
+		derive(slow_lagrangian, slow_dq, slow_dv, 1);
+		derive(fast_lagrangian, fast_dq, fast_dv, substeps);
+		slow_values.resize(1);
+		fast_values.resize(substeps);
+	}
+	unsigned int getSubsteps() const { return substeps; }
+	const formula::Formula<Field>& getSlowLagrangian() const { return slow_lagrangian; }
+	const formula::Formula<Field>& getFastLagrangian() const { return fast_lagrangian; }
+	virtual void step() {
+		unsigned int ns = slow.size(), nf = fast.size(), m = substeps;
+		Field h = this->t_step/m;
+		std::vector<Field> x(ns+m*nf), g0, g1;
+		for (unsigned int i = 0; i < ns; i++) x[i] = this->position.q[slow[i]] + this->t_step*this->position.v[slow[i]];
+		for (unsigned int k = 1; k <= m; k++) {
+			for (unsigned int i = 0; i < nf; i++) x[ns+(k-1)*nf+i] = this->position.q[fast[i]] + k*h*this->position.v[fast[i]];
+		}
+		this->solve(x);
+		stepGradients(x, g0, g1);
+		for (unsigned int i = 0; i < ns; i++) {
+			this->position.v[slow[i]] = (x[i] - this->position.q[slow[i]])/this->t_step;
+			this->position.p[slow[i]] = g1[slow[i]];
+		}
+		for (unsigned int i = 0; i < nf; i++) {
+			Field prev = (m > 1) ? x[ns+(m-2)*nf+i] : this->position.q[fast[i]];
+			this->position.v[fast[i]] = (x[ns+(m-1)*nf+i] - prev)/h;
+			this->position.p[fast[i]] = g1[fast[i]];
+		}
+		for (unsigned int i = 0; i < ns; i++) this->position.q[slow[i]] = x[i];
+		for (unsigned int i = 0; i < nf; i++) this->position.q[fast[i]] = x[ns+(m-1)*nf+i];
+		this->project();
+		this->t += this->t_step;
+	}
+protected:
+	// Full coordinates at substep k, q^k for the current position and x = (s1, f^1..f^m)
+	void point(const std::vector<Field> &x, unsigned int k, std::vector<Field> &q) const {
+		unsigned int ns = slow.size(), nf = fast.size();
+		q.resize(this->position.size());
+		for (unsigned int i = 0; i < ns; i++) q[slow[i]] = this->position.q[slow[i]] + (x[i] - this->position.q[slow[i]])*k/substeps;
+		for (unsigned int i = 0; i < nf; i++) q[fast[i]] = k ? x[ns+(k-1)*nf+i] : this->position.q[fast[i]];
+	}
+	// g0 = dL_d/dq at the start of the step, g1 = dL_d/dq at the end, and for the inner fast points
+	// inner[(k-1)*nf+i] = dL_d/df^k_i, k = 1..m-1
+	void stepGradients(const std::vector<Field> &x, std::vector<Field> &g0, std::vector<Field> &g1, std::vector<Field> *inner = nullptr) const {
+		unsigned int n = this->position.size(), ns = slow.size(), nf = fast.size(), m = substeps;
+		Field H = this->t_step, h = H/m;
+		std::vector<Field> q0, q1, qm(n), vm(n), fq, fv;
+		g0.assign(n, 0);
+		g1.assign(n, 0);
+		if (inner) inner->assign((m-1)*nf, 0);
+		point(x, 0, q0);
+		point(x, m, q1);
+		for (unsigned int i = 0; i < n; i++) {
+			qm[i] = (q0[i] + q1[i])/2;
+			vm[i] = (q1[i] - q0[i])/H;
+		}
+		partGradient(slow_dq, slow_dv, slow_values[0], qm, vm, fq, fv, 0);
+		for (unsigned int i = 0; i < ns; i++) {
+			unsigned int j = slow[i];
+			g0[j] += H*fq[j]/2 - fv[j];
+			g1[j] += H*fq[j]/2 + fv[j];
+		}
+		std::vector<Field> a(q0), b;
+		for (unsigned int k = 0; k < m; k++) {
+			point(x, k+1, b);
+			for (unsigned int i = 0; i < n; i++) {
+				qm[i] = (a[i] + b[i])/2;
+				vm[i] = (b[i] - a[i])/h;
+			}
+			partGradient(fast_dq, fast_dv, fast_values[k], qm, vm, fq, fv, k);
+			Field c = (k + Field(0.5))/m;
+			for (unsigned int i = 0; i < ns; i++) {
+				unsigned int j = slow[i];
+				g0[j] += h*((1-c)*fq[j] - fv[j]/H);
+				g1[j] += h*(c*fq[j] + fv[j]/H);
+			}
+			for (unsigned int i = 0; i < nf; i++) {
+				unsigned int j = fast[i];
+				Field left = h*fq[j]/2 - fv[j], right = h*fq[j]/2 + fv[j];
+				if (k == 0) g0[j] += left;
+				else if (inner) (*inner)[(k-1)*nf+i] += left;
+				if (k == m-1) g1[j] += right;
+				else if (inner) (*inner)[k*nf+i] += right;
+			}
+			a.swap(b);
+		}
+	}
+	// p_0 + D_1 L_d = 0 for slow and fast coordinates, and dL_d/df^k = 0 at the inner fast points
+	virtual void residual(const std::vector<Field> &x, std::vector<Field> &r) {
+		unsigned int ns = slow.size(), nf = fast.size(), m = substeps;
+		std::vector<Field> g0, g1, inner;
+		stepGradients(x, g0, g1, &inner);
+		r.resize(ns+m*nf);
+		for (unsigned int i = 0; i < ns; i++) r[i] = this->position.p[slow[i]] + g0[slow[i]];
+		for (unsigned int i = 0; i < nf; i++) r[ns+i] = this->position.p[fast[i]] + g0[fast[i]];
+		for (unsigned int k = 1; k < m; k++) {
+			for (unsigned int i = 0; i < nf; i++) r[ns+k*nf+i] = inner[(k-1)*nf+i];
+		}
+	}
+	bool isSlow(unsigned int i) const { return (place[i] < slow.size()) && (slow[place[i]] == i); }
+	// Slow coordinates come first in the residual and in x, the end fast point f^m is last in x
+	virtual unsigned int startRow(unsigned int i) const { return isSlow(i) ? place[i] : slow.size() + place[i]; }
+	virtual unsigned int endIndex(unsigned int i, unsigned int size) const { return isSlow(i) ? place[i] : size - fast.size() + place[i]; }
+	// Slow equations see every unknown they are coupled with, the equation of fast point k only
+	// the fast points k-1..k+1 and the slow coordinates
+	virtual void analyze(unsigned int size) {
+		unsigned int ns = slow.size(), nf = fast.size(), m = substeps;
+		this->couple();
+		this->pattern = SparsePattern(size);
+		for (unsigned int i = 0; i < ns; i++) {
+			for (auto j = this->coupling[slow[i]].begin(); j != this->coupling[slow[i]].end(); j++) {
+				if (isSlow(*j)) this->pattern.insert(i, place[*j]);
+				else for (unsigned int k = 0; k < m; k++) this->pattern.insert(i, ns+k*nf+place[*j]);
+			}
+		}
+		for (unsigned int e = 0; e < m; e++) {
+			for (unsigned int i = 0; i < nf; i++) {
+				unsigned int row = ns+e*nf+i;
+				for (auto j = this->coupling[fast[i]].begin(); j != this->coupling[fast[i]].end(); j++) {
+					if (isSlow(*j)) {
+						this->pattern.insert(row, place[*j]);
+						continue;
+					}
+					for (unsigned int b = (e > 1 ? e-1 : 1); (b <= e+1) && (b <= m); b++) this->pattern.insert(row, ns+(b-1)*nf+place[*j]);
+				}
+			}
+		}
+		this->constrain(ns+m*nf);
+		this->pattern.colorize();
+		this->use_sparse = this->pattern.nonzeros() < SPARSE_JACOBIAN_DENSITY*size*size;
+	}
+};
+
+}
+
+#endif // VARINT_MULTIRATE_HPP
@@ -0,0 +1,318 @@
+#ifndef VARINT_PLAN_HPP
+#define VARINT_PLAN_HPP
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <limits>
+#include <algorithm>
+#include "formula.hpp"
+
+namespace varint {
+namespace formula {
+
+#ifndef EL_UPTR
+#define EL_PTR Element<Field> *
+#define EL_UPTR std::unique_ptr< Element<Field> >
+#define PLAN_UNDEF_MACROS
+#endif
+
+// Several formulas in the same variables evaluated together. Structurally equal subtrees of all the
+// roots, sums and products compared up to the order of their terms, become one instruction of a
+// straight-line program that fills every output in one pass. Like ievaluate, an instruction is only
+// recomputed if one of its variables changed since the previous evaluate. Series, integrals, pair sums
+// and other nodes without a plain operation are kept as bound clones and shared when they print the same.
+template<class Field> class EvaluationPlan {
+protected:
+	enum Op { OP_CONSTANT, OP_VARIABLE, OP_SUM, OP_PRODUCT, OP_RATIO, OP_POWER, OP_FUNCTION, OP_OTHER };
+	struct Instruction {
+		Op op;
+		Elementary function;
+		// Variable slot of OP_VARIABLE, clone of OP_OTHER
+		int index;
+		// Operands are operands[first..first+count)
+		unsigned int first, count;
+		Field value;
+		Dependencies deps;
+	};
+	std::vector<std::string> names;
+	std::map<const std::string, unsigned int> slots;
+	std::vector<Instruction> program;
+	std::vector<unsigned int> operands;
+	std::vector<unsigned int> outputs;
+	std::vector< std::unique_ptr< Formula<Field> > > others;
+	// Instruction by structural key, only used while the plan is built
+	std::map<std::string, unsigned int> table;
+	unsigned int nodes;
+	std::vector<Field> registers;
+	std::vector<Field> last_values;
+	bool evaluated;
+	unsigned int add(Instruction instruction, const std::string &key) {
+		auto found = table.find(key);
+		if (found != table.end()) {
+			operands.resize(instruction.first);
+			return found->second;
+		}
+		for (unsigned int k = 0; k < instruction.count; k++) instruction.deps.merge(program[operands[instruction.first+k]].deps);
+		program.push_back(instruction);
+		table[key] = program.size()-1;
+		return program.size()-1;
+	}
+	// Children first, returns the instruction of el
+	unsigned int compile(const Element<Field> *el) {
+		nodes++;
+		Kind kind = el->getKind();
+		Instruction instruction = { OP_OTHER, ELEMENTARY_NONE, -1, (unsigned int)operands.size(), 0, Field(0), Dependencies() };
+		std::ostringstream key;
+		key.precision(std::numeric_limits<double>::max_digits10);
+		switch (kind) {
+			case KIND_FORMULA: nodes--; return compile(el->getChild(0));
+			case KIND_CONSTANT:
+				instruction.op = OP_CONSTANT;
+				instruction.value = static_cast<const Constant<Field>*>(el)->getValue();
+				key<<"c"<<instruction.value;
+				return add(instruction, key.str());
+			case KIND_VARIABLE: {
+				auto found = slots.find(static_cast<const Variable<Field>*>(el)->getName());
+				instruction.op = OP_VARIABLE;
+				instruction.index = found->second;
+				instruction.deps.set(found->second);
+				key<<"v"<<found->second;
+				return add(instruction, key.str());
+			}
+			case KIND_SUM: case KIND_PRODUCT: case KIND_RATIO: case KIND_POWER: case KIND_FUNCTION: {
+				if ((kind == KIND_FUNCTION) && ((el->arity() == 0) || (el->arity() > 2))) break;
+				instruction.op = (kind == KIND_SUM) ? OP_SUM : ((kind == KIND_PRODUCT) ? OP_PRODUCT : ((kind == KIND_RATIO) ? OP_RATIO : ((kind == KIND_POWER) ? OP_POWER : OP_FUNCTION)));
+				if (kind == KIND_FUNCTION) {
+					instruction.function = (el->arity() == 1) ? static_cast<const Function<Field>*>(el)->getFunction() : static_cast<const Function<Field, 2>*>(el)->getFunction();
+					if ((instruction.function == ELEMENTARY_NONE) && (el->arity() != 1)) {
+						instruction.op = OP_CONSTANT;
+						key<<"c0";
+						return add(instruction, key.str());
+					}
+				}
+				std::vector<unsigned int> children;
+				for (unsigned int i = 0; i < el->arity(); i++) children.push_back(compile(el->getChild(i)));
+				instruction.first = operands.size();
+				instruction.count = children.size();
+				operands.insert(operands.end(), children.begin(), children.end());
+				if ((kind == KIND_SUM) || (kind == KIND_PRODUCT)) std::sort(children.begin(), children.end());
+				key<<"o"<<instruction.op<<"f"<<instruction.function;
+				for (unsigned int k = 0; k < children.size(); k++) key<<","<<children[k];
+				return add(instruction, key.str());
+			}
+			default: break;
+		}
+		key<<"x"<<el->stringify();
+		auto found = table.find(key.str());
+		if (found != table.end()) return found->second;
+		std::unique_ptr< Formula<Field> > other(new Formula<Field>(el->clone()));
+		other->bind(slots);
+		instruction.index = others.size();
+		instruction.deps = other->getDependencies();
+		others.push_back(std::move(other));
+		return add(instruction, key.str());
+	}
+	Field compute(const Instruction &instruction, const std::vector<Field> &values, const Dependencies &changed) const {
+		const unsigned int *args = operands.data()+instruction.first;
+		switch (instruction.op) {
+			case OP_CONSTANT: return instruction.value;
+			case OP_VARIABLE: return values[instruction.index];
+			case OP_SUM: {
+				Field ret = 0;
+				for (unsigned int k = 0; k < instruction.count; k++) ret = ret + registers[args[k]];
+				return ret;
+			}
+			case OP_PRODUCT: {
+				Field ret = 1;
+				for (unsigned int k = 0; k < instruction.count; k++) ret = ret * registers[args[k]];
+				return ret;
+			}
+			case OP_RATIO: return registers[args[0]]/registers[args[1]];
+			case OP_POWER: return pow(registers[args[0]], registers[args[1]]);
+			case OP_FUNCTION: {
+				if (instruction.function == ELEMENTARY_NONE) return registers[args[0]];
+				Field arguments[2] = { registers[args[0]], (instruction.count > 1) ? registers[args[1]] : Field(0) };
+				return Elementaries<Field>::scalar(instruction.function, arguments);
+			}
+			default: return others[instruction.index]->getRoot()->ievaluate(values, changed);
+		}
+	}
+public:
+	// Throws std::invalid_argument if a free variable of a root is not in names
+	EvaluationPlan(const std::vector<const Element<Field>*> &roots, const std::vector<std::string> &_names) : names(_names), nodes(0), evaluated(false) {
+		for (unsigned int i = 0; i < names.size(); i++) slots[names[i]] = i;
+		for (unsigned int r = 0; r < roots.size(); r++) require_bound(*roots[r], slots);
+		for (unsigned int r = 0; r < roots.size(); r++) outputs.push_back(compile(roots[r]));
+		table.clear();
+		registers.resize(program.size());
+	}
+	EvaluationPlan(const EvaluationPlan<Field> &other) : names(other.names), slots(other.slots), program(other.program), operands(other.operands), outputs(other.outputs), nodes(other.nodes), registers(other.registers.size()), evaluated(false) {
+		for (unsigned int i = 0; i < other.others.size(); i++) {
+			others.push_back(std::unique_ptr< Formula<Field> >(new Formula<Field>(*other.others[i])));
+		}
+	}
+	const std::vector<std::string>& getNames() const { return names; }
+	// Number of outputs, nodes of all the roots and instructions left after sharing
+	unsigned int size() const { return outputs.size(); }
+	unsigned int getNodes() const { return nodes; }
+	unsigned int getInstructions() const { return program.size(); }
+	// values[i] is the value of getNames()[i], getOutput(r) is then the value of root r
+	void evaluate(const std::vector<Field> &values) {
+		Dependencies changed;
+		for (unsigned int i = 0; i < values.size(); i++) {
+			if (!evaluated || (i >= last_values.size()) || (values[i] != last_values[i])) changed.set(i);
+		}
+		last_values = values;
+		for (unsigned int k = 0; k < program.size(); k++) {
+			const Instruction &instruction = program[k];
+			if (evaluated && !instruction.deps.intersects(changed)) continue;
+			registers[k] = compute(instruction, values, changed);
+		}
+		evaluated = true;
+	}
+	const Field& getOutput(unsigned int r) const { return registers[outputs[r]]; }
+	void evaluate(const std::vector<Field> &values, std::vector<Field> &out) {
+		evaluate(values);
+		out.resize(outputs.size());
+		for (unsigned int r = 0; r < outputs.size(); r++) out[r] = registers[outputs[r]];
+	}
+	// The program at n points in the precision Lower, float for example, without rebuilding the plan. values[i*n+k]
+	// is getNames()[i] at point k and out[r*n+k] root r at point k. Every instruction is one loop over the points
+	// that the compiler vectorizes, float has twice the lanes of double. Special nodes are evaluated in Field and
+	// rounded. bounds[r*n+k], if given, is a first order bound of |out[r*n+k] - root r| from the rounding to
+	// Lower, kept in Field next to the Lower values; functions propagate the error by central differences.
+	template<class Lower> void bevaluate(const std::vector<Field> &values, unsigned int n, std::vector<Lower> &out, std::vector<Field> *bounds = nullptr) const {
+		using std::abs; using std::pow; using std::log;
+		static thread_local std::vector<Lower> reg, joined;
+		static thread_local std::vector<Field> err, args, other;
+		const Field u = Field(std::numeric_limits<Lower>::epsilon())/2;
+		bool bound = (bounds != nullptr);
+		reg.resize(program.size()*n);
+		if (bound) err.assign(program.size()*n, Field(0));
+		for (unsigned int k = 0; k < program.size(); k++) {
+			const Instruction &instruction = program[k];
+			const unsigned int *ops = operands.data()+instruction.first;
+			Lower *r = reg.data()+k*n;
+			Field *e = bound ? err.data()+k*n : nullptr;
+			switch (instruction.op) {
+				case OP_CONSTANT:
+					for (unsigned int p = 0; p < n; p++) r[p] = Lower(instruction.value);
+					if (bound) for (unsigned int p = 0; p < n; p++) e[p] = abs(instruction.value - Field(r[p]));
+					break;
+				case OP_VARIABLE: {
+					const Field *x = values.data()+instruction.index*n;
+					for (unsigned int p = 0; p < n; p++) r[p] = Lower(x[p]);
+					if (bound) for (unsigned int p = 0; p < n; p++) e[p] = abs(x[p] - Field(r[p]));
+					break;
+				}
+				case OP_SUM: case OP_PRODUCT: {
+					bool add = (instruction.op == OP_SUM);
+					for (unsigned int p = 0; p < n; p++) r[p] = add ? Lower(0) : Lower(1);
+					for (unsigned int a = 0; a < instruction.count; a++) {
+						const Lower *x = reg.data()+ops[a]*n;
+						if (bound) {
+							const Field *ex = err.data()+ops[a]*n;
+							// (r+er)(x+ex) = rx + r ex + x er to first order
+							for (unsigned int p = 0; p < n; p++) e[p] = add ? e[p] + ex[p] : abs(Field(r[p]))*ex[p] + abs(Field(x[p]))*e[p];
+						}
+						if (add) for (unsigned int p = 0; p < n; p++) r[p] += x[p];
+						else for (unsigned int p = 0; p < n; p++) r[p] *= x[p];
+						if (bound && (a > 0)) for (unsigned int p = 0; p < n; p++) e[p] += u*abs(Field(r[p]));
+					}
+					break;
+				}
+				case OP_RATIO: {
+					const Lower *x = reg.data()+ops[0]*n, *y = reg.data()+ops[1]*n;
+					for (unsigned int p = 0; p < n; p++) r[p] = x[p]/y[p];
+					if (bound) {
+						const Field *ex = err.data()+ops[0]*n, *ey = err.data()+ops[1]*n;
+						for (unsigned int p = 0; p < n; p++) e[p] = (ex[p] + abs(Field(r[p]))*ey[p])/abs(Field(y[p])) + u*abs(Field(r[p]));
+					}
+					break;
+				}
+				case OP_POWER: {
+					const Lower *x = reg.data()+ops[0]*n, *y = reg.data()+ops[1]*n;
+					const Instruction &exponent = program[ops[1]];
+					if ((exponent.op == OP_CONSTANT) && (exponent.value == Field(2))) for (unsigned int p = 0; p < n; p++) r[p] = x[p]*x[p];
+					else for (unsigned int p = 0; p < n; p++) r[p] = pow(x[p], y[p]);
+					if (bound) {
+						const Field *ex = err.data()+ops[0]*n, *ey = err.data()+ops[1]*n;
+						for (unsigned int p = 0; p < n; p++) {
+							Field base = abs(Field(x[p])), power = Field(y[p]);
+							e[p] = 2*u*abs(Field(r[p]));
+							if (ex[p] != Field(0)) e[p] += abs(power)*pow(base, power-1)*ex[p];
+							if (ey[p] != Field(0)) e[p] += abs(Field(r[p])*log(base))*ey[p];
+						}
+					}
+					break;
+				}
+				case OP_FUNCTION: {
+					unsigned int arity = instruction.count;
+					if (instruction.function == ELEMENTARY_NONE) {
+						std::copy(reg.begin()+ops[0]*n, reg.begin()+(ops[0]+1)*n, r);
+						if (bound) std::copy(err.begin()+ops[0]*n, err.begin()+(ops[0]+1)*n, e);
+						break;
+					}
+					// The arguments of a batch kernel follow each other
+					const Lower *lower = reg.data()+ops[0]*n;
+					if (arity > 1) {
+						joined.resize(arity*n);
+						for (unsigned int a = 0; a < arity; a++) std::copy(reg.begin()+ops[a]*n, reg.begin()+(ops[a]+1)*n, joined.begin()+a*n);
+						lower = joined.data();
+					}
+					Elementaries<Lower>::batch(instruction.function, lower, n, r);
+					if (!bound) break;
+					// |f(x+ex) - f(x-ex)|/2 for each argument, libm is accurate to about one ulp
+					args.resize(2);
+					for (unsigned int p = 0; p < n; p++) {
+						for (unsigned int a = 0; a < arity; a++) args[a] = Field(lower[a*n+p]);
+						e[p] = 2*u*abs(Field(r[p]));
+						for (unsigned int a = 0; a < arity; a++) {
+							Field ex = err[ops[a]*n+p], x = args[a];
+							if (ex == Field(0)) continue;
+							args[a] = x + ex;
+							Field high = Elementaries<Field>::scalar(instruction.function, args.data());
+							args[a] = x - ex;
+							e[p] += abs(high - Elementaries<Field>::scalar(instruction.function, args.data()))/2;
+							args[a] = x;
+						}
+					}
+					break;
+				}
+				default:
+					others[instruction.index]->getRoot()->bevaluate(values, n, other);
+					for (unsigned int p = 0; p < n; p++) r[p] = Lower(other[p]);
+					if (bound) for (unsigned int p = 0; p < n; p++) e[p] = abs(other[p] - Field(r[p]));
+			}
+		}
+		out.resize(outputs.size()*n);
+		if (bound) bounds->resize(outputs.size()*n);
+		for (unsigned int o = 0; o < outputs.size(); o++) {
+			std::copy(reg.begin()+outputs[o]*n, reg.begin()+(outputs[o]+1)*n, out.begin()+o*n);
+			if (bound) std::copy(err.begin()+outputs[o]*n, err.begin()+(outputs[o]+1)*n, bounds->begin()+o*n);
+		}
+	}
+	// Names missing from values are taken as 0
+	void nevaluate(const std::map<const std::string, Field> &values, std::vector<Field> &out) {
+		std::vector<Field> row(names.size());
+		for (unsigned int i = 0; i < row.size(); i++) {
+			auto found = values.find(names[i]);
+			if (found != values.end()) row[i] = found->second;
+		}
+		evaluate(row, out);
+	}
+};
+
+#ifdef PLAN_UNDEF_MACROS
+#undef EL_PTR
+#undef EL_UPTR
+#undef PLAN_UNDEF_MACROS
+#endif
+
+}
+}
+
+#endif // VARINT_PLAN_HPP
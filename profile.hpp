@@ -0,0 +1,135 @@
+#ifndef VARINT_PROFILE_HPP
+#define VARINT_PROFILE_HPP
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include "formula.hpp"
+
+namespace varint {
+namespace formula {
+
+#define PROFILE_WIDTH 60 // characters of a printed subtree in reports
+#ifdef FORMULA_PROFILE
+#define PROFILE_HOOKS true
+#else
+#define PROFILE_HOOKS false
+#endif
+
+// Time and call counts per node of nevaluate, ievaluate and bevaluate while the profiler is in use on a thread,
+// in programs built with FORMULA_PROFILE. Times are inclusive, the report derives the self time of a node by
+// subtracting its children. Trees that nodes evaluate internally (series terms, integrands, pair expressions)
+// count as self time of their owner.
+template<class Field> class Profiler {
+public:
+	struct Entry {
+		// Evaluations, cache hits of ievaluate and points (n per bevaluate)
+		unsigned long calls, hits, points;
+		double seconds;
+		Entry() : calls(0), hits(0), points(0), seconds(0) {}
+	};
+	// Measures one evaluation of node
+	class Probe {
+	protected:
+		Profiler<Field> &profiler;
+		const Element<Field> *node;
+		unsigned int points;
+		std::chrono::steady_clock::time_point start;
+	public:
+		Probe(Profiler<Field> &_profiler, const Element<Field> *_node, unsigned int _points) : profiler(_profiler), node(_node), points(_points), start(std::chrono::steady_clock::now()) {}
+		~Probe() {
+			Entry &entry = profiler.entries[node];
+			entry.calls++;
+			entry.points += points;
+			entry.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+		}
+	};
+	// Makes a profiler current on this thread while in scope
+	class Use {
+	protected:
+		Profiler<Field> *previous;
+	public:
+		Use(Profiler<Field> &profiler) : previous(current()) {
+			static_assert(sizeof(Field) && PROFILE_HOOKS, "define FORMULA_PROFILE to compile the profiler hooks");
+			current() = &profiler;
+		}
+		~Use() { current() = previous; }
+	};
+protected:
+	std::unordered_map<const Element<Field>*, Entry> entries;
+	struct Row {
+		const Element<Field> *node;
+		Entry entry;
+		double self;
+	};
+	// Inclusive and self time of every node under root, children before their parent is complete
+	double collect(const Element<Field> &root, std::vector<Row> &rows) const {
+		Row row = { &root, Entry(), 0 };
+		auto found = entries.find(&root);
+		if (found != entries.end()) row.entry = found->second;
+		unsigned int at = rows.size();
+		rows.push_back(row);
+		double children = 0;
+		for (unsigned int i = 0; i < root.arity(); i++) children += collect(*root.getChild(i), rows);
+		rows[at].self = std::max(0.0, row.entry.seconds-children);
+		return row.entry.seconds;
+	}
+	static std::string label(const Element<Field> &node, unsigned int width) {
+		std::string ret = node.stringify();
+		std::replace(ret.begin(), ret.end(), ';', ',');
+		std::replace(ret.begin(), ret.end(), '\n', ' ');
+		if (ret.size() > width) ret = ret.substr(0, width > 3 ? width-3 : 0)+"...";
+		return ret;
+	}
+	void fold(std::ostream &os, const Element<Field> &node, const std::string &stack, unsigned int width) const {
+		std::string frames = stack.empty() ? label(node, width) : stack+";"+label(node, width);
+		double children = 0;
+		for (unsigned int i = 0; i < node.arity(); i++) {
+			auto found = entries.find(node.getChild(i));
+			if (found != entries.end()) children += found->second.seconds;
+		}
+		auto found = entries.find(&node);
+		if (found == entries.end()) return;
+		long long self = (long long)(1e9*std::max(0.0, found->second.seconds-children));
+		if (self > 0) os<<frames<<" "<<self<<"\n";
+		for (unsigned int i = 0; i < node.arity(); i++) fold(os, *node.getChild(i), frames, width);
+	}
+public:
+	static Profiler<Field>*& current() {
+		static thread_local Profiler<Field> *ret = nullptr;
+		return ret;
+	}
+	void hit(const Element<Field> *node) { entries[node].hits++; }
+	void clear() { entries.clear(); }
+	// Counts of node, zero if it was not evaluated
+	Entry get(const Element<Field> *node) const {
+		auto found = entries.find(node);
+		return (found == entries.end()) ? Entry() : found->second;
+	}
+	// The top subtrees of root by inclusive time, with their share of the time of root, self time and counts
+	void report(std::ostream &os, const Element<Field> &root, unsigned int top = 10, unsigned int width = PROFILE_WIDTH) const {
+		std::vector<Row> rows;
+		double total = collect(root, rows);
+		std::stable_sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) { return a.entry.seconds > b.entry.seconds; });
+		if (total <= 0) total = 1;
+		for (unsigned int i = 0; (i < top) && (i < rows.size()); i++) {
+			const Row &row = rows[i];
+			if (!row.entry.calls) break;
+			os<<(unsigned int)(100*row.entry.seconds/total+0.5)<<"% self="<<(unsigned int)(100*row.self/total+0.5)<<"% calls="<<row.entry.calls;
+			if (row.entry.hits) os<<" hits="<<row.entry.hits;
+			if (row.entry.points != row.entry.calls) os<<" points="<<row.entry.points;
+			os<<" "<<label(*row.node, width)<<"\n";
+		}
+	}
+	// Folded stacks ("root;child;grandchild nanoseconds" per line) for flamegraph.pl, speedscope or inferno
+	void flamegraph(std::ostream &os, const Element<Field> &root, unsigned int width = PROFILE_WIDTH) const { fold(os, root, "", width); }
+};
+
+}
+}
+
+#endif // VARINT_PROFILE_HPP
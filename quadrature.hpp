@@ -0,0 +1,192 @@
+#ifndef VARINT_QUADRATURE_HPP
+#define VARINT_QUADRATURE_HPP
+
+#include <vector>
+#include <queue>
+#include <cmath>
+
+namespace varint {
+namespace quadrature {
+
+#define QUADRATURE_NEWTON_ITERATIONS 8
+#define QUADRATURE_PI 3.14159265358979323846
+#define DEFAULT_QUADRATURE_INTERVALS 256
+
+// Compile time helpers, all rules are given on [0,1]
+constexpr double cosine_series(double x2, double term, double sum, unsigned int k) {
+	return k > 24 ? sum : cosine_series(x2, -term*x2/((2*k+1)*(2*k+2)), sum + term, k+1);
+}
+constexpr double cosine(double x) { return cosine_series(x*x, 1.0, 0.0, 0); }
+
+constexpr double legendre_iter(unsigned int k, unsigned int n, double x, double prev, double cur) {
+	return k >= n ? cur : legendre_iter(k+1, n, x, cur, ((2*k+1)*x*cur - k*prev)/(k+1));
+}
+constexpr double legendre(unsigned int n, double x) { return n == 0 ? 1.0 : legendre_iter(1, n, x, 1.0, x); }
+// P'_n and P''_n, valid inside (-1,1)
+constexpr double legendre_d1(unsigned int n, double x) { return n == 0 ? 0.0 : n*(x*legendre(n, x) - legendre(n-1, x))/(x*x - 1.0); }
+constexpr double legendre_d2(unsigned int n, double x) { return (2.0*x*legendre_d1(n, x) - n*(n+1.0)*legendre(n, x))/(1.0 - x*x); }
+
+constexpr double legendre_newton(unsigned int n, double x, unsigned int iter) {
+	return iter == 0 ? x : legendre_newton(n, x - legendre(n, x)/legendre_d1(n, x), iter-1);
+}
+constexpr double legendre_root(unsigned int n, unsigned int i) {
+	return legendre_newton(n, -cosine(QUADRATURE_PI*(i+0.75)/(n+0.5)), QUADRATURE_NEWTON_ITERATIONS);
+}
+constexpr double legendre_weight(unsigned int n, double x) { return 2.0/((1.0 - x*x)*legendre_d1(n, x)*legendre_d1(n, x)); }
+
+constexpr double lobatto_newton(unsigned int n, double x, unsigned int iter) {
+	return iter == 0 ? x : lobatto_newton(n, x - legendre_d1(n, x)/legendre_d2(n, x), iter-1);
+}
+constexpr double lobatto_root(unsigned int n, unsigned int i) {
+	return i == 0 ? -1.0 : (i == n-1 ? 1.0 : lobatto_newton(n-1, -cosine(QUADRATURE_PI*i/(n-1)), QUADRATURE_NEWTON_ITERATIONS));
+}
+constexpr double lobatto_weight(unsigned int n, double x) { return 2.0/(n*(n-1.0)*legendre(n-1, x)*legendre(n-1, x)); }
+
+template<unsigned int... I> struct Indices {};
+template<unsigned int N, unsigned int... I> struct MakeIndices : MakeIndices<N-1, N-1, I...> {};
+template<unsigned int... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+template<class Rule, class Ind> struct QuadratureTable;
+
+template<class Rule, unsigned int... I> struct QuadratureTable<Rule, Indices<I...> > {
+	static constexpr unsigned int points = sizeof...(I);
+	static constexpr double nodes[sizeof...(I)] = { Rule::node(I)... };
+	static constexpr double weights[sizeof...(I)] = { Rule::weight(I)... };
+};
+
+template<class Rule, unsigned int... I> constexpr unsigned int QuadratureTable<Rule, Indices<I...> >::points;
+template<class Rule, unsigned int... I> constexpr double QuadratureTable<Rule, Indices<I...> >::nodes[sizeof...(I)];
+template<class Rule, unsigned int... I> constexpr double QuadratureTable<Rule, Indices<I...> >::weights[sizeof...(I)];
+
+template<unsigned int n> struct GaussLegendreRule {
+	static constexpr double node(unsigned int i) { return (1.0 + legendre_root(n, i))/2.0; }
+	static constexpr double weight(unsigned int i) { return legendre_weight(n, legendre_root(n, i))/2.0; }
+};
+
+template<unsigned int n> struct GaussLobattoRule {
+	static constexpr double node(unsigned int i) { return (1.0 + lobatto_root(n, i))/2.0; }
+	static constexpr double weight(unsigned int i) { return lobatto_weight(n, lobatto_root(n, i))/2.0; }
+};
+
+// n points, exact for polynomials of degree 2n-1
+template<unsigned int n> struct GaussLegendre : public QuadratureTable< GaussLegendreRule<n>, typename MakeIndices<n>::type > {
+	static constexpr unsigned int degree = 2*n - 1;
+};
+
+// n points including both ends, exact for polynomials of degree 2n-3
+template<unsigned int n> struct GaussLobatto : public QuadratureTable< GaussLobattoRule<n>, typename MakeIndices<n>::type > {
+	static_assert(n >= 2, "Gauss-Lobatto rule needs at least two points");
+	static constexpr unsigned int degree = 2*n - 3;
+};
+
+template<unsigned int n> constexpr unsigned int GaussLegendre<n>::degree;
+template<unsigned int n> constexpr unsigned int GaussLobatto<n>::degree;
+
+// 15 point Kronrod extension of the 7 point Gauss rule, gauss_weights are zero at the Kronrod nodes.
+// A template only so that the tables can be defined in the header.
+template<class Dummy = void> struct GaussKronrodTable {
+	static constexpr unsigned int points = 15;
+	static constexpr double nodes[15] = { 0.004272314439593680397, 0.025446043828620737737, 0.067567788320115463605, 0.129234407200302780068, 0.206956382266154434853, 0.297077424311301416547, 0.3961075224960507662, 0.5, 0.6038924775039492338, 0.702922575688698583453, 0.793043617733845565147, 0.870765592799697219932, 0.932432211679884536395, 0.974553956171379262263, 0.995727685560406319603 };
+	static constexpr double weights[15] = { 0.011467661005264612482, 0.031546046314989276645, 0.05239500516112509192, 0.070326629857762959373, 0.084502363319633951413, 0.095175289032392704957, 0.102216470037649446207, 0.104741070542363914006, 0.102216470037649446207, 0.095175289032392704957, 0.084502363319633951413, 0.070326629857762959373, 0.05239500516112509192, 0.031546046314989276645, 0.011467661005264612482 };
+	static constexpr double gauss_weights[15] = { 0.0, 0.064742483084434846635, 0.0, 0.139852695744638333951, 0.0, 0.190915025252559472475, 0.0, 0.208979591836734693878, 0.0, 0.190915025252559472475, 0.0, 0.139852695744638333951, 0.0, 0.064742483084434846635, 0.0 };
+};
+
+template<class Dummy> constexpr unsigned int GaussKronrodTable<Dummy>::points;
+template<class Dummy> constexpr double GaussKronrodTable<Dummy>::nodes[15];
+template<class Dummy> constexpr double GaussKronrodTable<Dummy>::weights[15];
+template<class Dummy> constexpr double GaussKronrodTable<Dummy>::gauss_weights[15];
+typedef GaussKronrodTable<> GaussKronrod15;
+
+// Integrands are called with a whole batch of nodes, f(nodes, values) sets values[i] = f(nodes[i])
+
+// Composite rule over intervals equal parts of [a,b], all nodes in one call of f
+template<class Rule, class Field, class Integrand> Field integrate(Integrand f, Field a, Field b, unsigned int intervals = 1) {
+	std::vector<Field> nodes(intervals*Rule::points), values;
+	Field h = (b-a)/Field(intervals), ret = 0;
+	for (unsigned int k = 0; k < intervals; k++) {
+		for (unsigned int i = 0; i < Rule::points; i++) nodes[k*Rule::points+i] = a + h*(Field(k) + Field(Rule::nodes[i]));
+	}
+	f(nodes, values);
+	for (unsigned int k = 0; k < intervals; k++) {
+		for (unsigned int i = 0; i < Rule::points; i++) ret += Field(Rule::weights[i])*values[k*Rule::points+i];
+	}
+	return ret*h;
+}
+
+// Gauss-Legendre rule chosen at run time, 1 to 8 points
+template<class Field, class Integrand> Field integrate_gauss(unsigned int points, Integrand f, Field a, Field b, unsigned int intervals = 1) {
+	switch (points) {
+		case 1: return integrate< GaussLegendre<1> >(f, a, b, intervals);
+		case 2: return integrate< GaussLegendre<2> >(f, a, b, intervals);
+		case 3: return integrate< GaussLegendre<3> >(f, a, b, intervals);
+		case 4: return integrate< GaussLegendre<4> >(f, a, b, intervals);
+		case 5: return integrate< GaussLegendre<5> >(f, a, b, intervals);
+		case 6: return integrate< GaussLegendre<6> >(f, a, b, intervals);
+		case 7: return integrate< GaussLegendre<7> >(f, a, b, intervals);
+		default: return integrate< GaussLegendre<8> >(f, a, b, intervals);
+	}
+}
+
+template<class Field> struct Segment {
+	Field a, b, value, error;
+	bool operator < (const Segment<Field> &other) const { return error < other.error; }
+};
+
+// Kronrod estimates of the segments, error is the difference to the embedded Gauss rule. One call of f for all segments.
+template<class Field, class Integrand> void kronrod(Integrand f, std::vector< Segment<Field> > &segments) {
+	using std::abs;
+	const unsigned int n = GaussKronrod15::points;
+	std::vector<Field> nodes(segments.size()*n), values;
+	for (unsigned int k = 0; k < segments.size(); k++) {
+		for (unsigned int i = 0; i < n; i++) nodes[k*n+i] = segments[k].a + (segments[k].b-segments[k].a)*Field(GaussKronrod15::nodes[i]);
+	}
+	f(nodes, values);
+	for (unsigned int k = 0; k < segments.size(); k++) {
+		Field kr = 0, g = 0, h = segments[k].b-segments[k].a;
+		for (unsigned int i = 0; i < n; i++) {
+			kr += Field(GaussKronrod15::weights[i])*values[k*n+i];
+			g += Field(GaussKronrod15::gauss_weights[i])*values[k*n+i];
+		}
+		segments[k].value = kr*h;
+		segments[k].error = abs((kr-g)*h);
+	}
+}
+
+// Adaptive Gauss-Kronrod: the segment with the largest error is halved until the total error is below
+// tolerance*max(1,|integral|) or max_intervals segments are used. Both halves are evaluated in one call of f.
+template<class Field, class Integrand> Field integrate_adaptive(Integrand f, Field a, Field b, Field tolerance, unsigned int max_intervals = DEFAULT_QUADRATURE_INTERVALS) {
+	using std::abs;
+	std::vector< Segment<Field> > batch(1);
+	batch[0].a = a;
+	batch[0].b = b;
+	kronrod(f, batch);
+	std::priority_queue< Segment<Field> > queue;
+	queue.push(batch[0]);
+	Field value = batch[0].value, error = batch[0].error;
+	batch.resize(2);
+	while (queue.size() < max_intervals) {
+		Field scale = abs(value) < Field(1) ? Field(1) : abs(value);
+		if (error <= tolerance*scale) break;
+		Segment<Field> worst = queue.top();
+		queue.pop();
+		Field mid = (worst.a+worst.b)/Field(2);
+		batch[0].a = worst.a;
+		batch[0].b = mid;
+		batch[1].a = mid;
+		batch[1].b = worst.b;
+		kronrod(f, batch);
+		value += batch[0].value+batch[1].value-worst.value;
+		error += batch[0].error+batch[1].error-worst.error;
+		queue.push(batch[0]);
+		queue.push(batch[1]);
+	}
+	// Sum again, the running sum picks up rounding from the subtractions
+	value = 0;
+	for (; !queue.empty(); queue.pop()) value += queue.top().value;
+	return value;
+}
+
+}
+}
+
+#endif // VARINT_QUADRATURE_HPP
@@ -0,0 +1,406 @@
+#ifndef VARINT_RATIONAL_HPP
+#define VARINT_RATIONAL_HPP
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <memory>
+#include <cmath>
+#include <climits>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+namespace varint {
+
+// Checked machine arithmetic, false on overflow
+inline bool checked_add(long long a, long long b, long long &r) {
+#if defined(__GNUC__) || defined(__clang__)
+	return !__builtin_add_overflow(a, b, &r);
+#else
+	if ((b > 0 && a > LLONG_MAX - b) || (b < 0 && a < LLONG_MIN - b)) return false;
+	r = a + b;
+	return true;
+#endif
+}
+
+inline bool checked_mul(long long a, long long b, long long &r) {
+#if defined(__GNUC__) || defined(__clang__)
+	return !__builtin_mul_overflow(a, b, &r);
+#else
+	if ((a > INT_MAX) || (a < -INT_MAX) || (b > INT_MAX) || (b < -INT_MAX)) return false;
+	r = a * b;
+	return true;
+#endif
+}
+
+inline long long gcd(long long a, long long b) {
+	unsigned long long x = a < 0 ? 0ULL - (unsigned long long)a : a;
+	unsigned long long y = b < 0 ? 0ULL - (unsigned long long)b : b;
+	while (y != 0) {
+		unsigned long long t = x % y;
+		x = y;
+		y = t;
+	}
+	return (long long)x;
+}
+
+// Arbitrary precision integer, sign and magnitude in base 2^32
+class BigInt {
+protected:
+	bool negative;
+	std::vector<uint32_t> limbs;
+	void trim() {
+		while (!limbs.empty() && (limbs.back() == 0)) limbs.pop_back();
+		if (limbs.empty()) negative = false;
+	}
+	static int compareMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+		if (a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+		for (unsigned int i = a.size(); i-- > 0; ) {
+			if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+		}
+		return 0;
+	}
+	static std::vector<uint32_t> addMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+		std::vector<uint32_t> ret(std::max(a.size(), b.size()) + 1, 0);
+		uint64_t carry = 0;
+		for (unsigned int i = 0; i < ret.size(); i++) {
+			uint64_t cur = carry + (i < a.size() ? a[i] : 0) + (i < b.size() ? b[i] : 0);
+			ret[i] = (uint32_t)cur;
+			carry = cur >> 32;
+		}
+		return ret;
+	}
+	// |a| >= |b|
+	static std::vector<uint32_t> subMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+		std::vector<uint32_t> ret(a.size(), 0);
+		int64_t borrow = 0;
+		for (unsigned int i = 0; i < a.size(); i++) {
+			int64_t cur = (int64_t)a[i] - borrow - (i < b.size() ? b[i] : 0);
+			borrow = cur < 0 ? 1 : 0;
+			ret[i] = (uint32_t)(cur + (borrow << 32));
+		}
+		return ret;
+	}
+	static std::vector<uint32_t> mulMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+		std::vector<uint32_t> ret(a.size() + b.size(), 0);
+		for (unsigned int i = 0; i < a.size(); i++) {
+			uint64_t carry = 0;
+			for (unsigned int j = 0; j < b.size(); j++) {
+				uint64_t cur = (uint64_t)a[i]*b[j] + ret[i+j] + carry;
+				ret[i+j] = (uint32_t)cur;
+				carry = cur >> 32;
+			}
+			ret[i+b.size()] = (uint32_t)carry;
+		}
+		return ret;
+	}
+	// Shift-subtract long division of magnitudes
+	static void divModMagnitude(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b, std::vector<uint32_t> &q, std::vector<uint32_t> &r) {
+		q.assign(a.size(), 0);
+		r.clear();
+		if (b.size() == 1) {
+			uint64_t rem = 0;
+			for (unsigned int i = a.size(); i-- > 0; ) {
+				uint64_t cur = (rem << 32) | a[i];
+				q[i] = (uint32_t)(cur / b[0]);
+				rem = cur % b[0];
+			}
+			if (rem) r.push_back((uint32_t)rem);
+			return;
+		}
+		for (unsigned int i = a.size()*32; i-- > 0; ) {
+			uint32_t carry = (a[i/32] >> (i%32)) & 1;
+			for (unsigned int j = 0; j < r.size(); j++) {
+				uint32_t next = r[j] >> 31;
+				r[j] = (r[j] << 1) | carry;
+				carry = next;
+			}
+			if (carry) r.push_back(carry);
+			if (compareMagnitude(r, b) >= 0) {
+				r = subMagnitude(r, b);
+				while (!r.empty() && (r.back() == 0)) r.pop_back();
+				q[i/32] |= 1u << (i%32);
+			}
+		}
+	}
+public:
+	BigInt(long long value = 0) : negative(value < 0) {
+		unsigned long long mag = value < 0 ? 0ULL - (unsigned long long)value : value;
+		while (mag) {
+			limbs.push_back((uint32_t)mag);
+			mag >>= 32;
+		}
+	}
+	bool isZero() const { return limbs.empty(); }
+	bool isNegative() const { return negative; }
+	bool fitsInt64() const {
+		if (limbs.size() > 2) return false;
+		uint64_t mag = limbs.size() > 1 ? ((uint64_t)limbs[1] << 32) | limbs[0] : (limbs.empty() ? 0 : limbs[0]);
+		return negative ? mag <= (uint64_t)LLONG_MAX + 1 : mag <= (uint64_t)LLONG_MAX;
+	}
+	long long toInt64() const {
+		uint64_t mag = limbs.size() > 1 ? ((uint64_t)limbs[1] << 32) | limbs[0] : (limbs.empty() ? 0 : limbs[0]);
+		return negative ? (long long)(0ULL - mag) : (long long)mag;
+	}
+	double toDouble() const {
+		double ret = 0;
+		for (unsigned int i = limbs.size(); i-- > 0; ) ret = ret*4294967296.0 + limbs[i];
+		return negative ? -ret : ret;
+	}
+	BigInt abs() const { BigInt ret(*this); ret.negative = false; return ret; }
+	BigInt operator - () const { BigInt ret(*this); if (!ret.isZero()) ret.negative = !negative; return ret; }
+	friend BigInt operator + (const BigInt &a, const BigInt &b) {
+		BigInt ret;
+		if (a.negative == b.negative) {
+			ret.limbs = addMagnitude(a.limbs, b.limbs);
+			ret.negative = a.negative;
+		} else if (compareMagnitude(a.limbs, b.limbs) >= 0) {
+			ret.limbs = subMagnitude(a.limbs, b.limbs);
+			ret.negative = a.negative;
+		} else {
+			ret.limbs = subMagnitude(b.limbs, a.limbs);
+			ret.negative = b.negative;
+		}
+		ret.trim();
+		return ret;
+	}
+	friend BigInt operator - (const BigInt &a, const BigInt &b) { return a + (-b); }
+	friend BigInt operator * (const BigInt &a, const BigInt &b) {
+		BigInt ret;
+		ret.limbs = mulMagnitude(a.limbs, b.limbs);
+		ret.negative = a.negative != b.negative;
+		ret.trim();
+		return ret;
+	}
+	// Truncating division, remainder has the sign of a
+	static void divMod(const BigInt &a, const BigInt &b, BigInt &q, BigInt &r) {
+		divModMagnitude(a.limbs, b.limbs, q.limbs, r.limbs);
+		q.negative = a.negative != b.negative;
+		r.negative = a.negative;
+		q.trim();
+		r.trim();
+	}
+	friend BigInt operator / (const BigInt &a, const BigInt &b) { BigInt q, r; divMod(a, b, q, r); return q; }
+	friend BigInt operator % (const BigInt &a, const BigInt &b) { BigInt q, r; divMod(a, b, q, r); return r; }
+	friend int compare(const BigInt &a, const BigInt &b) {
+		if (a.negative != b.negative) return a.negative ? -1 : 1;
+		int ret = compareMagnitude(a.limbs, b.limbs);
+		return a.negative ? -ret : ret;
+	}
+	friend bool operator == (const BigInt &a, const BigInt &b) { return compare(a, b) == 0; }
+	friend bool operator != (const BigInt &a, const BigInt &b) { return compare(a, b) != 0; }
+	friend bool operator < (const BigInt &a, const BigInt &b) { return compare(a, b) < 0; }
+	friend BigInt gcd(BigInt a, BigInt b) {
+		a = a.abs();
+		b = b.abs();
+		while (!b.isZero()) {
+			BigInt t = a % b;
+			a = b;
+			b = t;
+		}
+		return a;
+	}
+	std::string toString() const {
+		if (isZero()) return "0";
+		std::string ret;
+		std::vector<uint32_t> cur(limbs), q, r;
+		std::vector<uint32_t> base(1, 1000000000u);
+		while (!cur.empty()) {
+			divModMagnitude(cur, base, q, r);
+			uint32_t chunk = r.empty() ? 0 : r[0];
+			while (!q.empty() && (q.back() == 0)) q.pop_back();
+			for (int i = 0; i < 9; i++) {
+				if (q.empty() && (chunk == 0)) break;
+				ret += (char)('0' + chunk % 10);
+				chunk /= 10;
+			}
+			cur = q;
+		}
+		if (negative) ret += '-';
+		std::reverse(ret.begin(), ret.end());
+		return ret;
+	}
+	friend std::ostream& operator<<(std::ostream& os, const BigInt &value) { return os<<value.toString(); }
+};
+
+struct BigRational {
+	BigInt num;
+	BigInt den;
+};
+
+// Exact rational Field. Numerator and denominator live inline as machine integers and are
+// promoted to a shared heap BigRational only when an operation overflows.
+// Always normalized: den > 0, gcd(num, den) == 1.
+class Rational {
+protected:
+	long long num;
+	long long den;
+	std::shared_ptr<const BigRational> big;
+	BigInt bigNum() const { return big ? big->num : BigInt(num); }
+	BigInt bigDen() const { return big ? big->den : BigInt(den); }
+	static Rational fromBig(BigInt n, BigInt d) {
+		Rational ret;
+		if (d.isZero()) throw std::domain_error("Rational with a zero denominator");
+		if (d.isNegative()) {
+			n = -n;
+			d = -d;
+		}
+		BigInt g = gcd(n, d);
+		if (!g.isZero() && (g != BigInt(1))) {
+			n = n / g;
+			d = d / g;
+		}
+		if (n.fitsInt64() && d.fitsInt64()) {
+			ret.num = n.toInt64();
+			ret.den = d.toInt64();
+		} else {
+			std::shared_ptr<BigRational> tmp(new BigRational());
+			tmp->num = n;
+			tmp->den = d;
+			ret.big = tmp;
+		}
+		return ret;
+	}
+	// Fast path result, falls back to big integers when normalization itself overflows
+	static Rational make(long long n, long long d) {
+		if (d == 0) throw std::domain_error("Rational with a zero denominator");
+		if (d < 0) {
+			if ((n == LLONG_MIN) || (d == LLONG_MIN)) return fromBig(BigInt(n), BigInt(d));
+			n = -n;
+			d = -d;
+		}
+		long long g = gcd(n, d);
+		Rational ret;
+		if (g > 1) {
+			n /= g;
+			d /= g;
+		}
+		ret.num = n;
+		ret.den = d;
+		return ret;
+	}
+public:
+	// A zero denominator, also from a division by zero, throws std::domain_error
+	Rational(long long _num = 0) : num(_num), den(1) {}
+	Rational(long long _num, long long _den) : num(0), den(1) { *this = make(_num, _den); }
+	// Exact value of a double, which is always a dyadic rational, throws std::domain_error for inf and NaN
+	static Rational fromDouble(double value) {
+		if (!std::isfinite(value)) throw std::domain_error("Rational from a non-finite double");
+		int exp;
+		double mant = std::frexp(value, &exp);
+		long long n = (long long)std::ldexp(mant, 53);
+		exp -= 53;
+		BigInt bn(n), bd(1);
+		for (; exp > 0; exp--) bn = bn * BigInt(2);
+		for (; exp < 0; exp++) bd = bd * BigInt(2);
+		return fromBig(bn, bd);
+	}
+	bool isSmall() const { return !big; }
+	bool isInteger() const { return big ? big->den == BigInt(1) : den == 1; }
+	BigInt numerator() const { return bigNum(); }
+	BigInt denominator() const { return bigDen(); }
+	double toDouble() const { return big ? big->num.toDouble()/big->den.toDouble() : (double)num/(double)den; }
+	explicit operator double() const { return toDouble(); }
+	Rational operator - () const {
+		if (!big && (num != LLONG_MIN)) return Rational(-num, den);
+		return fromBig(-bigNum(), bigDen());
+	}
+	friend Rational operator + (const Rational &a, const Rational &b) {
+		if (!a.big && !b.big) {
+			long long n1, n2, n, d;
+			if ((a.den == b.den) && checked_add(a.num, b.num, n)) return make(n, a.den);
+			if (checked_mul(a.num, b.den, n1) && checked_mul(b.num, a.den, n2) && checked_add(n1, n2, n) && checked_mul(a.den, b.den, d)) return make(n, d);
+		}
+		return fromBig(a.bigNum()*b.bigDen() + b.bigNum()*a.bigDen(), a.bigDen()*b.bigDen());
+	}
+	friend Rational operator - (const Rational &a, const Rational &b) { return a + (-b); }
+	friend Rational operator * (const Rational &a, const Rational &b) {
+		if (!a.big && !b.big) {
+			// Cross reduction keeps the result normalized without a final gcd
+			long long g1 = gcd(a.num, b.den), g2 = gcd(b.num, a.den), n, d;
+			if (g1 == 0) g1 = 1;
+			if (g2 == 0) g2 = 1;
+			if (checked_mul(a.num/g1, b.num/g2, n) && checked_mul(a.den/g2, b.den/g1, d)) {
+				Rational ret;
+				ret.num = n;
+				ret.den = d;
+				return ret;
+			}
+		}
+		return fromBig(a.bigNum()*b.bigNum(), a.bigDen()*b.bigDen());
+	}
+	friend Rational operator / (const Rational &a, const Rational &b) {
+		if (!b.big) {
+			if (b.num == LLONG_MIN) return a * fromBig(BigInt(b.den), BigInt(b.num));
+			return a * make(b.den, b.num);
+		}
+		return a * fromBig(b.big->den, b.big->num);
+	}
+	Rational& operator += (const Rational &other) { return *this = *this + other; }
+	Rational& operator -= (const Rational &other) { return *this = *this - other; }
+	Rational& operator *= (const Rational &other) { return *this = *this * other; }
+	Rational& operator /= (const Rational &other) { return *this = *this / other; }
+	friend int compare(const Rational &a, const Rational &b) {
+		if (!a.big && !b.big) {
+			if (a.den == b.den) return a.num < b.num ? -1 : (a.num > b.num ? 1 : 0);
+			long long n1, n2;
+			if (checked_mul(a.num, b.den, n1) && checked_mul(b.num, a.den, n2)) return n1 < n2 ? -1 : (n1 > n2 ? 1 : 0);
+		}
+		return compare(a.bigNum()*b.bigDen(), b.bigNum()*a.bigDen());
+	}
+	friend bool operator == (const Rational &a, const Rational &b) {
+		if (!a.big && !b.big) return (a.num == b.num) && (a.den == b.den);
+		return compare(a, b) == 0;
+	}
+	friend bool operator != (const Rational &a, const Rational &b) { return !(a == b); }
+	friend bool operator < (const Rational &a, const Rational &b) { return compare(a, b) < 0; }
+	friend bool operator > (const Rational &a, const Rational &b) { return compare(a, b) > 0; }
+	friend bool operator <= (const Rational &a, const Rational &b) { return compare(a, b) <= 0; }
+	friend bool operator >= (const Rational &a, const Rational &b) { return compare(a, b) >= 0; }
+	friend Rational abs(const Rational &a) { return a < Rational(0) ? -a : a; }
+	// Exact for integer exponents, otherwise through double
+	friend Rational pow(const Rational &base, const Rational &exponent) {
+		if (!exponent.isInteger() || !exponent.isSmall()) return fromDouble(std::pow(base.toDouble(), exponent.toDouble()));
+		long long e = exponent.num;
+		Rational ret(1), cur(e < 0 ? Rational(1)/base : base);
+		unsigned long long k = e < 0 ? 0ULL - (unsigned long long)e : e;
+		while (k) {
+			if (k & 1) ret *= cur;
+			k >>= 1;
+			if (k) cur *= cur;
+		}
+		return ret;
+	}
+	// Elementary functions are not rational, the exact value of the nearest double stands for them
+#define RATIONAL_THROUGH_DOUBLE(f) friend Rational f(const Rational &a) { return fromDouble(std::f(a.toDouble())); }
+	RATIONAL_THROUGH_DOUBLE(sin)
+	RATIONAL_THROUGH_DOUBLE(cos)
+	RATIONAL_THROUGH_DOUBLE(tan)
+	RATIONAL_THROUGH_DOUBLE(asin)
+	RATIONAL_THROUGH_DOUBLE(acos)
+	RATIONAL_THROUGH_DOUBLE(atan)
+	RATIONAL_THROUGH_DOUBLE(sinh)
+	RATIONAL_THROUGH_DOUBLE(cosh)
+	RATIONAL_THROUGH_DOUBLE(tanh)
+	RATIONAL_THROUGH_DOUBLE(exp)
+	RATIONAL_THROUGH_DOUBLE(log)
+	RATIONAL_THROUGH_DOUBLE(sqrt)
+#undef RATIONAL_THROUGH_DOUBLE
+	friend Rational atan2(const Rational &y, const Rational &x) { return fromDouble(std::atan2(y.toDouble(), x.toDouble())); }
+	friend Rational hypot(const Rational &x, const Rational &y) { return fromDouble(std::hypot(x.toDouble(), y.toDouble())); }
+	friend std::ostream& operator<<(std::ostream& os, const Rational &value) {
+		if (value.big) {
+			os<<value.big->num;
+			if (value.big->den != BigInt(1)) os<<"/"<<value.big->den;
+		} else {
+			os<<value.num;
+			if (value.den != 1) os<<"/"<<value.den;
+		}
+		return os;
+	}
+};
+
+}
+
+#endif // VARINT_RATIONAL_HPP
@@ -0,0 +1,379 @@
+#ifndef VARINT_REWRITE_HPP
+#define VARINT_REWRITE_HPP
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <cmath>
+#include "formula.hpp"
+
+namespace varint {
+namespace formula {
+
+#ifndef EL_UPTR
+#define EL_PTR Element<Field> *
+#define EL_UPTR std::unique_ptr< Element<Field> >
+#define REWRITE_UNDEF_MACROS
+#endif
+
+#define REWRITE_MAX_DEPTH 64
+
+// Rewrite rule matching a node of kind pattern[0] whose first children are of kinds pattern[1..],
+// KIND_ANY matches every kind. apply() returns the replacement of the node or nullptr,
+// rules that only reorder the node in place also return nullptr.
+template<class Field> class Rule {
+protected:
+	std::vector<Kind> pattern;
+public:
+	Rule(std::initializer_list<Kind> _pattern) : pattern(_pattern) {}
+	virtual ~Rule() {}
+	const std::vector<Kind>& getPattern() const { return pattern; }
+	virtual EL_UPTR apply(Element<Field> &node) const = 0;
+};
+
+// Discrimination tree over kind patterns: a lookup follows the node kind and the kinds of its
+// children, plus the KIND_ANY edges, and returns only the rules that can match.
+class RuleIndex {
+protected:
+	std::vector< std::array<int, KIND_COUNT> > edges;
+	std::vector< std::vector<unsigned int> > leaves;
+	template<class Field> void walk(unsigned int cur, unsigned int depth, const Element<Field> &node, std::vector<unsigned int> &found) const {
+		found.insert(found.end(), leaves[cur].begin(), leaves[cur].end());
+		Kind key;
+		if (depth == 0) key = node.getKind();
+		else if (depth <= node.arity()) key = node.getChild(depth-1)->getKind();
+		else return;
+		if ((key != KIND_ANY) && (edges[cur][key] >= 0)) walk(edges[cur][key], depth+1, node, found);
+		if (edges[cur][KIND_ANY] >= 0) walk(edges[cur][KIND_ANY], depth+1, node, found);
+	}
+	unsigned int node() {
+		std::array<int, KIND_COUNT> none;
+		none.fill(-1);
+		edges.push_back(none);
+		leaves.push_back(std::vector<unsigned int>());
+		return edges.size()-1;
+	}
+public:
+	RuleIndex() { node(); }
+	void insert(const std::vector<Kind> &pattern, unsigned int rule) {
+		unsigned int cur = 0;
+		for (auto key = pattern.begin(); key != pattern.end(); key++) {
+			if (edges[cur][*key] < 0) {
+				unsigned int next = node();
+				edges[cur][*key] = next;
+			}
+			cur = edges[cur][*key];
+		}
+		leaves[cur].push_back(rule);
+	}
+	// Rules that can match node, in insertion order
+	template<class Field> void match(const Element<Field> &node, std::vector<unsigned int> &found) const {
+		found.clear();
+		walk(0, 0, node, found);
+		std::sort(found.begin(), found.end());
+	}
+	unsigned int size() const { return edges.size(); }
+};
+
+// Bottom-up rewriting: children first, then the rules indexed for the node, in the order they were added.
+// A replacement is rewritten again, so rules can rely on their output being simplified.
+template<class Field> class Rewriter {
+protected:
+	std::vector< std::unique_ptr< Rule<Field> > > rules;
+	RuleIndex index;
+	void addStandardRules();
+public:
+	Rewriter(bool standard_rules = true) { if (standard_rules) addStandardRules(); }
+	// Takes ownership of the rule
+	void add(Rule<Field> *rule) {
+		index.insert(rule->getPattern(), rules.size());
+		rules.push_back(std::unique_ptr< Rule<Field> >(rule));
+	}
+	unsigned int size() const { return rules.size(); }
+	const RuleIndex& getIndex() const { return index; }
+	// Replacement of node, nullptr if node was only changed in place
+	EL_UPTR rewrite(Element<Field> &node, unsigned int depth = 0) const {
+		rewriteChildren(node, depth);
+		if (depth >= REWRITE_MAX_DEPTH) return nullptr;
+		std::vector<unsigned int> found;
+		index.match(node, found);
+		for (auto rule = found.begin(); rule != found.end(); rule++) {
+			EL_UPTR ret = std::move(rules[*rule]->apply(node));
+			if (ret) {
+				EL_UPTR again = std::move(rewrite(*ret, depth+1));
+				return again ? std::move(again) : std::move(ret);
+			}
+		}
+		return nullptr;
+	}
+	void rewriteChildren(Element<Field> &node, unsigned int depth = 0) const {
+		for (unsigned int i = 0; i < node.arity(); i++) {
+			EL_PTR child = node.getChild(i);
+			EL_UPTR ret = std::move(rewrite(*child, depth));
+			if (ret) node.replaceById(child->getId(), std::move(ret));
+		}
+	}
+	// Rewrites node, a replacement of node itself is installed through its parent
+	void simplify(Element<Field> &node) const {
+		EL_UPTR ret = std::move(rewrite(node));
+		if (ret && node.getParent()) node.getParent()->replaceById(node.getId(), std::move(ret));
+	}
+	// Rules used by Element::simplifyObject, domain rules added here apply to every simplification
+	static Rewriter<Field>& standard() {
+		static Rewriter<Field> ret;
+		return ret;
+	}
+};
+
+// Flattens nested collections of the same kind, sorts the terms and folds the constants
+template<class Field, class C> class CanonicalCollection : public Rule<Field> {
+public:
+	CanonicalCollection() : Rule<Field>({ C::KIND }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		C &collection = static_cast<C&>(node);
+		collection.flatten();
+		collection.sort();
+		collection.collectConstants();
+		return nullptr;
+	}
+};
+
+// Empty collection is the neutral element, a single term stands for the collection
+template<class Field, class C> class TrivialCollection : public Rule<Field> {
+public:
+	TrivialCollection() : Rule<Field>({ C::KIND }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		C &collection = static_cast<C&>(node);
+		if (collection.arity() == 0) return EL_UPTR(new Constant<Field>(Field(C::KIND == KIND_SUM ? 0 : 1)));
+		if (collection.arity() == 1) return std::move(collection.term(0)->clone());
+		return nullptr;
+	}
+};
+
+// x^1 = x, x^0 = 1
+template<class Field> class PowerIdentity : public Rule<Field> {
+public:
+	PowerIdentity() : Rule<Field>({ KIND_POWER, KIND_ANY, KIND_CONSTANT }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		Power<Field> &power = static_cast<Power<Field>&>(node);
+		if ((*power.getPower())==Field(1)) return std::move(power.getExpression()->clone());
+		if ((*power.getPower())==Field(0)) return EL_UPTR(new Constant<Field>(1));
+		return nullptr;
+	}
+};
+
+// (a*b)^n = a^n*b^n
+template<class Field> class PowerOfProduct : public Rule<Field> {
+public:
+	PowerOfProduct() : Rule<Field>({ KIND_POWER, KIND_PRODUCT }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		Power<Field> &power = static_cast<Power<Field>&>(node);
+		const Product<Field> &base = static_cast<const Product<Field>&>(*power.getExpression());
+		Product<Field> *ret = new Product<Field>();
+		for (auto term = base.getTerms().begin(); term != base.getTerms().end(); term++) {
+			ret->append(EL_UPTR(new Power<Field>(std::move((*term)->clone()), std::move(power.getPower()->clone()))));
+		}
+		return EL_UPTR(ret);
+	}
+};
+
+// a/1 = a
+template<class Field> class RatioIdentity : public Rule<Field> {
+public:
+	RatioIdentity() : Rule<Field>({ KIND_RATIO, KIND_ANY, KIND_CONSTANT }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		Ratio<Field> &ratio = static_cast<Ratio<Field>&>(node);
+		if ((*ratio.getDenominator())==Field(1)) return std::move(ratio.getNumerator()->clone());
+		return nullptr;
+	}
+};
+
+// 0/a = 0
+template<class Field> class RatioZero : public Rule<Field> {
+public:
+	RatioZero() : Rule<Field>({ KIND_RATIO, KIND_CONSTANT }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		Ratio<Field> &ratio = static_cast<Ratio<Field>&>(node);
+		if ((*ratio.getNumerator())==Field(0)) return EL_UPTR(new Constant<Field>(0));
+		return nullptr;
+	}
+};
+
+// Common polynomial factors of numerator and denominator cancel, (x^2-1)/(x+1) = x-1
+template<class Field> class RatioCancel : public Rule<Field> {
+public:
+	RatioCancel() : Rule<Field>({ KIND_RATIO }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const { return Expander<Field>().cancel(node); }
+};
+
+// a/b + c/d = (a*d + c*b)/(b*d) over the least common denominator, when that is cheaper to evaluate
+template<class Field> class CombineRatios : public Rule<Field> {
+public:
+	CombineRatios() : Rule<Field>({ KIND_SUM }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		unsigned int ratios = 0;
+		for (unsigned int i = 0; i < node.arity(); i++) if (node.getChild(i)->getKind() == KIND_RATIO) ratios++;
+		if (ratios < 2) return nullptr;
+		return Expander<Field>().combine(node);
+	}
+};
+
+// Built-in function of node, ELEMENTARY_NONE for other functions
+template<class Field> Elementary elementary_of(const Element<Field> &node) {
+	if (node.getKind() != KIND_FUNCTION) return ELEMENTARY_NONE;
+	if (node.arity() == 1) return static_cast<const Function<Field>&>(node).getFunction();
+	if (node.arity() == 2) return static_cast<const Function<Field, 2>&>(node).getFunction();
+	return ELEMENTARY_NONE;
+}
+
+// f(c) folds when the value is an integer, sin(0) = 0, exp(0) = 1, sqrt(4) = 2
+template<class Field> class ElementaryConstant : public Rule<Field> {
+public:
+	ElementaryConstant() : Rule<Field>({ KIND_FUNCTION, KIND_CONSTANT }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		Elementary f = elementary_of(node);
+		if (f == ELEMENTARY_NONE) return nullptr;
+		Field args[2];
+		for (unsigned int i = 0; i < node.arity(); i++) {
+			Constant<Field> *arg = kind_cast< Constant<Field> >(node.getChild(i));
+			if (!arg) return nullptr;
+			args[i] = arg->getValue();
+		}
+		Field value = Elementaries<Field>::scalar(f, args);
+		double approx = static_cast<double>(value);
+		if (!(std::fabs(approx) < 1e15)) return nullptr;
+		Field rounded = Field(static_cast<long long>(approx));
+		if (!(rounded == value)) return nullptr;
+		return EL_UPTR(new Constant<Field>(rounded));
+	}
+};
+
+// log(exp(u)) = u, exp(log(u)) = u, sin(asin(u)) = u, cos(acos(u)) = u, tan(atan(u)) = u
+template<class Field> class ElementaryInverse : public Rule<Field> {
+public:
+	ElementaryInverse() : Rule<Field>({ KIND_FUNCTION, KIND_FUNCTION }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		Elementary outer = elementary_of(node);
+		if ((outer == ELEMENTARY_NONE) || (node.arity() != 1)) return nullptr;
+		EL_PTR inner = node.getChild(0);
+		if (inner->arity() != 1) return nullptr;
+		Elementary f = elementary_of(*inner);
+		if (((outer == ELEMENTARY_LOG) && (f == ELEMENTARY_EXP)) || ((outer == ELEMENTARY_EXP) && (f == ELEMENTARY_LOG)) ||
+			((outer == ELEMENTARY_SIN) && (f == ELEMENTARY_ASIN)) || ((outer == ELEMENTARY_COS) && (f == ELEMENTARY_ACOS)) ||
+			((outer == ELEMENTARY_TAN) && (f == ELEMENTARY_ATAN))) return std::move(inner->getChild(0)->clone());
+		return nullptr;
+	}
+};
+
+// sqrt(u)^2 = u
+template<class Field> class SquareOfRoot : public Rule<Field> {
+public:
+	SquareOfRoot() : Rule<Field>({ KIND_POWER, KIND_FUNCTION, KIND_CONSTANT }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		Power<Field> &power = static_cast<Power<Field>&>(node);
+		if (!((*power.getPower())==Field(2)) || (elementary_of(*power.getExpression()) != ELEMENTARY_SQRT)) return nullptr;
+		return std::move(power.getExpression()->getChild(0)->clone());
+	}
+};
+
+// a*sin(u)^2 + a*cos(u)^2 = a
+template<class Field> class Pythagorean : public Rule<Field> {
+protected:
+	// u if el is sin(u)^2 or cos(u)^2
+	static EL_PTR squared(EL_PTR el, Elementary &f) {
+		Power<Field> *power = kind_cast< Power<Field> >(el);
+		if (!power || !((*power->getPower())==Field(2))) return nullptr;
+		f = elementary_of(*power->getExpression());
+		if ((f != ELEMENTARY_SIN) && (f != ELEMENTARY_COS)) return nullptr;
+		return power->getExpression()->getChild(0);
+	}
+	// Splits term into the squared function and the key of its argument and cofactors
+	static bool split(EL_PTR term, Elementary &f, std::string &key, int &factor) {
+		unsigned int n = (term->getKind() == KIND_PRODUCT) ? term->arity() : 1;
+		for (unsigned int i = 0; i < n; i++) {
+			EL_PTR el = (term->getKind() == KIND_PRODUCT) ? term->getChild(i) : term;
+			EL_PTR u = squared(el, f);
+			if (!u) continue;
+			key = u->stringify() + "|";
+			for (unsigned int j = 0; j < n; j++) if (j != i) key += term->getChild(j)->stringify() + "*";
+			factor = i;
+			return true;
+		}
+		return false;
+	}
+public:
+	Pythagorean() : Rule<Field>({ KIND_SUM }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		std::map<std::string, unsigned int> seen[2];
+		for (unsigned int i = 0; i < node.arity(); i++) {
+			Elementary f;
+			std::string key;
+			int factor;
+			if (!split(node.getChild(i), f, key, factor)) continue;
+			unsigned int side = (f == ELEMENTARY_SIN) ? 0 : 1;
+			auto other = seen[1-side].find(key);
+			if (other == seen[1-side].end()) {
+				seen[side][key] = i;
+				continue;
+			}
+			// The cofactors of the sin(u)^2 term stand for both terms
+			EL_PTR term = node.getChild(i);
+			std::vector< EL_UPTR > cofactors, parts;
+			if (term->getKind() == KIND_PRODUCT) {
+				for (unsigned int j = 0; j < term->arity(); j++) if ((int)j != factor) cofactors.push_back(std::move(term->getChild(j)->clone()));
+			}
+			for (unsigned int j = 0; j < node.arity(); j++) {
+				if ((j != i) && (j != other->second)) parts.push_back(std::move(node.getChild(j)->clone()));
+			}
+			parts.push_back(std::move(make_product<Field>(cofactors)));
+			return make_sum<Field>(parts);
+		}
+		return nullptr;
+	}
+};
+
+// A view inside a simplified tree is replaced by a materialized copy, whose substituted tree is then rewritten
+template<class Field> class MaterializeSubstitution : public Rule<Field> {
+public:
+	MaterializeSubstitution() : Rule<Field>({ KIND_SUBSTITUTION }) {}
+	virtual EL_UPTR apply(Element<Field> &node) const {
+		if (static_cast<Substitution<Field>&>(node).isMaterialized()) return nullptr;
+		EL_UPTR ret = std::move(node.clone());
+		static_cast<Substitution<Field>&>(*ret).materialize();
+		return ret;
+	}
+};
+
+template<class Field> void Rewriter<Field>::addStandardRules() {
+	add(new MaterializeSubstitution<Field>());
+	add(new CanonicalCollection< Field, Sum<Field> >());
+	add(new CanonicalCollection< Field, Product<Field> >());
+	add(new TrivialCollection< Field, Sum<Field> >());
+	add(new TrivialCollection< Field, Product<Field> >());
+	add(new PowerIdentity<Field>());
+	add(new PowerOfProduct<Field>());
+	add(new RatioIdentity<Field>());
+	add(new RatioZero<Field>());
+	add(new RatioCancel<Field>());
+	add(new CombineRatios<Field>());
+	add(new ElementaryConstant<Field>());
+	add(new ElementaryInverse<Field>());
+	add(new SquareOfRoot<Field>());
+	add(new Pythagorean<Field>());
+}
+
+#undef REWRITE_MAX_DEPTH
+#ifdef REWRITE_UNDEF_MACROS
+#undef EL_PTR
+#undef EL_UPTR
+#undef REWRITE_UNDEF_MACROS
+#endif
+
+}
+}
+
+#endif // VARINT_REWRITE_HPP
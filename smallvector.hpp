@@ -0,0 +1,129 @@
+#ifndef VARINT_SMALLVECTOR_HPP
+#define VARINT_SMALLVECTOR_HPP
+
+#include <new>
+#include <utility>
+#include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+
+namespace varint {
+
+// Vector whose first N elements live inside the object, it only allocates when it grows beyond N.
+// Iterators are pointers and are invalidated by any insertion, as with std::vector.
+template<class T, unsigned int N> class SmallVector {
+protected:
+	T *items;
+	unsigned int count;
+	unsigned int capacity;
+	typename std::aligned_storage<sizeof(T), alignof(T)>::type storage[N];
+	T* local() { return reinterpret_cast<T*>(storage); }
+	bool inlined() const { return items == reinterpret_cast<const T*>(storage); }
+	void release() { if (!inlined()) ::operator delete(items); }
+	void grow(unsigned int n) {
+		if (n <= capacity) return;
+		unsigned int next = std::max(n, 2*capacity);
+		T *moved = static_cast<T*>(::operator new(next*sizeof(T)));
+		for (unsigned int i = 0; i < count; i++) {
+			new (moved+i) T(std::move(items[i]));
+			items[i].~T();
+		}
+		release();
+		items = moved;
+		capacity = next;
+	}
+	// Takes the elements of other, which is left empty
+	void take(SmallVector<T, N> &other) {
+		if (other.inlined()) {
+			for (unsigned int i = 0; i < other.count; i++) new (items+i) T(std::move(other.items[i]));
+			count = other.count;
+			other.clear();
+		} else {
+			items = other.items;
+			count = other.count;
+			capacity = other.capacity;
+			other.items = other.local();
+			other.count = 0;
+			other.capacity = N;
+		}
+	}
+public:
+	typedef T value_type;
+	typedef T* iterator;
+	typedef const T* const_iterator;
+	SmallVector() : items(local()), count(0), capacity(N) {}
+	SmallVector(const SmallVector<T, N> &other) : items(local()), count(0), capacity(N) {
+		reserve(other.count);
+		for (unsigned int i = 0; i < other.count; i++) new (items+i) T(other.items[i]);
+		count = other.count;
+	}
+	SmallVector(SmallVector<T, N> &&other) : items(local()), count(0), capacity(N) { take(other); }
+	~SmallVector() { clear(); release(); }
+	SmallVector<T, N>& operator = (const SmallVector<T, N> &other) {
+		if (this == &other) return *this;
+		clear();
+		reserve(other.count);
+		for (unsigned int i = 0; i < other.count; i++) new (items+i) T(other.items[i]);
+		count = other.count;
+		return *this;
+	}
+	SmallVector<T, N>& operator = (SmallVector<T, N> &&other) {
+		if (this == &other) return *this;
+		clear();
+		release();
+		items = local();
+		capacity = N;
+		take(other);
+		return *this;
+	}
+	unsigned int size() const { return count; }
+	bool empty() const { return count == 0; }
+	iterator begin() { return items; }
+	iterator end() { return items+count; }
+	const_iterator begin() const { return items; }
+	const_iterator end() const { return items+count; }
+	T& operator [] (unsigned int i) { return items[i]; }
+	const T& operator [] (unsigned int i) const { return items[i]; }
+	T& at(unsigned int i) { if (i >= count) throw std::out_of_range("SmallVector::at"); return items[i]; }
+	const T& at(unsigned int i) const { if (i >= count) throw std::out_of_range("SmallVector::at"); return items[i]; }
+	T& front() { return items[0]; }
+	const T& front() const { return items[0]; }
+	T& back() { return items[count-1]; }
+	const T& back() const { return items[count-1]; }
+	void reserve(unsigned int n) { grow(n); }
+	void push_back(T value) {
+		grow(count+1);
+		new (items+count) T(std::move(value));
+		count++;
+	}
+	void pop_back() { items[--count].~T(); }
+	void clear() {
+		for (unsigned int i = 0; i < count; i++) items[i].~T();
+		count = 0;
+	}
+	iterator insert(const_iterator position, T value) {
+		unsigned int i = position-items;
+		grow(count+1);
+		if (i == count) new (items+count) T(std::move(value));
+		else {
+			new (items+count) T(std::move(items[count-1]));
+			for (unsigned int k = count-1; k > i; k--) items[k] = std::move(items[k-1]);
+			items[i] = std::move(value);
+		}
+		count++;
+		return items+i;
+	}
+	iterator erase(const_iterator position) { return erase(position, position+1); }
+	iterator erase(const_iterator first, const_iterator last) {
+		unsigned int i = first-items, n = last-first;
+		if (!n) return items+i;
+		for (unsigned int k = i; k+n < count; k++) items[k] = std::move(items[k+n]);
+		for (unsigned int k = count-n; k < count; k++) items[k].~T();
+		count -= n;
+		return items+i;
+	}
+};
+
+}
+
+#endif // VARINT_SMALLVECTOR_HPP
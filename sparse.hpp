@@ -0,0 +1,125 @@
+#ifndef VARINT_SPARSE_HPP
+#define VARINT_SPARSE_HPP
+
+#include <vector>
+#include <map>
+#include <set>
+#include <cmath>
+#include <algorithm>
+
+namespace varint {
+
+// Structural nonzeros of a square matrix stored by columns, plus a column coloring:
+// columns of the same color never share a row, so one residual evaluation gives all of them.
+class SparsePattern {
+protected:
+	std::vector< std::vector<unsigned int> > columns;
+	std::vector<unsigned int> colors;
+	std::vector< std::vector<unsigned int> > groups;
+public:
+	SparsePattern(unsigned int n = 0) : columns(n), colors(n, 0) {}
+	unsigned int size() const { return columns.size(); }
+	unsigned int nonzeros() const {
+		unsigned int ret = 0;
+		for (auto col = columns.begin(); col != columns.end(); col++) ret += col->size();
+		return ret;
+	}
+	void insert(unsigned int row, unsigned int col) { columns[col].push_back(row); }
+	const std::vector<unsigned int>& column(unsigned int col) const { return columns[col]; }
+	unsigned int color(unsigned int col) const { return colors[col]; }
+	unsigned int numColors() const { return groups.size(); }
+	const std::vector<unsigned int>& group(unsigned int c) const { return groups[c]; }
+	// Greedy distance-2 coloring of columns
+	void colorize() {
+		unsigned int n = columns.size();
+		std::vector< std::vector<unsigned int> > rows(n);
+		for (auto col = columns.begin(); col != columns.end(); col++) {
+			std::sort(col->begin(), col->end());
+			col->erase(std::unique(col->begin(), col->end()), col->end());
+		}
+		for (unsigned int j = 0; j < n; j++) {
+			for (auto row = columns[j].begin(); row != columns[j].end(); row++) rows[*row].push_back(j);
+		}
+		std::vector<unsigned int> forbidden(n, n);
+		groups.clear();
+		for (unsigned int j = 0; j < n; j++) {
+			for (auto row = columns[j].begin(); row != columns[j].end(); row++) {
+				for (auto other = rows[*row].begin(); other != rows[*row].end(); other++) {
+					if (*other < j) forbidden[colors[*other]] = j;
+				}
+			}
+			unsigned int c = 0;
+			while (forbidden[c] == j) c++;
+			colors[j] = c;
+			if (c >= groups.size()) groups.resize(c+1);
+			groups[c].push_back(j);
+		}
+	}
+};
+
+// Row-wise sparse matrix with in-place LU solve, fill-in is created only where elimination needs it
+template<class Field> class SparseMatrix {
+protected:
+	std::vector< std::map<unsigned int, Field> > rows;
+public:
+	SparseMatrix(unsigned int n = 0) : rows(n) {}
+	unsigned int size() const { return rows.size(); }
+	void resize(unsigned int n) { rows.assign(n, std::map<unsigned int, Field>()); }
+	void clear() { for (auto row = rows.begin(); row != rows.end(); row++) row->clear(); }
+	void set(unsigned int i, unsigned int j, Field value) { rows[i][j] = value; }
+	Field get(unsigned int i, unsigned int j) const {
+		auto it = rows[i].find(j);
+		return it == rows[i].end() ? 0 : it->second;
+	}
+	// Entries of row i by column
+	const std::map<unsigned int, Field>& row(unsigned int i) const { return rows[i]; }
+	// Gaussian elimination with partial pivoting, destroys the matrix, b is replaced by the solution
+	bool solve(std::vector<Field> &b) {
+		unsigned int n = rows.size();
+		std::vector< std::set<unsigned int> > colrows(n);
+		std::vector<unsigned int> perm(n);
+		std::vector<bool> done(n, false);
+		for (unsigned int i = 0; i < n; i++) {
+			for (auto entry = rows[i].begin(); entry != rows[i].end(); entry++) colrows[entry->first].insert(i);
+		}
+		for (unsigned int k = 0; k < n; k++) {
+			unsigned int pivot = n;
+			Field best = 0;
+			for (auto row = colrows[k].begin(); row != colrows[k].end(); row++) {
+				if (done[*row]) continue;
+				Field cur = std::abs(rows[*row][k]);
+				if ((pivot == n) || (cur > best)) { pivot = *row; best = cur; }
+			}
+			if ((pivot == n) || (best == 0)) return false;
+			done[pivot] = true;
+			perm[k] = pivot;
+			const std::map<unsigned int, Field> &prow = rows[pivot];
+			Field diag = prow.at(k);
+			for (auto row = colrows[k].begin(); row != colrows[k].end(); row++) {
+				if (done[*row]) continue;
+				std::map<unsigned int, Field> &cur = rows[*row];
+				Field f = cur[k]/diag;
+				cur.erase(k);
+				if (f == 0) continue;
+				for (auto entry = prow.upper_bound(k); entry != prow.end(); entry++) {
+					cur[entry->first] -= f*entry->second;
+					colrows[entry->first].insert(*row);
+				}
+				b[*row] -= f*b[pivot];
+			}
+		}
+		std::vector<Field> x(n);
+		for (unsigned int k = n; k-- > 0; ) {
+			const std::map<unsigned int, Field> &prow = rows[perm[k]];
+			Field sum = b[perm[k]];
+			for (auto entry = prow.upper_bound(k); entry != prow.end(); entry++) sum -= entry->second*x[entry->first];
+			x[k] = sum/prow.at(k);
+		}
+		b = x;
+		return true;
+	}
+};
+
+}
+
+#endif // VARINT_SPARSE_HPP
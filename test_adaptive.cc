@@ -0,0 +1,90 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include "libvarint.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint;
+using namespace varint::formula;
+
+typedef VectorSpace<double> S;
+
+E radius(double n) { return power(sum(power(var("x"), 2), power(var("y"), 2)), n/2); }
+
+// Kepler problem, unit mass and GM, the period of a = 1 is 2 pi
+E kepler() { return sum(product(num(0.5), sum(power(var("vx"), 2), power(var("vy"), 2))), radius(-1)); }
+
+double distance(const S &a, const S &b) { return max(fabs(a.q[0]-b.q[0]), fabs(a.q[1]-b.q[1])); }
+
+int main() {
+	// Eccentricity 0.9 from the perihelion at r = 0.1, the speed there is 19 times the one at the aphelion
+	double e = 0.9, period = 2*M_PI;
+	S phase0({ "x", "y" }, { "vx", "vy" }, { 1-e, 0.0 }, { 0.0, sqrt((1+e)/(1-e)) });
+	Formula<double> L(kepler());
+
+	// dt = r^(3/2) dtau: short steps near the perihelion, long ones in the slow part of the orbit
+	Formula<double> monitor(radius(1.5));
+	AdaptiveIntegrator<S> adaptive(L, 0, period, 0.05, phase0, monitor);
+	double e0 = adaptive.energy(), drift = 0, shortest = period, longest = 0;
+	for (auto iter = adaptive.begin(); iter != adaptive.end(); iter++) {
+		drift = max(drift, fabs(adaptive.energy()-e0));
+		if (adaptive.getSteps() > 0) {
+			shortest = min(shortest, adaptive.getStep());
+			longest = max(longest, adaptive.getStep());
+		}
+	}
+	double adaptive_err = distance(adaptive.getPosition(), phase0);
+	unsigned int steps = adaptive.getSteps();
+	cout<<"adaptive steps="<<steps<<" t="<<adaptive.getTime()<<" err="<<adaptive_err<<" drift="<<drift<<" longest/shortest>50 "<<(longest > 50*shortest)<<"\n";
+
+	// y = 0 at the aphelion (t = pi, x = -1.9) and back at the perihelion (t = 2 pi, x = 0.1)
+	AdaptiveIntegrator<S> crossings(L, 0, 1.25*period, 0.05, phase0, monitor);
+	crossings.addEvent(Formula<double>(var("y")));
+	for (auto iter = crossings.begin(); iter != crossings.end(); iter++);
+	const vector<AdaptiveIntegrator<S>::Event> &events = crossings.getEvents();
+	cout<<"events="<<events.size();
+	for (unsigned int k = 0; k < events.size(); k++) cout<<" t="<<events[k].t<<" x="<<events[k].state.q[0];
+	cout<<"\n";
+
+	// The same number of fixed steps
+	HamiltonIntegrator<S> fixed(L, 0, period, period/steps, phase0);
+	for (auto iter = fixed.begin(); iter != fixed.end(); iter++);
+	double fixed_err = distance(fixed.getPosition(), phase0);
+	cout<<"fixed steps="<<steps<<" err="<<fixed_err<<" adaptive more accurate "<<(adaptive_err*10 < fixed_err)<<"\n";
+
+	// Output every eighth of the period by interpolation, stopped at the first aphelion by a terminal event on y
+	crossings.setOutput(period/8);
+	crossings.addEvent(Formula<double>(var("y")), true);
+	for (auto iter = crossings.begin(); iter != crossings.end(); iter++) cout<<"t="<<iter.getTime()<<" "<<*iter<<"\n";
+	cout<<"stopped t="<<crossings.getTime()<<" events="<<crossings.getEvents().size()<<"\n";
+
+	// A range for takes end() once, before the terminal event moves the end time
+	unsigned int yielded = 0;
+	double x = 0;
+	for (auto &state : crossings) {
+		x = state.q[0];
+		if (++yielded > 100) break;
+	}
+	cout<<"range for yielded="<<yielded<<" x="<<x<<" stopped t="<<crossings.getTime()<<"\n";
+
+	// Settings go to the scheme: a unit rod pendulum under unit gravity, steps in dt = (2+y) dtau
+	S pendulum0({ "x", "y" }, { "vx", "vy" }, { sin(1.2), -cos(1.2) }, { 0.0, 0.0 });
+	Formula<double> particle(sum(product(num(0.5), sum(power(var("vx"), 2), power(var("vy"), 2))), product(num(-1), var("y"))));
+	AdaptiveIntegrator<S> rod(particle, 0, 10, 0.05, pendulum0, Formula<double>(sum(num(2), var("y"))));
+	rod.addConstraint(Formula<double>(sum(sum(power(var("x"), 2), power(var("y"), 2)), num(-1))));
+	rod.setNewtonTolerance(1e-13);
+	double violation = 0;
+	for (auto iter = rod.begin(); iter != rod.end(); iter++) {
+		const S &s = rod.getScheme().getPosition();
+		violation = max(violation, fabs(s.q[0]*s.q[0]+s.q[1]*s.q[1]-1));
+	}
+	cout<<"rod constraints="<<rod.numConstraints()<<" scheme="<<rod.getScheme().numConstraints()<<" steps="<<rod.getSteps()<<" |g|<1e-10 "<<(violation < 1e-10)<<"\n";
+	AdaptiveIntegrator<S> lower(L, 0, period, 0.05, phase0, monitor);
+	lower.setMixedPrecision(true);
+	for (auto iter = lower.begin(); iter != lower.end(); iter++);
+	cout<<"mixed "<<lower.getMixedPrecision()<<" scheme "<<lower.getScheme().getMixedPrecision()<<" mass bound>0 "<<(lower.getMassBound() > 0)<<" err<1e-9 "<<(distance(lower.getPosition(), adaptive.getPosition()) < 1e-9)<<"\n";
+	return 0;
+}
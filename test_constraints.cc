@@ -0,0 +1,80 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include "libvarint.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint;
+using namespace varint::formula;
+
+typedef VectorSpace<double> S;
+
+// Unit mass in the plane under unit gravity
+E particle(const string &x, const string &y) {
+	return sum(product(num(0.5), sum(power(var("v"+x), 2), power(var("v"+y), 2))), product(num(-1), var(y)));
+}
+
+// (x1-x0)^2 + (y1-y0)^2 - 1, a unit rod, the first end is fixed at the origin when x0 is empty
+E rod(const string &x0, const string &y0, const string &x1, const string &y1) {
+	E dx = x0.empty() ? var(x1) : difference(var(x1), var(x0)), dy = y0.empty() ? var(y1) : difference(var(y1), var(y0));
+	return sum(sum(power(move(dx), 2), power(move(dy), 2)), num(-1));
+}
+
+int main() {
+	double theta0 = 1.2, t1 = 10;
+	// Reference: the same pendulum in its angle, L = vt^2/2 + cos(t)
+	Formula<double> angular(sum(product(num(0.5), power(var("vt"), 2)), call(ELEMENTARY_COS, var("t"))));
+	GalerkinIntegrator<S, 3> reference(angular, 0, t1, 0.01, S({ "t" }, { "vt" }, { theta0 }, { 0.0 }));
+	for (auto iter = reference.begin(); iter != reference.end(); iter++);
+	double exact = reference.getPosition().q[0];
+
+	// Rigid rod: SHAKE/RATTLE with a large step
+	S phase0({ "x", "y" }, { "vx", "vy" }, { sin(theta0), -cos(theta0) }, { 0.0, 0.0 });
+	Formula<double> L(particle("x", "y"));
+	HamiltonIntegrator<S> rigid(L, 0, t1, 0.05, phase0);
+	rigid.addConstraint(Formula<double>(rod("", "", "x", "y")));
+	double e0 = 0, drift = 0, violation = 0, tangent = 0;
+	for (auto iter = rigid.begin(); iter != rigid.end(); iter++) {
+		const S &pos = rigid.getPosition();
+		if (iter.getTime() == 0) e0 = rigid.energy();
+		drift = max(drift, fabs(rigid.energy()-e0));
+		violation = max(violation, fabs(pos.q[0]*pos.q[0]+pos.q[1]*pos.q[1]-1));
+		tangent = max(tangent, fabs(pos.q[0]*pos.v[0]+pos.q[1]*pos.v[1]));
+	}
+	const S &end = rigid.getPosition();
+	double rigid_err = fabs(atan2(end.q[0], -end.q[1])-exact);
+	cout<<"constraints="<<rigid.numConstraints()<<" unknowns="<<rigid.getPattern().size()<<"\n";
+	cout<<"rigid h=0.05 err="<<rigid_err<<" |g|<1e-10 "<<(violation < 1e-10)<<" |Gv|<1e-10 "<<(tangent < 1e-10)<<" drift="<<drift<<"\n";
+
+	// A stiff penalty k/2 g^2 instead of the constraint, same step: the rod stretches and the angle is off
+	Formula<double> P(sum(particle("x", "y"), product(num(-0.5e4), power(rod("", "", "x", "y"), 2))));
+	HamiltonIntegrator<S> penalty(P, 0, t1, 0.05, phase0);
+	double stretch = 0;
+	for (auto iter = penalty.begin(); iter != penalty.end(); iter++) stretch = max(stretch, fabs(iter->q[0]*iter->q[0]+iter->q[1]*iter->q[1]-1));
+	double penalty_err = fabs(atan2(penalty.getPosition().q[0], -penalty.getPosition().q[1])-exact);
+	cout<<"penalty h=0.05 err="<<penalty_err<<" |g|>1e-5 "<<(stretch > 1e-5)<<" rigid more accurate "<<(rigid_err < penalty_err)<<"\n";
+
+	// Triple pendulum of rods, Galerkin with three constraints
+	vector<string> q = { "x1", "y1", "x2", "y2", "x3", "y3" }, v;
+	for (unsigned int i = 0; i < q.size(); i++) v.push_back("v"+q[i]);
+	Formula<double> chain(sum(sum(particle("x1", "y1"), particle("x2", "y2")), particle("x3", "y3")));
+	GalerkinIntegrator<S, 2> triple(chain, 0, 5, 0.05, S(q, v, { 1, 0, 2, 0, 2, -1 }, vector<double>(6, 0.0)));
+	triple.addConstraint(Formula<double>(rod("", "", "x1", "y1")));
+	triple.addConstraint(Formula<double>(rod("x1", "y1", "x2", "y2")));
+	triple.addConstraint(Formula<double>(rod("x2", "y2", "x3", "y3")));
+	e0 = triple.energy();
+	drift = violation = 0;
+	for (auto iter = triple.begin(); iter != triple.end(); iter++) {
+		const S &pos = triple.getPosition();
+		drift = max(drift, fabs(triple.energy()-e0));
+		for (unsigned int k = 0; k < 3; k++) {
+			double dx = pos.q[2*k] - (k ? pos.q[2*k-2] : 0), dy = pos.q[2*k+1] - (k ? pos.q[2*k-1] : 0);
+			violation = max(violation, fabs(dx*dx+dy*dy-1));
+		}
+	}
+	cout<<"triple unknowns="<<triple.getPattern().size()<<" |g|<1e-10 "<<(violation < 1e-10)<<" drift="<<drift<<"\n";
+	return 0;
+}
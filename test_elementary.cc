@@ -0,0 +1,65 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <cmath>
+#include <memory>
+#include "formula.hpp"
+#include "rational.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint;
+using namespace varint::formula;
+
+int main() {
+	map<const string, double> vals;
+	vals["q"] = 0.7;
+	vals["v"] = -1.3;
+	// Pendulum: v^2/2 + cos(q)
+	Formula<double> L(sum(product(num(0.5), power(var("v"), 2)), call(ELEMENTARY_COS, var("q"))));
+	E dq = L.derivative("q");
+	cout<<L<<" = "<<L.nevaluate(vals)<<" err="<<L.nevaluate(vals)-(0.5*1.69+cos(0.7))<<"\n";
+	cout<<"dL/dq = "<<dq<<" err="<<dq->nevaluate(vals)+sin(0.7)<<"\n";
+	// Chain rule: d/dq exp(sin(q^2)), names resolve through the registry
+	Formula<double> g(E(new Function<double>("exp", call(ELEMENTARY_SIN, power(var("q"), 2)))));
+	E dg = g.derivative("q");
+	cout<<"d/dq "<<g<<" = "<<dg<<" err="<<dg->nevaluate(vals)-exp(sin(0.49))*cos(0.49)*1.4<<"\n";
+	// atan2 partials
+	array<E, 2> parts = {{ var("q"), var("v") }};
+	Formula<double> angle(E(new Function<double, 2>(ELEMENTARY_ATAN2, parts)));
+	E dv = angle.derivative("v");
+	cout<<angle<<" err="<<angle.nevaluate(vals)-atan2(0.7, -1.3)<<" d/dv err="<<dv->nevaluate(vals)+0.7/(0.49+1.69)<<"\n";
+
+	// Batched evaluation against the scalar path
+	Formula<double> h(sum(product(call(ELEMENTARY_SQRT, sum(num(1), power(var("q"), 2))), call(ELEMENTARY_SIN, var("v"))), call(ELEMENTARY_ATAN, var("q"))));
+	h.bind(vector<string>({ "q", "v" }));
+	unsigned int n = 1000;
+	vector<double> values(2*n), out;
+	for (unsigned int k = 0; k < n; k++) {
+		values[k] = 0.01*k;
+		values[n+k] = 1.0-0.002*k;
+	}
+	h.bevaluate(values, n, out);
+	double err = 0;
+	for (unsigned int k = 0; k < n; k++) {
+		map<const string, double> point;
+		point["q"] = values[k];
+		point["v"] = values[n+k];
+		err = max(err, fabs(out[k]-h.nevaluate(point)));
+	}
+	cout<<"batch n="<<out.size()<<" err="<<err<<"\n";
+
+	// Identities
+	Formula<double> id(sum(sum(product(num(3), power(call(ELEMENTARY_SIN, var("q")), 2)), product(num(3), power(call(ELEMENTARY_COS, var("q")), 2))),
+		sum(call(ELEMENTARY_LOG, call(ELEMENTARY_EXP, var("v"))), sum(power(call(ELEMENTARY_SQRT, var("q")), 2), call(ELEMENTARY_COS, num(0))))));
+	cout<<id<<"\n";
+	id.simplifyObject();
+	cout<<id<<"\n";
+
+	// Rational fields go through the nearest double
+	Formula< Rational > r(unique_ptr< Element<Rational> >(new Function<Rational>(ELEMENTARY_SQRT, unique_ptr< Element<Rational> >(new Constant<Rational>(Rational(9, 4))))));
+	cout<<r<<" = "<<r.nevaluate(map<const string, Rational>())<<"\n";
+	return 0;
+}
@@ -0,0 +1,49 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include "formula.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint::formula;
+
+int main() {
+	map<const string, double> vals;
+	vals["x"] = 0.3;
+	vals["y"] = -1.7;
+	vals["z"] = 2.5;
+	// (x+y)^3*(x-2*y)*z
+	Formula<double> f(product(product(power(sum(var("x"), var("y")), 3), sum(var("x"), product(num(-2), var("y")))), var("z")));
+	double value = f.nevaluate(vals);
+	cout<<f<<" ops="<<Expander<double>::operations(*f.getRoot())<<"\n";
+	Formula<double> expanded(f);
+	expanded.expand();
+	cout<<expanded<<" ops="<<Expander<double>::operations(*expanded.getRoot())<<" diff="<<expanded.nevaluate(vals)-value<<"\n";
+	Formula<double> compressed(expanded);
+	compressed.compress();
+	cout<<compressed<<" ops="<<Expander<double>::operations(*compressed.getRoot())<<" diff="<<compressed.nevaluate(vals)-value<<"\n";
+	Formula<double> together(expanded);
+	together.together();
+	cout<<together<<" diff="<<together.nevaluate(vals)-value<<"\n";
+	// Over the term budget the power stays as it is
+	Formula<double> big(sum(power(sum(var("x"), var("y")), 20), product(var("x"), sum(var("y"), var("z")))));
+	big.expand(10);
+	cout<<big<<"\n";
+	Formula<double> threaded(f);
+	threaded.expand(DEFAULT_EXPAND_TERMS, DEFAULT_EXPAND_DEPTH, 2);
+	cout<<"threads=2 same="<<(threaded.stringify() == expanded.stringify())<<"\n";
+	// (x^3*t-t)/(x^2*t^2-t^2) = (x^2+x+1)/((x+1)*t)
+	Formula<double> r(frac(sum(product(power(var("x"), 3), var("t")), product(num(-1), var("t"))), sum(product(power(var("x"), 2), power(var("t"), 2)), product(num(-1), power(var("t"), 2)))));
+	cout<<r<<"\n";
+	r.simplifyObject();
+	cout<<r<<"\n";
+	// 1/(x-1) + 1/(x+1) + 2/(x^2-1) = 2/(x-1)
+	Formula<double> s(sum(sum(frac(num(1), sum(var("x"), num(-1))), frac(num(1), sum(var("x"), num(1)))), frac(num(2), sum(power(var("x"), 2), num(-1)))));
+	value = s.nevaluate(vals);
+	cout<<s<<"\n";
+	s.simplifyObject();
+	cout<<s<<" diff="<<s.nevaluate(vals)-value<<"\n";
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef VARINT_TEST_FORMULAS_HPP
+#define VARINT_TEST_FORMULAS_HPP
+
+#include <string>
+#include <memory>
+#include "formula.hpp"
+
+// Builders of double formulas shared by the tests
+typedef std::unique_ptr< varint::formula::Element<double> > E;
+
+inline E var(const std::string &name) { return E(new varint::formula::Variable<double>(name)); }
+inline E num(double value) { return E(new varint::formula::Constant<double>(value)); }
+inline E call(varint::formula::Elementary f, E arg) { return E(new varint::formula::Function<double>(f, std::move(arg))); }
+inline E power(E base, E n) { return E(new varint::formula::Power<double>(std::move(base), std::move(n))); }
+inline E power(E base, double n) { return power(std::move(base), num(n)); }
+inline E sum(E a, E b) {
+	std::unique_ptr< varint::formula::Sum<double> > ret(new varint::formula::Sum<double>());
+	ret->append(std::move(a));
+	ret->append(std::move(b));
+	return ret;
+}
+inline E product(E a, E b) {
+	std::unique_ptr< varint::formula::Product<double> > ret(new varint::formula::Product<double>());
+	ret->append(std::move(a));
+	ret->append(std::move(b));
+	return ret;
+}
+inline E difference(E a, E b) { return sum(std::move(a), product(num(-1), std::move(b))); }
+inline E frac(E a, E b) { return E(new varint::formula::Ratio<double>(std::move(a), std::move(b))); }
+
+#endif // VARINT_TEST_FORMULAS_HPP
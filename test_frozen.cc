@@ -0,0 +1,86 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include "formula.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint::formula;
+
+typedef unique_ptr< Variable<double> > V;
+
+int main() {
+	// Chain of pendulums, L = sum v_i^2/2 + cos(q_i) + cos(q_i - q_{i+1}), plus log(1+q_0^2/2) as a series
+	unsigned int links = 6;
+	vector<string> names;
+	for (unsigned int i = 0; i < links; i++) names.push_back("q"+to_string(i));
+	for (unsigned int i = 0; i < links; i++) names.push_back("v"+to_string(i));
+	E lagrangian = E(new TaylorSeries<double>(frac(power(num(-1), sum(var("n"), num(1))), var("n")), product(num(0.5), power(var("q0"), 2)), V(new Variable<double>("n")), 1));
+	for (unsigned int i = 0; i < links; i++) {
+		lagrangian = sum(move(lagrangian), sum(product(num(0.5), power(var("v"+to_string(i)), 2)), call(ELEMENTARY_COS, var("q"+to_string(i)))));
+		if (i+1 < links) lagrangian = sum(move(lagrangian), call(ELEMENTARY_COS, sum(var("q"+to_string(i)), product(num(-1), var("q"+to_string(i+1))))));
+	}
+	Formula<double> L(move(lagrangian));
+	FrozenFormula<double> frozen(L, names);
+	vector< E > partials;
+	for (unsigned int i = 0; i < names.size(); i++) partials.push_back(L.derivative(names[i]));
+
+	// Each thread walks its own trajectory, moving one coordinate per step so the caches are used.
+	// L itself is not frozen, the reference values are computed afterwards on this thread.
+	unsigned int threads = 4, steps = 200;
+	vector< vector< vector<double> > > points(threads), results(threads);
+	vector<thread> workers;
+	for (unsigned int t = 0; t < threads; t++) {
+		workers.push_back(thread([&, t]() {
+			Scratch<double> scratch = frozen.scratch();
+			vector<double> values(names.size()), gradient;
+			for (unsigned int i = 0; i < values.size(); i++) values[i] = 0.1*(i+t);
+			for (unsigned int s = 0; s < steps; s++) {
+				values[(s+t) % values.size()] += 0.01*(t+1);
+				double value = frozen.evaluate(values, scratch);
+				frozen.gradient(values, scratch, gradient);
+				points[t].push_back(values);
+				results[t].push_back(gradient);
+				results[t].back().push_back(value);
+			}
+		}));
+	}
+	for (auto worker = workers.begin(); worker != workers.end(); worker++) worker->join();
+	double err = 0;
+	for (unsigned int t = 0; t < threads; t++) {
+		for (unsigned int s = 0; s < steps; s++) {
+			map<const string, double> point;
+			for (unsigned int i = 0; i < names.size(); i++) point[names[i]] = points[t][s][i];
+			err = max(err, fabs(results[t][s][names.size()]-L.nevaluate(point)));
+			for (unsigned int i = 0; i < names.size(); i++) err = max(err, fabs(results[t][s][i]-partials[i]->nevaluate(point)));
+		}
+	}
+	cout<<"threads="<<threads<<" roots="<<(frozen.hasGradient() ? names.size()+1 : 1)<<" err="<<err<<"\n";
+
+	// Without a scratch every thread gets its own, copies share the trees
+	FrozenFormula<double> copy(frozen);
+	map<const string, double> point;
+	point["q0"] = 0.3;
+	point["v2"] = -0.5;
+	cout<<"copy err="<<fabs(copy.nevaluate(point)-L.nevaluate(point))<<"\n";
+
+	// Alternating formulas keep one cache each, a formula built where a freed one was does not see its values
+	Formula<double> sine(call(ELEMENTARY_SIN, var("x"))), cosine(call(ELEMENTARY_COS, var("x")));
+	FrozenFormula<double> fs(sine, { "x" }, false), fc(cosine, { "x" }, false);
+	err = 0;
+	for (unsigned int k = 0; k < 10; k++) {
+		double x = 0.1*k;
+		err = max(err, fabs(fs.evaluate({ x })-sin(x)) + fabs(fc.evaluate({ x })-cos(x)));
+	}
+	double reused = 0;
+	for (unsigned int k = 0; k < 2; k++) {
+		FrozenFormula<double> shortlived((k == 0) ? sine : cosine, { "x" }, false);
+		reused = shortlived.evaluate({ 0.5 });
+	}
+	cout<<"alternating err="<<err<<" rebuilt err="<<fabs(reused-cos(0.5))<<"\n";
+	return 0;
+}
@@ -0,0 +1,85 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <sstream>
+#include "libvarint.hpp"
+
+using namespace std;
+using namespace varint;
+using namespace varint::formula;
+
+typedef VectorSpace<double> S;
+
+// L = v^2/2 - x^2/2, x(t) = cos(t)
+unique_ptr< Element<double> > oscillator() {
+	unique_ptr< Product<double> > kinetic(new Product<double>());
+	unique_ptr< Product<double> > potential(new Product<double>());
+	unique_ptr< Sum<double> > sum(new Sum<double>());
+	kinetic->append(unique_ptr< Element<double> >(new Constant<double>(0.5)));
+	kinetic->append(unique_ptr< Element<double> >(new Power<double>(unique_ptr< Element<double> >(new Variable<double>("v")), unique_ptr< Element<double> >(new Constant<double>(2)))));
+	potential->append(unique_ptr< Element<double> >(new Constant<double>(-0.5)));
+	potential->append(unique_ptr< Element<double> >(new Power<double>(unique_ptr< Element<double> >(new Variable<double>("x")), unique_ptr< Element<double> >(new Constant<double>(2)))));
+	sum->append(move(kinetic));
+	sum->append(move(potential));
+	return move(sum);
+}
+
+unique_ptr< Element<double> > square(unique_ptr< Element<double> > el, double factor) {
+	unique_ptr< Product<double> > ret(new Product<double>());
+	ret->append(unique_ptr< Element<double> >(new Constant<double>(factor)));
+	ret->append(unique_ptr< Element<double> >(new Power<double>(move(el), unique_ptr< Element<double> >(new Constant<double>(2)))));
+	return move(ret);
+}
+
+// Chain of n unit masses connected by unit springs, the first one is attached to a wall
+unique_ptr< Element<double> > chain(unsigned int n, vector<string> &x, vector<string> &v) {
+	unique_ptr< Sum<double> > sum(new Sum<double>());
+	for (unsigned int i = 0; i < n; i++) {
+		ostringstream xs, vs;
+		xs<<"x"<<i;
+		vs<<"v"<<i;
+		x.push_back(xs.str());
+		v.push_back(vs.str());
+		sum->append(square(unique_ptr< Element<double> >(new Variable<double>(v[i])), 0.5));
+		unique_ptr< Sum<double> > spring(new Sum<double>());
+		spring->append(unique_ptr< Element<double> >(new Variable<double>(x[i])));
+		if (i > 0) {
+			unique_ptr< Product<double> > prev(new Product<double>());
+			prev->append(unique_ptr< Element<double> >(new Constant<double>(-1)));
+			prev->append(unique_ptr< Element<double> >(new Variable<double>(x[i-1])));
+			spring->append(move(prev));
+		}
+		sum->append(square(move(spring), -0.5));
+	}
+	return move(sum);
+}
+
+template<class Integrator> void run(const string &name, double t_step) {
+	Formula<double> L(oscillator());
+	S phase0(vector<string>(1, "x"), vector<string>(1, "v"), vector<double>(1, 1.0), vector<double>(1, 0.0));
+	Integrator integrator(L, 0.0, 10.0, t_step, phase0);
+	unsigned int steps = 0;
+	for (typename Integrator::iterator iter = integrator.begin(); iter != integrator.end(); iter++) steps++;
+	const S &phaset = integrator.getPosition();
+	cout<<name<<" h="<<t_step<<" steps="<<steps<<" "<<phaset<<" error="<<fabs(phaset.q[0]-cos(integrator.getTime()))<<" energy="<<integrator.energy()<<"\n";
+}
+
+int main() {
+	run< HamiltonIntegrator<S> >("midpoint", 0.1);
+	run< HamiltonIntegrator<S> >("midpoint", 0.01);
+	run< GalerkinIntegrator<S, 2> >("galerkin2", 0.1);
+	run< GalerkinIntegrator<S, 3> >("galerkin3", 0.5);
+	run< GalerkinIntegrator<S, 3, quadrature::GaussLobatto<4> > >("lobatto3", 0.5);
+	vector<string> x, v;
+	Formula<double> L(chain(40, x, v));
+	vector<double> q0(40, 0.0);
+	q0[0] = 1.0;
+	S phase0(x, v, q0, vector<double>(40, 0.0));
+	GalerkinIntegrator<S, 2> integrator(L, 0.0, 1.0, 0.1, phase0);
+	double e0 = integrator.energy();
+	for (GalerkinIntegrator<S, 2>::iterator iter = integrator.begin(); iter != integrator.end(); iter++);
+	cout<<"chain unknowns="<<integrator.getPattern().size()<<" nonzeros="<<integrator.getPattern().nonzeros()<<" colors="<<integrator.getPattern().numColors()<<" energy drift="<<fabs(integrator.energy()-e0)<<"\n";
+	return 0;
+}
@@ -0,0 +1,82 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <chrono>
+#include "libvarint.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint;
+using namespace varint::formula;
+
+typedef VectorSpace<double> S;
+
+// Fermi-Pasta-Ulam chain: unit masses, springs d^2/2 + d^4/4 between neighbours and to the walls
+E fpu(unsigned int n, vector<string> &q, vector<string> &v) {
+	unique_ptr< Sum<double> > ret(new Sum<double>());
+	for (unsigned int i = 0; i < n; i++) {
+		q.push_back("x"+to_string(i));
+		v.push_back("v"+to_string(i));
+		ret->append(product(num(0.5), power(var(v.back()), 2)));
+	}
+	for (unsigned int i = 0; i <= n; i++) {
+		E d = (i == 0) ? var(q[0]) : ((i == n) ? var(q[n-1]) : difference(var(q[i]), var(q[i-1])));
+		E e = d->clone();
+		ret->append(product(num(-0.5), power(move(d), 2)));
+		ret->append(product(num(-0.25), power(move(e), 4)));
+	}
+	return ret;
+}
+
+// Double pendulum in its angles, the mass matrix holds cos(a-b)
+E pendulum() {
+	E kinetic = sum(power(var("va"), 2), product(num(0.5), power(var("vb"), 2)));
+	E coupling = product(product(var("va"), var("vb")), call(ELEMENTARY_COS, difference(var("a"), var("b"))));
+	E potential = sum(product(num(2), call(ELEMENTARY_COS, var("a"))), call(ELEMENTARY_COS, var("b")));
+	return sum(sum(move(kinetic), move(coupling)), move(potential));
+}
+
+template<class Integrator> double run(Integrator &integrator) {
+	auto start = chrono::steady_clock::now();
+	for (auto iter = integrator.begin(); iter != integrator.end(); iter++);
+	return chrono::duration<double>(chrono::steady_clock::now()-start).count();
+}
+
+double difference(const S &a, const S &b) {
+	double ret = 0;
+	for (unsigned int i = 0; i < a.size(); i++) ret = max(ret, max(fabs(a.q[i]-b.q[i]), fabs(a.p[i]-b.p[i])));
+	return ret;
+}
+
+int main() {
+	const char *kinds[] = { "general", "quadratic", "constant" };
+	vector<string> q, v;
+	Formula<double> chain(fpu(200, q, v));
+	vector<double> q0(200, 0.0);
+	for (unsigned int i = 0; i < 200; i++) q0[i] = 0.5*sin(M_PI*(i+1)/201);
+	S chain0(q, v, q0, vector<double>(200, 0.0));
+	Formula<double> angles(pendulum());
+	S pendulum0({ "a", "b" }, { "va", "vb" }, { 1.0, -0.5 }, { 0.0, 0.3 });
+	Formula<double> relativistic(product(num(-1), power(difference(num(1), power(var("v"), 2)), 0.5)));
+	S particle0({ "x" }, { "v" }, { 0.0 }, { 0.5 });
+
+	// M = d^2L/dv^2 found symbolically
+	HamiltonIntegrator<S> fast(chain, 0, 20, 0.05, chain0), dp(angles, 0, 20, 0.05, pendulum0), rel(relativistic, 0, 1, 0.1, particle0);
+	cout<<"fpu "<<kinds[fast.getKinetic()]<<", double pendulum "<<kinds[dp.getKinetic()]<<", relativistic "<<kinds[rel.getKinetic()]<<"\n";
+
+	// Same trajectories as the Newton solve with the finite difference Jacobian
+	HamiltonIntegrator<S> slow(chain, 0, 20, 0.05, chain0), dp_newton(angles, 0, 20, 0.05, pendulum0);
+	slow.setMassSolve(false);
+	dp_newton.setMassSolve(false);
+	double fast_time = run(fast), slow_time = run(slow);
+	run(dp);
+	run(dp_newton);
+	run(rel);
+	cout<<"fpu 200 masses err<1e-7 "<<(difference(fast.getPosition(), slow.getPosition()) < 1e-7)<<" energy="<<fast.energy()<<" faster "<<(fast_time*1.5 < slow_time)<<"\n";
+	cout<<"double pendulum err<1e-9 "<<(difference(dp.getPosition(), dp_newton.getPosition()) < 1e-9)<<" "<<dp.getPosition()<<"\n";
+	cout<<"relativistic "<<rel.getPosition()<<"\n";
+	cerr<<"mass solve "<<fast_time<<"s newton "<<slow_time<<"s\n";
+	return 0;
+}
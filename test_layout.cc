@@ -0,0 +1,50 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <memory>
+#include "formula.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint;
+using namespace varint::formula;
+
+int main() {
+	cout<<"bytes element="<<sizeof(Element<double>)<<" constant="<<sizeof(Constant<double>)<<" variable="<<sizeof(Variable<double>)
+		<<" sum="<<sizeof(Sum<double>)<<" function="<<sizeof(Function<double>)<<"\n";
+
+	// Terms spill to the heap past COLLECTION_INLINE_TERMS and come back through erase and insert
+	SmallVector< unique_ptr<int>, 4 > terms;
+	for (int i = 0; i < 10; i++) terms.push_back(unique_ptr<int>(new int(i)));
+	terms.erase(terms.begin()+2, terms.begin()+8);
+	terms.insert(terms.begin()+1, unique_ptr<int>(new int(-1)));
+	SmallVector< unique_ptr<int>, 4 > moved(std::move(terms));
+	cout<<"terms";
+	for (auto term = moved.begin(); term != moved.end(); term++) cout<<" "<<**term;
+	cout<<" left="<<terms.size()<<"\n";
+
+	// Names are interned, equal names share one string
+	Variable<double> a("q0"), b(string("q")+"0");
+	cout<<"same symbol="<<(a.getSymbol() == b.getSymbol())<<" same string="<<(&a.getName() == &b.getName())<<"\n";
+
+	// A sum over 100 variables, past the inline word of Dependencies, evaluated incrementally
+	unsigned int n = 100;
+	vector<string> names;
+	unique_ptr< Sum<double> > sum(new Sum<double>());
+	for (unsigned int i = 0; i < n; i++) {
+		names.push_back("x"+to_string(i));
+		sum->append(product(num(i+1), call(ELEMENTARY_SIN, var(names.back()))));
+	}
+	Formula<double> f(move(sum));
+	f.bind(names);
+	vector<double> values(n, 0.5);
+	map<const string, double> point;
+	for (unsigned int i = 0; i < n; i++) point[names[i]] = 0.5;
+	double err = fabs(f.ievaluate(values)-f.nevaluate(point));
+	values[70] = point["x70"] = 1.5;
+	err = max(err, fabs(f.ievaluate(values)-f.nevaluate(point)));
+	cout<<"slots="<<n<<" err="<<err<<"\n";
+	return 0;
+}
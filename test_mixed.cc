@@ -0,0 +1,130 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <chrono>
+#include "libvarint.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint;
+using namespace varint::formula;
+
+typedef VectorSpace<double> S;
+
+// Chain of n unit pendulums in the angles a_i, the mass matrix holds cos(a_i - a_j)
+E chain(unsigned int n, vector<string> &q, vector<string> &v) {
+	unique_ptr< Sum<double> > ret(new Sum<double>());
+	for (unsigned int i = 0; i < n; i++) q.push_back("a"+to_string(i));
+	for (unsigned int i = 0; i < n; i++) v.push_back("v"+to_string(i));
+	for (unsigned int i = 0; i < n; i++) {
+		for (unsigned int j = 0; j < n; j++) {
+			double m = n - max(i, j);
+			ret->append(product(product(num(m/2), product(var(v[i]), var(v[j]))), call(ELEMENTARY_COS, difference(var(q[i]), var(q[j])))));
+		}
+		ret->append(product(num(n-i), call(ELEMENTARY_COS, var(q[i]))));
+	}
+	return ret;
+}
+
+// Fermi-Pasta-Ulam chain: unit masses, springs d^2/2 + d^4/4 between neighbours and to the walls
+E fpu(unsigned int n, vector<string> &q, vector<string> &v) {
+	unique_ptr< Sum<double> > ret(new Sum<double>());
+	for (unsigned int i = 0; i < n; i++) {
+		q.push_back("x"+to_string(i));
+		v.push_back("u"+to_string(i));
+		ret->append(product(num(0.5), power(var(v.back()), 2)));
+	}
+	for (unsigned int i = 0; i <= n; i++) {
+		E d = (i == 0) ? var(q[0]) : ((i == n) ? var(q[n-1]) : difference(var(q[i]), var(q[i-1])));
+		E e = d->clone();
+		ret->append(product(num(-0.5), power(move(d), 2)));
+		ret->append(product(num(-0.25), power(move(e), 4)));
+	}
+	return ret;
+}
+
+double difference(const S &a, const S &b) {
+	double ret = 0;
+	for (unsigned int i = 0; i < a.size(); i++) ret = max(ret, max(fabs(a.q[i]-b.q[i]), fabs(a.p[i]-b.p[i])));
+	return ret;
+}
+
+// The same run in double and with the matrices in float
+template<class Integrator> void compare(const string &name, Integrator &exact, Integrator &mixed, double tolerance) {
+	mixed.setMixedPrecision(true);
+	for (auto iter = exact.begin(); iter != exact.end(); iter++);
+	for (auto iter = mixed.begin(); iter != mixed.end(); iter++);
+	double err = difference(exact.getPosition(), mixed.getPosition());
+	cout<<name<<" err<"<<tolerance<<" "<<(err < tolerance)<<" mass bound<1e-5 "<<(mixed.getMassBound() < 1e-5)<<" solve error<1e-5 "<<(mixed.getSolveError() < 1e-5)<<"\n";
+	cerr<<name<<" err "<<err<<" mass bound "<<mixed.getMassBound()<<" solve error "<<mixed.getSolveError()<<"\n";
+}
+
+int main() {
+	// The gradient of a 4 link chain at 256 points in float, against double
+	unsigned int n = 4, points = 256;
+	vector<string> q, v;
+	Formula<double> L(chain(n, q, v));
+	vector<string> names(q);
+	names.insert(names.end(), v.begin(), v.end());
+	vector< Formula<double> > outputs;
+	for (unsigned int i = 0; i < 2*n; i++) outputs.push_back(Formula<double>(L.derivative(names[i])));
+	vector<const Element<double>*> roots;
+	for (unsigned int r = 0; r < outputs.size(); r++) roots.push_back(&outputs[r]);
+	EvaluationPlan<double> plan(roots, names);
+	vector<double> values(2*n*points), exact, bounds;
+	vector<float> lower;
+	for (unsigned int i = 0; i < 2*n; i++) {
+		for (unsigned int k = 0; k < points; k++) values[i*points+k] = sin(0.37*(i+1) + 0.011*k);
+	}
+	plan.bevaluate(values, points, exact);
+	plan.bevaluate(values, points, lower, &bounds);
+	bool holds = true;
+	double worst = 0, largest = 0;
+	for (unsigned int k = 0; k < exact.size(); k++) {
+		double err = fabs(exact[k] - lower[k]);
+		if (err > bounds[k]) holds = false;
+		worst = max(worst, err);
+		largest = max(largest, bounds[k]);
+	}
+	cout<<"float gradient at "<<points<<" points bound holds "<<holds<<" bound<1e-4 "<<(largest < 1e-4)<<" err>0 "<<(worst > 0)<<"\n";
+
+	// Timing only: float has twice the lanes of double
+	unsigned int calls = 200;
+	auto start = chrono::steady_clock::now();
+	for (unsigned int c = 0; c < calls; c++) plan.bevaluate(values, points, exact);
+	double doubles = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+	start = chrono::steady_clock::now();
+	for (unsigned int c = 0; c < calls; c++) plan.bevaluate(values, points, lower);
+	double floats = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+	cerr<<"double "<<doubles<<"s float "<<floats<<"s\n";
+
+	// Constant M, factored once in float
+	vector<string> xq, xv;
+	Formula<double> springs(fpu(50, xq, xv));
+	vector<double> x0(50, 0.0);
+	for (unsigned int i = 0; i < 50; i++) x0[i] = 0.5*sin(M_PI*(i+1)/51);
+	S springs0(xq, xv, x0, vector<double>(50, 0.0));
+	HamiltonIntegrator<S> fpu_exact(springs, 0, 10, 0.05, springs0), fpu_mixed(springs, 0, 10, 0.05, springs0);
+	compare("fpu", fpu_exact, fpu_mixed, 1e-9);
+
+	// M(q) of the chain evaluated by its plan in float at every step
+	q.clear();
+	v.clear();
+	Formula<double> links(chain(3, q, v));
+	S links0(q, v, { 0.5, -0.3, 0.2 }, { 0.0, 0.4, -0.1 });
+	HamiltonIntegrator<S> chain_exact(links, 0, 10, 0.05, links0), chain_mixed(links, 0, 10, 0.05, links0);
+	compare("pendulum chain", chain_exact, chain_mixed, 1e-9);
+
+	// Newton with the dense Jacobian, and the sparse one of the tridiagonal chain, factored in float
+	Formula<double> relativistic(difference(product(num(-1), power(difference(num(1), power(var("v"), 2)), 0.5)), product(num(0.5), power(var("x"), 2))));
+	S particle0({ "x" }, { "v" }, { 0.0 }, { 0.5 });
+	HamiltonIntegrator<S> rel_exact(relativistic, 0, 10, 0.1, particle0), rel_mixed(relativistic, 0, 10, 0.1, particle0);
+	compare("relativistic", rel_exact, rel_mixed, 1e-9);
+	HamiltonIntegrator<S> sparse_exact(springs, 0, 10, 0.05, springs0), sparse_mixed(springs, 0, 10, 0.05, springs0);
+	sparse_exact.setMassSolve(false);
+	sparse_mixed.setMassSolve(false);
+	compare("fpu sparse newton", sparse_exact, sparse_mixed, 1e-9);
+	return 0;
+}
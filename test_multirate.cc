@@ -0,0 +1,128 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <chrono>
+#include "libvarint.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint;
+using namespace varint::formula;
+
+typedef VectorSpace<double> S;
+
+// Exposes the phase space point to check the step map
+class Map : public MultirateIntegrator<S> {
+public:
+	Map(Formula<double> L, double t_step, S phase0, const vector<string> &fast, unsigned int substeps) : MultirateIntegrator<S>(L, 0, 1, t_step, phase0, fast, substeps) {}
+	void apply(const vector<double> &qp, vector<double> &out) {
+		unsigned int n = position.size();
+		for (unsigned int i = 0; i < n; i++) {
+			position.q[i] = qp[i];
+			position.p[i] = qp[n+i];
+			position.v[i] = 0;
+		}
+		step();
+		out = position.q;
+		out.insert(out.end(), position.p.begin(), position.p.end());
+	}
+};
+
+// Pendulum s with a stiff nonlinear spring f hanging from it
+E pendulum() {
+	E slow = sum(product(num(0.5), power(var("vs"), 2)), call(ELEMENTARY_COS, var("s")));
+	E fast = sum(product(num(0.5), power(var("vf"), 2)), product(num(-50), power(call(ELEMENTARY_SIN, difference(var("f"), var("s"))), 2)));
+	return sum(move(slow), move(fast));
+}
+
+// n slow particles in softened gravity, all pairs, a light particle on a stiff spring (omega = 100) to the first one
+E cluster(unsigned int n, vector<string> &q, vector<string> &v) {
+	vector< vector<string> > particles(n);
+	unique_ptr< Sum<double> > ret(new Sum<double>());
+	for (unsigned int i = 0; i < n; i++) {
+		q.push_back("x"+to_string(i));
+		v.push_back("v"+to_string(i));
+		particles[i] = { q.back() };
+		ret->append(product(num(0.5), power(var(v.back()), 2)));
+	}
+	E pair = frac(num(1), power(sum(power(difference(var("a"), var("b")), 2), num(1)), 0.5));
+	ret->append(E(new PairSum<double>(move(pair), particles, { "a" }, { "b" })));
+	q.push_back("f");
+	v.push_back("vf");
+	ret->append(product(num(0.5), power(var("vf"), 2)));
+	ret->append(product(num(-0.5e4), power(difference(var("f"), var(q[0])), 2)));
+	return ret;
+}
+
+template<class Integrator> double run(Integrator &integrator, double &drift) {
+	auto start = chrono::steady_clock::now();
+	double e0 = integrator.energy();
+	drift = 0;
+	for (typename Integrator::iterator iter = integrator.begin(); iter != integrator.end(); iter++) drift = max(drift, fabs(integrator.energy()-e0));
+	return chrono::duration<double>(chrono::steady_clock::now()-start).count();
+}
+
+int main() {
+	// One substep is the midpoint rule
+	S phase0({ "s", "f" }, { "vs", "vf" }, { 0.5, 0.6 }, { 0.0, 0.3 });
+	Formula<double> L(pendulum());
+	MultirateIntegrator<S> single(L, 0, 1, 0.05, phase0, { "f" }, 1);
+	HamiltonIntegrator<S> midpoint(L, 0, 1, 0.05, phase0);
+	for (auto iter = single.begin(); iter != single.end(); iter++);
+	for (auto iter = midpoint.begin(); iter != midpoint.end(); iter++);
+	double err = 0;
+	for (unsigned int i = 0; i < 2; i++) err = max(err, fabs(single.getPosition().q[i]-midpoint.getPosition().q[i]));
+	cout<<"slow: "<<single.getSlowLagrangian()<<"\nfast: "<<single.getFastLagrangian()<<"\n";
+	cout<<"one substep against midpoint err<1e-10 "<<(err < 1e-10)<<"\n";
+
+	// The step map (s, f, ps, pf) -> (s', f', ps', pf') preserves the symplectic form, J^T Omega J = Omega
+	Map map(L, 0.1, phase0, { "f" }, 8);
+	vector<double> x = { 0.5, 0.6, 0.2, -0.4 }, y0, y1, J(16);
+	map.apply(x, y0);
+	double h = 1e-6;
+	for (unsigned int j = 0; j < 4; j++) {
+		vector<double> xh(x), xl(x);
+		xh[j] += h;
+		xl[j] -= h;
+		map.apply(xh, y1);
+		map.apply(xl, y0);
+		for (unsigned int i = 0; i < 4; i++) J[i*4+j] = (y1[i]-y0[i])/(2*h);
+	}
+	double defect = 0;
+	for (unsigned int a = 0; a < 4; a++) {
+		for (unsigned int b = 0; b < 4; b++) {
+			double w = 0;
+			for (unsigned int i = 0; i < 2; i++) w += J[i*4+a]*J[(i+2)*4+b] - J[(i+2)*4+a]*J[i*4+b];
+			double omega = (a+2 == b) ? 1 : ((b+2 == a) ? -1 : 0);
+			defect = max(defect, fabs(w-omega));
+		}
+	}
+	cout<<"symplectic defect="<<(defect < 1e-6 ? "small" : "large")<<"\n";
+
+	// Fast scale 100 times the slow one: midpoint at the fast step against 20 substeps of a 20 times longer step
+	vector<string> q, v;
+	Formula<double> C(cluster(20, q, v));
+	vector<double> q0(21), v0(21, 0.0);
+	for (unsigned int i = 0; i < 20; i++) q0[i] = 1.5*i;
+	q0[20] = 0.01;
+	S cluster0(q, v, q0, v0);
+	double fine_drift, mr_drift;
+	HamiltonIntegrator<S> reference(C, 0, 1, 0.002, cluster0);
+	run(reference, fine_drift);
+	HamiltonIntegrator<S> fine(C, 0, 1, 0.005, cluster0);
+	double fine_time = run(fine, fine_drift);
+	MultirateIntegrator<S> multirate(C, 0, 1, 0.1, cluster0, { "f" }, 20);
+	double mr_time = run(multirate, mr_drift);
+	double fine_err = 0, mr_err = 0;
+	for (unsigned int i = 0; i < 21; i++) {
+		fine_err = max(fine_err, fabs(fine.getPosition().q[i]-reference.getPosition().q[i]));
+		mr_err = max(mr_err, fabs(multirate.getPosition().q[i]-reference.getPosition().q[i]));
+	}
+	cout<<"midpoint h=0.005 err="<<fine_err<<" drift="<<fine_drift<<"\n";
+	cout<<"multirate H=0.1 m=20 unknowns="<<multirate.getPattern().size()<<" err="<<mr_err<<" drift="<<mr_drift<<"\n";
+	cout<<"speedup="<<(fine_time/mr_time > 4 ? "yes" : "no")<<"\n";
+	cerr<<"midpoint "<<fine_time<<"s multirate "<<mr_time<<"s\n";
+	return 0;
+}
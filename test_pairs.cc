@@ -0,0 +1,123 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include "formula.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint::formula;
+
+// Softened gravity k/sqrt(|p_i-p_j|^2+1) in the plane, k is a parameter
+E gravity() {
+	E dx = sum(var("x1"), product(num(-1), var("x2"))), dy = sum(var("y1"), product(num(-1), var("y2")));
+	return frac(var("k"), power(sum(sum(power(move(dx), 2), power(move(dy), 2)), num(1)), 0.5));
+}
+
+// Sum over n >= 1 of k/(n^2+|p_i-p_j|^2)
+E screening() {
+	E dx = sum(var("x1"), product(num(-1), var("x2"))), dy = sum(var("y1"), product(num(-1), var("y2")));
+	E term = frac(var("k"), sum(power(var("n"), 2), sum(power(move(dx), 2), power(move(dy), 2))));
+	return E(new InfiniteSum<double>(move(term), unique_ptr< Variable<double> >(new Variable<double>("n"))));
+}
+
+vector< vector<string> > plane(unsigned int n) {
+	vector< vector<string> > ret(n);
+	for (unsigned int i = 0; i < n; i++) ret[i] = { "x"+to_string(i), "y"+to_string(i) };
+	return ret;
+}
+
+double seconds(chrono::steady_clock::time_point start) { return chrono::duration<double>(chrono::steady_clock::now()-start).count(); }
+
+int main() {
+	// Builder: terms are moved in, ids and parents assigned in one pass
+	auto start = chrono::steady_clock::now();
+	unique_ptr< Sum<double> > chain = generate_sum<double>(100000, [](unsigned int i) { return product(num(0.5), power(var("v"+to_string(i)), 2)); });
+	vector<E> terms;
+	for (unsigned int i = 0; i < 4; i++) terms.push_back(var("q"+to_string(i)));
+	Product<double> moved(move(terms));
+	cout<<"generated "<<chain->arity()<<" terms, moved "<<moved.arity()<<" left "<<(terms[0] == nullptr)<<"\n";
+	chain->simplifyObject();
+	cout<<"simplified "<<chain->arity()<<" terms in "<<(seconds(start) < 60 ? "time" : "too long")<<"\n";
+
+	// Pair sum against the explicit sum of its pairs
+	unsigned int n = 7;
+	PairSum<double> V(gravity(), plane(n), { "x1", "y1" }, { "x2", "y2" });
+	E explicit_sum = V.evaluate(map<const string, E>());
+	map<const string, double> point;
+	point["k"] = -1.5;
+	for (unsigned int i = 0; i < n; i++) {
+		point["x"+to_string(i)] = cos(1.3*i);
+		point["y"+to_string(i)] = sin(0.7*i*i);
+	}
+	cout<<V<<"\n";
+	double err = fabs(V.nevaluate(point)-explicit_sum->nevaluate(point));
+	vector<string> names = { "x0", "y3", "x6", "k" };
+	for (auto name = names.begin(); name != names.end(); name++) {
+		E d = V.derivative(*name), dd = d->derivative("y3");
+		err = max(err, fabs(d->nevaluate(point)-explicit_sum->derivative(*name)->nevaluate(point)));
+		err = max(err, fabs(dd->nevaluate(point)-explicit_sum->derivative(*name)->derivative("y3")->nevaluate(point)));
+	}
+	cout<<"pairs="<<explicit_sum->arity()<<" err="<<err<<"\n";
+	// Incremental evaluation through a formula
+	Formula<double> f(E(V.clone()));
+	vector<string> slots = { "k" };
+	vector<double> values = { point["k"] };
+	for (unsigned int i = 0; i < n; i++) {
+		slots.push_back("x"+to_string(i));
+		slots.push_back("y"+to_string(i));
+		values.push_back(point["x"+to_string(i)]);
+		values.push_back(point["y"+to_string(i)]);
+	}
+	f.bind(slots);
+	cout<<"ievaluate err="<<fabs(f.ievaluate(values)-V.nevaluate(point))<<"\n";
+
+	// Copies share the pair expression, each thread evaluates its own copy. A series in the pair is
+	// evaluated through ievaluate of its terms, which must not write the shared nodes.
+	PairSum<double> screened(screening(), plane(n), { "x1", "y1" }, { "x2", "y2" });
+	Formula<double> g(E(screened.clone()));
+	g.bind(slots);
+	unsigned int threads = 4, steps = 100;
+	vector< vector<double> > results(threads);
+	vector<thread> workers;
+	for (unsigned int t = 0; t < threads; t++) {
+		workers.push_back(thread([&, t]() {
+			Formula<double> mine(g);
+			vector<double> at(values);
+			for (unsigned int s = 0; s < steps; s++) {
+				at[1+(s % (2*n))] += 0.01*(t+1);
+				results[t].push_back(mine.ievaluate(at));
+			}
+		}));
+	}
+	for (auto worker = workers.begin(); worker != workers.end(); worker++) worker->join();
+	err = 0;
+	for (unsigned int t = 0; t < threads; t++) {
+		vector<double> at(values);
+		for (unsigned int s = 0; s < steps; s++) {
+			at[1+(s % (2*n))] += 0.01*(t+1);
+			map<const string, double> check;
+			for (unsigned int i = 0; i < slots.size(); i++) check[slots[i]] = at[i];
+			err = max(err, fabs(results[t][s]-screened.nevaluate(check)));
+		}
+	}
+	cout<<"threads="<<threads<<" err<1e-12 "<<(err < 1e-12)<<"\n";
+
+	// 10000 particles: the potential and a row of its gradient hold one pair expression each
+	start = chrono::steady_clock::now();
+	unsigned int many = 10000;
+	PairSum<double> large(gravity(), plane(many), { "x1", "y1" }, { "x2", "y2" });
+	vector<E> gradient;
+	for (unsigned int i = 0; i < many; i++) gradient.push_back(large.derivative("x"+to_string(i)));
+	map<const string, double> spread;
+	spread["k"] = 1;
+	for (unsigned int i = 0; i < many; i++) spread["x"+to_string(i)] = i;
+	double force = gradient[0]->nevaluate(spread), exact = 0;
+	for (unsigned int j = 1; j < many; j++) exact += double(j)/pow(double(j)*j+1, 1.5);
+	cout<<"particles="<<many<<" gradient="<<gradient.size()<<" err="<<fabs(force-exact)<<" "<<(seconds(start) < 60 ? "linear" : "too long")<<"\n";
+	return 0;
+}
@@ -0,0 +1,112 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <chrono>
+#include <stdexcept>
+#include "formula.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint::formula;
+
+unsigned int count(const Element<double> *el) {
+	unsigned int ret = 1;
+	for (unsigned int i = 0; i < el->arity(); i++) ret += count(el->getChild(i));
+	return ret;
+}
+
+// Chain of n unit pendulums in the angles a_i, the mass matrix holds cos(a_i - a_j)
+E chain(unsigned int n, vector<string> &names) {
+	unique_ptr< Sum<double> > ret(new Sum<double>());
+	for (unsigned int i = 0; i < n; i++) names.push_back("a"+to_string(i));
+	for (unsigned int i = 0; i < n; i++) names.push_back("v"+to_string(i));
+	for (unsigned int i = 0; i < n; i++) {
+		for (unsigned int j = 0; j < n; j++) {
+			double m = n - max(i, j);
+			ret->append(product(product(num(m/2), product(var(names[n+i]), var(names[n+j]))), call(ELEMENTARY_COS, difference(var(names[i]), var(names[j])))));
+		}
+		ret->append(product(num(n-i), call(ELEMENTARY_COS, var(names[i]))));
+	}
+	return ret;
+}
+
+int main() {
+	// Sums and products match up to the order of their terms
+	vector<const Element<double>*> roots;
+	Formula<double> a(sum(var("x"), var("y"))), b(sum(var("y"), var("x"))), c(product(call(ELEMENTARY_SIN, sum(var("x"), var("y"))), var("x")));
+	roots = { &a, &b, &c };
+	EvaluationPlan<double> small(roots, { "x", "y" });
+	vector<double> out;
+	small.evaluate({ 0.5, 0.25 }, out);
+	cout<<"nodes="<<small.getNodes()<<" instructions="<<small.getInstructions()<<" out="<<out[0]<<" "<<out[1]<<" "<<out[2]<<"\n";
+
+	// A variable without a slot is an error, not a 0
+	Formula<double> misspelled(sum(var("x"), var("z")));
+	roots = { &misspelled };
+	try {
+		EvaluationPlan<double> wrong(roots, { "x", "y" });
+		cout<<"unbound plan built\n";
+	} catch (const invalid_argument &e) {
+		cout<<"plan: "<<e.what()<<"\n";
+	}
+	try {
+		misspelled.bind(vector<string>({ "x", "y" }));
+		cout<<"unbound formula bound\n";
+	} catch (const invalid_argument &e) {
+		cout<<"bind: "<<e.what()<<"\n";
+	}
+
+	// L, its gradient and the energy of a 6 link chain
+	unsigned int n = 6;
+	vector<string> names;
+	Formula<double> L(chain(n, names));
+	vector< Formula<double> > outputs;
+	outputs.push_back(L);
+	for (unsigned int i = 0; i < 2*n; i++) outputs.push_back(Formula<double>(L.derivative(names[i])));
+	unique_ptr< Sum<double> > energy(new Sum<double>());
+	for (unsigned int i = 0; i < n; i++) energy->append(product(var(names[n+i]), outputs[1+n+i].getRoot()->clone()));
+	energy->append(product(num(-1), L.getRoot()->clone()));
+	outputs.push_back(Formula<double>(move(energy)));
+	roots.clear();
+	unsigned int largest = 0;
+	for (unsigned int r = 0; r < outputs.size(); r++) {
+		roots.push_back(&outputs[r]);
+		largest = max(largest, count(outputs[r].getRoot().get()));
+		outputs[r].bind(names);
+	}
+	EvaluationPlan<double> plan(roots, names);
+	cout<<"roots="<<plan.size()<<" nodes="<<plan.getNodes()<<" largest="<<largest<<" instructions="<<plan.getInstructions()<<" below largest "<<(plan.getInstructions() < largest)<<"\n";
+
+	// Same values as every formula on its own, also after changing one variable
+	vector<double> values(2*n);
+	for (unsigned int i = 0; i < 2*n; i++) values[i] = 0.1*(i+1);
+	double err = 0;
+	for (unsigned int pass = 0; pass < 2; pass++) {
+		if (pass) values[3] += 0.5;
+		plan.evaluate(values, out);
+		for (unsigned int r = 0; r < outputs.size(); r++) err = max(err, fabs(out[r]-outputs[r].ievaluate(values)));
+	}
+	cout<<"err<1e-12 "<<(err < 1e-12)<<" energy="<<out.back()<<"\n";
+
+	// All variables change at every call, as at the start of a Newton step
+	unsigned int calls = 2000;
+	double check = 0;
+	auto start = chrono::steady_clock::now();
+	for (unsigned int k = 0; k < calls; k++) {
+		for (unsigned int i = 0; i < 2*n; i++) values[i] += 1e-3;
+		for (unsigned int r = 0; r < outputs.size(); r++) check += outputs[r].ievaluate(values);
+	}
+	double separate = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+	start = chrono::steady_clock::now();
+	for (unsigned int k = 0; k < calls; k++) {
+		for (unsigned int i = 0; i < 2*n; i++) values[i] -= 1e-3;
+		plan.evaluate(values, out);
+		for (unsigned int r = 0; r < out.size(); r++) check -= out[r];
+	}
+	double together = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+	cout<<"plan faster "<<(together*2 < separate)<<"\n";
+	cerr<<"separate "<<separate<<"s plan "<<together<<"s check "<<check<<"\n";
+	return 0;
+}
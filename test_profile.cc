@@ -0,0 +1,71 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <memory>
+#include <algorithm>
+#define FORMULA_PROFILE
+#include "formula.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint::formula;
+
+typedef unique_ptr< Variable<double> > V;
+
+int main() {
+	// Pendulum with a slowly converging correction: v^2/2 + cos(q) + sum_n cos(n*q)/n^2
+	E series(new InfiniteSum<double>(frac(call(ELEMENTARY_COS, product(var("n"), var("q"))), power(var("n"), 2)), V(new Variable<double>("n"))));
+	const Element<double> *slow = series.get();
+	Formula<double> L(sum(sum(product(num(0.5), power(var("v"), 2)), call(ELEMENTARY_COS, var("q"))), move(series)));
+	map<const string, double> vals;
+	vals["q"] = 0.7;
+	vals["v"] = -1.3;
+
+	Profiler<double> profiler;
+	{
+		Profiler<double>::Use use(profiler);
+		for (unsigned int i = 0; i < 20; i++) L.nevaluate(vals);
+	}
+	stringstream report;
+	profiler.report(report, L, 4);
+	// The formula and its root sum come first, then the series
+	string line;
+	for (unsigned int i = 0; i < 3; i++) getline(report, line);
+	cout<<"root calls="<<profiler.get(&L).calls<<" series calls="<<profiler.get(slow).calls<<"\n";
+	cout<<"costliest term is the series: "<<(line.find("\\sum_{n=1}") != string::npos)<<"\n";
+	stringstream folded;
+	profiler.flamegraph(folded, L);
+	// The series is formula;sum;series, its children are never evaluated so all its time is its own
+	unsigned int lines = 0, well_formed = 0, series_stacks = 0, depth = 0;
+	long long series_ns = 0, largest = 0;
+	while (getline(folded, line)) {
+		lines++;
+		size_t space = line.rfind(' ');
+		if ((space == string::npos) || (atoll(line.c_str()+space+1) <= 0)) continue;
+		well_formed++;
+		long long ns = atoll(line.c_str()+space+1);
+		largest = max(largest, ns);
+		string frames = line.substr(0, space);
+		if (frames.substr(frames.rfind(';')+1).find("\\sum_{n=1}") == 0) {
+			series_stacks++;
+			depth = count(frames.begin(), frames.end(), ';')+1;
+			series_ns = ns;
+		}
+	}
+	cout<<"flamegraph lines="<<(lines > 0)<<" well formed="<<(lines == well_formed)<<" series stacks="<<series_stacks<<" depth="<<depth;
+	cout<<" series ns=self "<<(series_ns == (long long)(1e9*profiler.get(slow).seconds))<<" largest "<<(series_ns == largest)<<"\n";
+
+	// Incremental evaluation counts cache hits: only q changes, v^2/2 is never recomputed
+	profiler.clear();
+	L.bind(vector<string>({ "q", "v" }));
+	const Element<double> *kinetic = L.getRoot()->getChild(0)->getChild(0);
+	{
+		Profiler<double>::Use use(profiler);
+		for (unsigned int i = 0; i < 10; i++) L.ievaluate(vector<double>({ 0.1*i, -1.3 }));
+	}
+	cout<<*kinetic<<" calls="<<profiler.get(kinetic).calls<<" hits="<<profiler.get(kinetic).hits<<"\n";
+	return 0;
+}
@@ -0,0 +1,64 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <memory>
+#include "libvarint.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint;
+using namespace varint::formula;
+
+typedef unique_ptr< Variable<double> > V;
+typedef VectorSpace<double> S;
+
+int main() {
+	map<const string, double> vals;
+	vals["a"] = 1.5;
+	vals["x"] = 0.8;
+	// int_0^pi sin(t) dt = 2 with fixed rules and adaptively
+	DefiniteIntegral<double> s(call(ELEMENTARY_SIN, var("t")), V(new Variable<double>("t")), num(0), num(M_PI));
+	cout<<s<<"\n";
+	unsigned int rules[] = { 2, 4, 8 };
+	for (unsigned int i = 0; i < 3; i++) {
+		s.setRule(rules[i], 1);
+		double value = s.nevaluate(vals);
+		cout<<"  gauss"<<rules[i]<<" err="<<fabs(value-2)<<" evaluations="<<s.lastEvaluations()<<"\n";
+	}
+	s.setRule(0, DEFAULT_QUADRATURE_INTERVALS);
+	double value = s.nevaluate(vals, -12);
+	cout<<"  adaptive err="<<fabs(value-2)<<" evaluations="<<s.lastEvaluations()<<"\n";
+	// Endpoint singularity of the derivative, int_0^1 sqrt(t) dt = 2/3
+	DefiniteIntegral<double> r(call(ELEMENTARY_SQRT, var("t")), V(new Variable<double>("t")), num(0), num(1));
+	value = r.nevaluate(vals, -10);
+	cout<<r<<" err="<<fabs(value-2.0/3)<<" evaluations="<<r.lastEvaluations()<<"\n";
+
+	// F(a,x) = int_0^x exp(-a*t^2) dt, dF/dx by the Leibniz rule and dF/da under the integral
+	Formula<double> F(E(new DefiniteIntegral<double>(call(ELEMENTARY_EXP, product(num(-1), product(var("a"), power(var("t"), 2)))), V(new Variable<double>("t")), num(0), var("x"))));
+	E dx = F.derivative("x"), da = F.derivative("a");
+	double h = 1e-6;
+	map<const string, double> xp(vals), xm(vals), ap(vals), am(vals);
+	xp["x"] += h;
+	xm["x"] -= h;
+	ap["a"] += h;
+	am["a"] -= h;
+	cout<<F<<" = "<<F.nevaluate(vals)<<"\n";
+	cout<<"  d/dx = "<<dx<<" err="<<fabs(dx->nevaluate(vals)-(F.nevaluate(xp)-F.nevaluate(xm))/(2*h))<<"\n";
+	cout<<"  d/da err="<<fabs(da->nevaluate(vals)-(F.nevaluate(ap)-F.nevaluate(am))/(2*h))<<"\n";
+	// Incremental path, the integration variable gets its own slot
+	F.bind(vector<string>({ "a", "x" }));
+	cout<<"  ievaluate err="<<fabs(F.ievaluate(vector<double>({ 1.5, 0.8 }))-F.nevaluate(vals))<<"\n";
+
+	// Discrete action of a linear step of the pendulum L = v^2/2 + cos(q) against the adaptive integral over the step
+	Formula<double> L(sum(product(num(0.5), power(var("v"), 2)), call(ELEMENTARY_COS, var("q"))));
+	double q0 = 0.3, q1 = 0.45, t_step = 0.1;
+	GalerkinIntegrator<S, 1, quadrature::GaussLegendre<4> > galerkin(L, 0, 1, t_step, S({ "q" }, { "v" }, { q0 }, { 0 }));
+	map<const string, E> path;
+	path["q"] = sum(num(q0), product(num((q1-q0)/t_step), var("t")));
+	path["v"] = num((q1-q0)/t_step);
+	DefiniteIntegral<double> action(L.evaluate(path), V(new Variable<double>("t")), num(0), num(t_step));
+	cout<<"action="<<galerkin.action(vector<double>({ q1 }))<<" err="<<fabs(galerkin.action(vector<double>({ q1 }))-action.nevaluate(vals, -14))<<"\n";
+	return 0;
+}
@@ -0,0 +1,58 @@
+#include <iostream>
+#include <string>
+#include <map>
+#include <memory>
+#include <cmath>
+#include <stdexcept>
+#include "rational.hpp"
+#include "formula.hpp"
+
+using namespace std;
+using namespace varint;
+using namespace varint::formula;
+
+typedef Rational Q;
+
+int main() {
+	Q third(1, 3), sixth(1, 6);
+	cout<<third+sixth<<" "<<third*sixth<<" "<<third/sixth<<" "<<third-sixth<<"\n";
+	Q big(1, 1LL<<62);
+	cout<<big<<" small="<<big.isSmall()<<"\n";
+	big = big*big;
+	cout<<big<<" small="<<big.isSmall()<<"\n";
+	big = big*Q(1LL<<62)*Q(1LL<<62);
+	cout<<big<<" small="<<big.isSmall()<<"\n";
+	cout<<pow(Q(2, 3), Q(70))<<"\n";
+	cout<<pow(Q(2, 3), Q(-3))<<"\n";
+	cout<<Q::fromDouble(0.375)<<"\n";
+	// No value stands for a zero denominator or a non-finite double
+	const char *errors[] = { "1/0", "x/0", "0^-1", "inf", "nan" };
+	for (unsigned int k = 0; k < 5; k++) {
+		try {
+			Q value = (k == 0) ? Q(1, 0) : ((k == 1) ? third/Q(0) : ((k == 2) ? pow(Q(0), Q(-1)) : Q::fromDouble((k == 3) ? INFINITY : NAN)));
+			cout<<errors[k]<<" = "<<value<<"\n";
+		} catch (const domain_error &e) {
+			cout<<errors[k]<<": "<<e.what()<<"\n";
+		}
+	}
+
+	unique_ptr< Element<Q> > x(new Variable<Q>("x"));
+	unique_ptr< Element<Q> > half(new Ratio<Q>(unique_ptr< Element<Q> >(new Constant<Q>(1)), unique_ptr< Element<Q> >(new Constant<Q>(2))));
+	unique_ptr< Product<Q> > product(new Product<Q>());
+	product->append(unique_ptr< Element<Q> >(new Constant<Q>(Q(2, 3))));
+	product->append(unique_ptr< Element<Q> >(new Constant<Q>(Q(9, 4))));
+	product->append(move(x));
+	product->collectConstants();
+	cout<<*product<<"\n";
+	unique_ptr< Sum<Q> > sum(new Sum<Q>());
+	sum->append(move(product));
+	sum->append(move(half));
+	sum->append(unique_ptr< Element<Q> >(new Constant<Q>(Q(1, 3))));
+	sum->append(unique_ptr< Element<Q> >(new Constant<Q>(Q(1, 6))));
+	sum->collectConstants();
+	cout<<*sum<<"\n";
+	map<const string, Q> vals;
+	vals["x"] = Q(1, 7);
+	cout<<sum->nevaluate(vals)<<"\n";
+	return 0;
+}
@@ -0,0 +1,55 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include "formula.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint::formula;
+
+// (a^b)^c = a^(b*c)
+class PowerOfPower : public Rule<double> {
+public:
+	PowerOfPower() : Rule<double>({ KIND_POWER, KIND_POWER }) {}
+	virtual E apply(Element<double> &node) const {
+		Power<double> &outer = static_cast<Power<double>&>(node);
+		const Power<double> &inner = static_cast<const Power<double>&>(*outer.getExpression());
+		unique_ptr< Product<double> > exponent(new Product<double>());
+		exponent->append(inner.getPower()->clone());
+		exponent->append(outer.getPower()->clone());
+		return E(new Power<double>(inner.getExpression()->clone(), move(exponent)));
+	}
+};
+
+int main() {
+	// (x*y)^1 + 0/z + w*(2*3)
+	unique_ptr< Product<double> > xy(new Product<double>());
+	xy->append(var("x"));
+	xy->append(var("y"));
+	unique_ptr< Product<double> > inner(new Product<double>());
+	inner->append(num(2));
+	inner->append(num(3));
+	unique_ptr< Product<double> > scaled(new Product<double>());
+	scaled->append(var("w"));
+	scaled->append(move(inner));
+	unique_ptr< Sum<double> > sum(new Sum<double>());
+	sum->append(E(new Power<double>(move(xy), num(1))));
+	sum->append(E(new Ratio<double>(num(0), var("z"))));
+	sum->append(move(scaled));
+	Formula<double> f(move(sum));
+	cout<<f<<"\n";
+	f.simplifyObject();
+	cout<<f<<"\n";
+
+	// ((x^2)^3)/1 with a domain rule
+	Rewriter<double> rewriter;
+	rewriter.add(new PowerOfPower());
+	Formula<double> g(E(new Ratio<double>(E(new Power<double>(E(new Power<double>(var("x"), num(2))), num(3))), num(1))));
+	vector<unsigned int> found;
+	rewriter.getIndex().match(*g.getRoot(), found);
+	cout<<g<<" rules="<<rewriter.size()<<" candidates="<<found.size()<<"\n";
+	rewriter.simplify(g);
+	cout<<g<<"\n";
+	return 0;
+}
@@ -0,0 +1,61 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <memory>
+#include "formula.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint::formula;
+
+typedef unique_ptr< Variable<double> > V;
+
+// Richardson extrapolation assumes sums of the form S + c/n, it is left out for alternating series
+void report(InfiniteSum<double> &s, const map<const string, double> &vals, double exact, bool logarithmic) {
+	const char *names[] = { "none", "aitken", "richardson", "levin" };
+	Acceleration methods[] = { ACCELERATION_NONE, ACCELERATION_AITKEN, ACCELERATION_RICHARDSON, ACCELERATION_LEVIN };
+	for (unsigned int i = 0; i < 4; i++) {
+		if (!logarithmic && (methods[i] == ACCELERATION_RICHARDSON)) continue;
+		s.setAcceleration(methods[i]);
+		double value = s.nevaluate(vals);
+		cout<<"  "<<names[i]<<" terms="<<s.lastTerms()<<" err="<<fabs(value-exact)<<"\n";
+	}
+}
+
+int main() {
+	map<const string, double> vals;
+	vals["x"] = 0.9;
+	// sum 1/n^2 = pi^2/6
+	InfiniteSum<double> zeta(frac(num(1), power(var("n"), num(2))), V(new Variable<double>("n")));
+	cout<<zeta<<"\n";
+	report(zeta, vals, M_PI*M_PI/6, true);
+	// sum (-1)^(n+1)/n = log(2)
+	InfiniteSum<double> alternating(frac(power(num(-1), sum(var("n"), num(1))), var("n")), V(new Variable<double>("n")));
+	cout<<alternating<<"\n";
+	report(alternating, vals, log(2.0), false);
+	// log(1+x) = sum (-1)^(n+1)/n*x^n, the coefficients are computed once
+	TaylorSeries<double> taylor(frac(power(num(-1), sum(var("n"), num(1))), var("n")), var("x"), V(new Variable<double>("n")), 1);
+	cout<<taylor<<" = "<<taylor.nevaluate(vals)<<" terms="<<taylor.lastTerms()<<" err="<<fabs(taylor.nevaluate(vals)-log(1.9))<<"\n";
+	E dtaylor = taylor.derivative("x");
+	cout<<"d/dx err="<<fabs(dtaylor->nevaluate(vals)-1/1.9)<<"\n";
+	// Incremental evaluation inside a formula, with a tighter precision through nevaluate
+	Formula<double> f(product(var("x"), E(taylor.clone())));
+	f.bind(vector<string>({ "x" }));
+	double first = f.ievaluate(vector<double>({ 0.5 })), second = f.ievaluate(vector<double>({ 0.9 }));
+	cout<<"ievaluate err="<<fabs(first-0.5*log(1.5))<<" "<<fabs(second-0.9*log(1.9))<<" precise err="<<fabs(taylor.nevaluate(vals, -12)-log(1.9))<<"\n";
+	// Zero terms are skipped: two leading zeros, sum (n-1)(n-2)/n^4 = zeta(2) - 3 zeta(3) + 2 zeta(4)
+	InfiniteSum<double> leading(frac(product(sum(var("n"), num(-1)), sum(var("n"), num(-2))), power(var("n"), num(4))), V(new Variable<double>("n")));
+	double zeta3 = 1.2020569031595942, value = leading.nevaluate(vals);
+	cout<<"leading zeros "<<value<<" err<1e-6 "<<(fabs(value-(M_PI*M_PI/6-3*zeta3+pow(M_PI, 4)/45)) < 1e-6)<<"\n";
+	// Only every fourth power, (1+(-1)^n)(1+(-1)^(n(n-1)/2))/4 is 1 for n = 0 mod 4: sum x^(4k) = 1/(1-x^4)
+	E every = frac(product(sum(num(1), power(num(-1), var("n"))), sum(num(1), power(num(-1), product(product(var("n"), sum(var("n"), num(-1))), num(0.5))))), num(4));
+	TaylorSeries<double> fourth(move(every), var("x"), V(new Variable<double>("n")), 0);
+	value = fourth.nevaluate(vals);
+	cout<<"interleaved zeros "<<value<<" err<1e-6 "<<(fabs(value-1/(1-pow(0.9, 4))) < 1e-6)<<"\n";
+	// Finite sums add every term
+	FiniteSum<double> finite(var("n"), V(new Variable<double>("n")), 1, 100);
+	cout<<finite<<" = "<<finite.nevaluate(vals)<<"\n";
+	return 0;
+}
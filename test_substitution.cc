@@ -0,0 +1,78 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <cmath>
+#include <memory>
+#include "formula.hpp"
+#include "test_formulas.hpp"
+
+using namespace std;
+using namespace varint::formula;
+
+typedef shared_ptr< Element<double> > P;
+
+bool materialized(const Element<double> *el) { return static_cast<const Substitution<double>*>(el)->isMaterialized(); }
+
+int main() {
+	// f = x^2 sin(y) + x seen with x = y + 1
+	Formula<double> f(sum(product(power(var("x"), 2), call(ELEMENTARY_SIN, var("y"))), var("x")));
+	map<const string, P> bindings;
+	bindings["x"] = P(sum(var("y"), num(1)).release());
+	E view = f.substitute(bindings);
+	map<const string, E> values;
+	values["x"] = sum(var("y"), num(1));
+	E copy = f.evaluate(values);
+	cout<<*view<<" kind substitution "<<(view->getKind() == KIND_SUBSTITUTION)<<" materialized "<<materialized(view.get())<<"\n";
+
+	// Same value as the substituted copy, without building it
+	map<const string, double> at;
+	at["y"] = 0.5;
+	cout<<"nevaluate="<<view->nevaluate(at)<<" copy="<<copy->nevaluate(at)<<" materialized "<<materialized(view.get())<<"\n";
+
+	// Free variables are those of the bindings and the unbound ones of the source
+	set<string> names;
+	view->variables(names);
+	cout<<"variables";
+	for (auto name = names.begin(); name != names.end(); name++) cout<<" "<<*name;
+	cout<<"\n";
+
+	// d/dy of (y+1)^2 sin(y) + y + 1 = 2(y+1) sin(y) + (y+1)^2 cos(y) + 1
+	E dy = view->derivative("y");
+	double y = 0.5, exact = 2*(y+1)*sin(y) + (y+1)*(y+1)*cos(y) + 1;
+	cout<<"derivative err<1e-12 "<<(fabs(dy->nevaluate(at) - exact) < 1e-12)<<" dx="<<view->derivative("x")->nevaluate(at)<<"\n";
+
+	// A clone is another view on the same source, the source is never changed
+	E twin = view->clone();
+	cout<<"clone "<<*twin<<" materialized "<<materialized(twin.get())<<" source "<<f<<"\n";
+
+	// Binding builds the substituted tree once, ievaluate then follows the values
+	Formula<double> bound(view->clone());
+	bound.bind(vector<string>({ "y" }));
+	cout<<"bound materialized "<<materialized(bound.getRoot().get());
+	for (unsigned int k = 0; k < 3; k++) {
+		y = 0.25*k;
+		at["y"] = y;
+		cout<<" ievaluate("<<y<<")="<<bound.ievaluate({ y })<<" err<1e-12 "<<(fabs(bound.ievaluate({ y }) - copy->nevaluate(at)) < 1e-12);
+	}
+	cout<<"\n";
+	E materialized_twin = bound.getRoot()->clone();
+	cout<<"clone of materialized "<<materialized(materialized_twin.get())<<"\n";
+
+	// Simplifying a tree around the view materializes it and simplifies the substituted tree
+	map<const string, P> constant;
+	constant["x"] = P(num(1).release());
+	Formula<double> outer(product(f.substitute(constant), num(2)));
+	outer.simplifyObject();
+	bool found = false;
+	for (unsigned int i = 0; i < outer.getRoot()->arity(); i++) {
+		const Element<double> *inner = outer.getRoot()->getChild(i);
+		if (inner->getKind() == KIND_SUBSTITUTION) found = materialized(inner);
+	}
+	cout<<"through parent materialized "<<found<<" value="<<outer.nevaluate(at)<<"\n";
+	Formula<double> alone(f.substitute(bindings));
+	alone.simplifyObject();
+	cout<<"through formula "<<alone<<" materialized "<<materialized(alone.getRoot().get())<<" source "<<f<<"\n";
+	return 0;
+}